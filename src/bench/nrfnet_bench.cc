@@ -0,0 +1,531 @@
+// Pushes synthetic IP traffic through two complete nrfnet stacks joined by a
+// simulated radio medium and reports goodput, latency percentiles and CPU
+// time per byte.
+//
+//     nrfnet_bench --duration_s=10 --packet_size=512 --rate_pps=50 --loss=0.01
+//
+// Each stack is the one the daemon runs in mesh mode: a TunnelInterface on
+// one end of a SOCK_SEQPACKET socketpair standing in for the tun device, the
+// header and payload compression, fragmentation, error correction and ack
+// layers, and a MeshRadioInterface on a SimulatedRadio. Both stacks run their
+// own event loop thread in real time.
+//
+// --rate_pps=0 sends nothing after discovery, for the CPU use and loop
+// wakeups of idle nodes.
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ack_handling_layer.h"
+#include "event_loop.h"
+#include "forward_error_correction_layer.h"
+#include "header_compression_layer.h"
+#include "latency_trace.h"
+#include "layer_stack.h"
+#include "log.h"
+#include "mesh_radio_interface.h"
+#include "message_fragmentation_layer.h"
+#include "nrftime.h"
+#include "payload_compression_layer.h"
+#include "simulated_radio.h"
+#include "tunnel_interface.h"
+
+Logger::LogPrinter logger;
+
+namespace
+{
+    struct BenchOptions
+    {
+        uint64_t duration_s = 10;
+        size_t packet_size = 512;
+        uint64_t rate_pps = 50;
+        uint8_t data_rate = nerfnet::RADIO_2MBPS;
+        uint8_t channel = 76;
+        uint64_t poll_interval_us = 1000;
+        bool ack = false;
+        uint32_t ack_window = 16;
+        uint32_t ack_max_retransmits = 30;
+        uint32_t ack_bounded_retransmits = 4;
+        uint32_t ack_real_time_deadline_ms = 150;
+        // The DSCP the synthetic packets are marked with, 46 (EF) makes them RealTime
+        uint8_t dscp = 0;
+        bool payload_compression = true;
+        bool fec = true;
+        uint64_t discovery_timeout_s = 30;
+        nerfnet::SimulatedMediumConfig medium;
+    };
+
+    // The bytes of IP and UDP header in front of every synthetic packet.
+    constexpr size_t kHeaderSize = 20 + 8;
+
+    // The bench's own fields at the start of the UDP payload.
+    struct __attribute__((packed)) ProbeHeader
+    {
+        uint32_t sequence;
+        uint64_t sent_us;
+    };
+
+    constexpr size_t kMinPacketSize = kHeaderSize + sizeof(ProbeHeader);
+
+    // The delay between starting the two nodes.
+    constexpr uint64_t kStartStaggerUs = 500000;
+
+    void Usage(const char *program)
+    {
+        fprintf(stderr,
+                "Usage: %s [--duration_s=N] [--packet_size=BYTES] [--rate_pps=N]\n"
+                "          [--data_rate=0(1M)|1(2M)|2(250K)] [--channel=N] [--poll_interval_us=N]\n"
+                "          [--loss=P] [--bit_error_rate=P] [--collisions=0|1] [--seed=N]\n"
+                "          [--ack=0|1] [--ack_window=N] [--ack_max_retransmits=N]\n"
+                "          [--ack_bounded_retransmits=N] [--ack_real_time_deadline_ms=N] [--dscp=N]\n"
+                "          [--payload_compression=0|1] [--fec=0|1] [--discovery_timeout_s=N]\n",
+                program);
+        exit(1);
+    }
+
+    BenchOptions ParseOptions(int argc, char **argv)
+    {
+        BenchOptions options;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            size_t equals = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || equals == std::string::npos)
+            {
+                Usage(argv[0]);
+            }
+            std::string key = arg.substr(2, equals - 2);
+            std::string value = arg.substr(equals + 1);
+            if (key == "duration_s")
+                options.duration_s = std::stoull(value);
+            else if (key == "packet_size")
+                options.packet_size = std::stoul(value);
+            else if (key == "rate_pps")
+                options.rate_pps = std::stoull(value);
+            else if (key == "data_rate")
+                options.data_rate = std::stoi(value);
+            else if (key == "channel")
+                options.channel = std::stoi(value);
+            else if (key == "poll_interval_us")
+                options.poll_interval_us = std::stoull(value);
+            else if (key == "loss")
+                options.medium.loss_rate = std::stod(value);
+            else if (key == "bit_error_rate")
+                options.medium.bit_error_rate = std::stod(value);
+            else if (key == "collisions")
+                options.medium.collisions = std::stoi(value) != 0;
+            else if (key == "seed")
+                options.medium.seed = std::stoul(value);
+            else if (key == "ack")
+                options.ack = std::stoi(value) != 0;
+            else if (key == "ack_window")
+                options.ack_window = std::stoul(value);
+            else if (key == "ack_max_retransmits")
+                options.ack_max_retransmits = std::stoul(value);
+            else if (key == "ack_bounded_retransmits")
+                options.ack_bounded_retransmits = std::stoul(value);
+            else if (key == "ack_real_time_deadline_ms")
+                options.ack_real_time_deadline_ms = std::stoul(value);
+            else if (key == "dscp")
+                options.dscp = std::stoi(value);
+            else if (key == "payload_compression")
+                options.payload_compression = std::stoi(value) != 0;
+            else if (key == "fec")
+                options.fec = std::stoi(value) != 0;
+            else if (key == "discovery_timeout_s")
+                options.discovery_timeout_s = std::stoull(value);
+            else
+                Usage(argv[0]);
+        }
+        CHECK(options.packet_size >= kMinPacketSize && options.packet_size <= PACKET_BUFFER_MAX_FRAME_SIZE,
+              "packet_size must be between %zu and %d", kMinPacketSize, PACKET_BUFFER_MAX_FRAME_SIZE);
+        CHECK(options.dscp < 64, "dscp must be below 64");
+        return options;
+    }
+
+    uint16_t Ipv4Checksum(const uint8_t *header, size_t length)
+    {
+        uint32_t sum = 0;
+        for (size_t i = 0; i + 1 < length; i += 2)
+        {
+            sum += (header[i] << 8) | header[i + 1];
+        }
+        while (sum >> 16)
+        {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return static_cast<uint16_t>(~sum);
+    }
+
+    // Builds an IPv4/UDP packet from 10.0.0.1 to 10.0.0.2 like the tunnel
+    // would read, marked with `dscp`, with the probe header and a counting
+    // pattern as payload.
+    void BuildPacket(std::vector<uint8_t> &packet, uint32_t sequence, uint8_t dscp)
+    {
+        uint8_t *ip = packet.data();
+        uint16_t total_length = static_cast<uint16_t>(packet.size());
+        std::memset(ip, 0, kHeaderSize);
+        ip[0] = 0x45;
+        ip[1] = dscp << 2;
+        ip[2] = total_length >> 8;
+        ip[3] = total_length & 0xFF;
+        ip[4] = sequence >> 8;
+        ip[5] = sequence & 0xFF;
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        const uint8_t addresses[8] = {10, 0, 0, 1, 10, 0, 0, 2};
+        std::memcpy(&ip[12], addresses, sizeof(addresses));
+        uint16_t checksum = Ipv4Checksum(ip, 20);
+        ip[10] = checksum >> 8;
+        ip[11] = checksum & 0xFF;
+
+        uint8_t *udp = ip + 20;
+        uint16_t udp_length = total_length - 20;
+        udp[0] = 0x9C;
+        udp[1] = 0x40;
+        udp[2] = 0x9C;
+        udp[3] = 0x40;
+        udp[4] = udp_length >> 8;
+        udp[5] = udp_length & 0xFF;
+
+        ProbeHeader probe = {sequence, nerfnet::TimeNowUs()};
+        std::memcpy(udp + 8, &probe, sizeof(probe));
+        for (size_t i = kMinPacketSize; i < packet.size(); i++)
+        {
+            packet[i] = static_cast<uint8_t>(i);
+        }
+    }
+
+    uint64_t ProcessCpuTimeUs()
+    {
+        struct rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+        return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+               usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+
+    // One node: a layer stack on a simulated radio, fed through a socketpair.
+    class BenchNode
+    {
+    public:
+        BenchNode(nerfnet::SimulatedMedium &medium, const BenchOptions &options)
+            : radio_(medium),
+              sockets_(MakeSocketPair()),
+              tunnel_(sockets_[0]),
+              ack_(options.ack_window),
+              mesh_(radio_, sockets_[0], 0x55, 0x66, options.channel, options.poll_interval_us,
+                    0, 0, false, options.data_rate),
+              stack_(tunnel_, header_compression_, payload_compression_, fragmentation_, fec_, ack_, mesh_)
+        {
+            ack_.Enable(options.ack);
+            ack_.SetMaxRetransmits(options.ack_max_retransmits);
+            ack_.SetBoundedRetransmits(options.ack_bounded_retransmits);
+            ack_.SetRealTimeDeadlineUs(options.ack_real_time_deadline_ms * 1000ULL);
+            if (options.ack)
+            {
+                fragmentation_.SetReassemblyLimits(AckLayer::kMaxFramesInFlight, ack_.RetransmitHorizonUs());
+                fec_.SetAckLayer(&ack_);
+            }
+            payload_compression_.Enable(options.payload_compression);
+            fec_.Enable(options.fec);
+            loop_.AddLayer(&tunnel_);
+            loop_.AddLayer(&fragmentation_);
+            loop_.AddLayer(&ack_);
+            loop_.AddLayer(&mesh_);
+        }
+
+        ~BenchNode()
+        {
+            Stop();
+            // Wakes the tunnel thread out of read() so the tunnel can join it
+            shutdown(sockets_[0], SHUT_RDWR);
+            close(sockets_[1]);
+        }
+
+        void Start()
+        {
+            tunnel_.Start();
+            loop_thread_ = std::thread([this]
+                                       { loop_.Run(); });
+        }
+
+        void Stop()
+        {
+            loop_.Stop();
+            if (loop_thread_.joinable())
+            {
+                loop_thread_.join();
+            }
+        }
+
+        // The application's end of the tunnel.
+        int app_fd() const { return sockets_[1]; }
+
+        uint64_t wakeups() const { return loop_.Wakeups(); }
+
+    private:
+        static std::vector<int> MakeSocketPair()
+        {
+            int fds[2];
+            CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0,
+                  "Failed to create socketpair: %s (%d)", strerror(errno), errno);
+            return {fds[0], fds[1]};
+        }
+
+        nerfnet::SimulatedRadio radio_;
+        std::vector<int> sockets_;
+        nerfnet::TunnelInterface tunnel_;
+        HeaderCompressionLayer header_compression_;
+        PayloadCompressionLayer payload_compression_;
+        MessageFragmentationLayer fragmentation_;
+        ForwardErrorCorrectionLayer fec_;
+        AckLayer ack_;
+        nerfnet::MeshRadioInterface mesh_;
+        LayerStack<nerfnet::TunnelInterface, HeaderCompressionLayer, PayloadCompressionLayer,
+                   MessageFragmentationLayer, ForwardErrorCorrectionLayer, AckLayer, nerfnet::MeshRadioInterface>
+            stack_;
+        nerfnet::EventLoop loop_;
+        std::thread loop_thread_;
+    };
+
+    // Collects the packets coming out of the receiving node.
+    class Receiver
+    {
+    public:
+        explicit Receiver(int fd)
+            : fd_(fd), thread_(&Receiver::Loop, this)
+        {
+        }
+
+        ~Receiver()
+        {
+            Stop();
+        }
+
+        void Stop()
+        {
+            running_ = false;
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+        }
+
+        // Starts counting, packets with a lower sequence number are warm up probes.
+        void Measure(uint32_t first_sequence)
+        {
+            first_sequence_ = first_sequence;
+            measuring_ = true;
+        }
+
+        // True once any packet made it through the stacks.
+        bool connected() const { return warmup_received_ > 0 || received_ > 0; }
+        uint64_t received() const { return received_; }
+        uint64_t bytes() const { return bytes_; }
+        uint64_t corrupted() const { return corrupted_; }
+        uint64_t reordered() const { return reordered_; }
+        const nerfnet::LatencyHistogram &latency() const { return latency_; }
+
+    private:
+        void Loop()
+        {
+            std::vector<uint8_t> packet(PACKET_BUFFER_MAX_FRAME_SIZE);
+            uint32_t last_sequence = 0;
+            while (running_)
+            {
+                struct pollfd poll_fd = {fd_, POLLIN, 0};
+                if (poll(&poll_fd, 1, 100) <= 0)
+                {
+                    continue;
+                }
+                ssize_t size = recv(fd_, packet.data(), packet.size(), 0);
+                if (size < static_cast<ssize_t>(kMinPacketSize))
+                {
+                    continue;
+                }
+                ProbeHeader probe;
+                std::memcpy(&probe, packet.data() + kHeaderSize, sizeof(probe));
+                uint64_t now_us = nerfnet::TimeNowUs();
+                if (!measuring_ || probe.sequence < first_sequence_)
+                {
+                    warmup_received_++;
+                    continue;
+                }
+
+                bool intact = Ipv4Checksum(packet.data(), 20) == 0;
+                for (ssize_t i = kMinPacketSize; intact && i < size; i++)
+                {
+                    intact = packet[i] == static_cast<uint8_t>(i);
+                }
+                if (!intact)
+                {
+                    corrupted_++;
+                    continue;
+                }
+                if (probe.sequence < last_sequence)
+                {
+                    reordered_++;
+                }
+                last_sequence = probe.sequence;
+                latency_.Record(now_us - probe.sent_us);
+                received_++;
+                bytes_ += size;
+            }
+        }
+
+        int fd_;
+        std::atomic<bool> running_{true};
+        std::atomic<bool> measuring_{false};
+        std::atomic<uint32_t> first_sequence_{0};
+        std::atomic<uint64_t> warmup_received_{0};
+        std::atomic<uint64_t> received_{0};
+        std::atomic<uint64_t> bytes_{0};
+        std::atomic<uint64_t> corrupted_{0};
+        std::atomic<uint64_t> reordered_{0};
+        nerfnet::LatencyHistogram latency_;
+        std::thread thread_;
+    };
+
+    void Send(int fd, std::vector<uint8_t> &packet, uint32_t sequence, uint8_t dscp)
+    {
+        BuildPacket(packet, sequence, dscp);
+        if (send(fd, packet.data(), packet.size(), 0) < 0)
+        {
+            LOGE("Failed to send: %s (%d)", strerror(errno), errno);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options = ParseOptions(argc, argv);
+
+    nerfnet::SimulatedMedium medium(options.medium);
+    BenchNode sender(medium, options);
+    BenchNode receiver_node(medium, options);
+    Receiver receiver(receiver_node.app_fd());
+    // Nodes started together send their discovery packets in lockstep and
+    // collide every time, so give them different phases
+    receiver_node.Start();
+    nerfnet::SleepUs(kStartStaggerUs);
+    sender.Start();
+
+    // Probe until the nodes have found each other and a packet gets through
+    std::vector<uint8_t> packet(options.packet_size);
+    uint32_t sequence = 0;
+    uint64_t discovery_start_us = nerfnet::TimeNowUs();
+    LOGI("Waiting for the nodes to discover each other");
+    while (!receiver.connected())
+    {
+        CHECK(nerfnet::TimeNowUs() - discovery_start_us < options.discovery_timeout_s * 1000000,
+              "Nodes did not connect within %llu s", static_cast<unsigned long long>(options.discovery_timeout_s));
+        Send(sender.app_fd(), packet, sequence++, options.dscp);
+        nerfnet::SleepUs(200000);
+    }
+    LOGI("Connected after %.1f s", (nerfnet::TimeNowUs() - discovery_start_us) / 1e6);
+    // Let the probes drain so they don't queue in front of the measured traffic
+    nerfnet::SleepUs(500000);
+
+    // Offer a constant packet rate for the measured window, a rate of zero
+    // measures the idle nodes
+    uint32_t first_sequence = sequence;
+    receiver.Measure(first_sequence);
+    uint64_t start_us = nerfnet::TimeNowUs();
+    uint64_t cpu_start_us = ProcessCpuTimeUs();
+    uint64_t sender_wakeups = sender.wakeups();
+    uint64_t receiver_wakeups = receiver_node.wakeups();
+    uint64_t end_us = start_us + options.duration_s * 1000000;
+    if (options.rate_pps == 0)
+    {
+        nerfnet::SleepUs(end_us - start_us);
+    }
+    else
+    {
+        uint64_t interval_us = 1000000 / options.rate_pps;
+        for (uint64_t next_us = start_us; next_us < end_us; next_us += interval_us)
+        {
+            uint64_t now_us = nerfnet::TimeNowUs();
+            if (next_us > now_us)
+            {
+                nerfnet::SleepUs(next_us - now_us);
+            }
+            Send(sender.app_fd(), packet, sequence++, options.dscp);
+        }
+    }
+    uint64_t sent = sequence - first_sequence;
+
+    // Give packets still in flight a moment to arrive
+    nerfnet::SleepUs(2000000);
+    uint64_t elapsed_us = nerfnet::TimeNowUs() - start_us;
+    uint64_t cpu_us = ProcessCpuTimeUs() - cpu_start_us;
+    sender_wakeups = sender.wakeups() - sender_wakeups;
+    receiver_wakeups = receiver_node.wakeups() - receiver_wakeups;
+    sender.Stop();
+    receiver_node.Stop();
+    receiver.Stop();
+
+    nerfnet::SimulatedMediumStats medium_stats = medium.stats();
+    const nerfnet::LatencyHistogram &latency = receiver.latency();
+    uint64_t bytes = receiver.bytes();
+    double measured_s = options.duration_s;
+
+    printf("\n");
+    printf("packets sent        %llu x %zu bytes at %llu pps\n", static_cast<unsigned long long>(sent),
+           options.packet_size, static_cast<unsigned long long>(options.rate_pps));
+    printf("packets received    %llu (%.2f%% lost, %llu corrupted, %llu reordered)\n",
+           static_cast<unsigned long long>(receiver.received()),
+           sent ? 100.0 * (sent - std::min<uint64_t>(sent, receiver.received())) / sent : 0.0,
+           static_cast<unsigned long long>(receiver.corrupted()),
+           static_cast<unsigned long long>(receiver.reordered()));
+    printf("goodput             %.1f kbit/s\n", bytes * 8 / measured_s / 1000.0);
+    printf("latency us          p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+           static_cast<unsigned long long>(latency.ValueAtPercentile(50.0)),
+           static_cast<unsigned long long>(latency.ValueAtPercentile(99.0)),
+           static_cast<unsigned long long>(latency.ValueAtPercentile(99.9)),
+           static_cast<unsigned long long>(latency.max()));
+    printf("cpu                 %.1f%% of one core, %.1f ns per delivered byte\n",
+           100.0 * cpu_us / elapsed_us, bytes ? 1000.0 * cpu_us / bytes : 0.0);
+    printf("loop wakeups        %.0f/s sender, %.0f/s receiver\n", sender_wakeups * 1e6 / elapsed_us,
+           receiver_wakeups * 1e6 / elapsed_us);
+    printf("radio packets       %llu sent, %llu delivered, %llu lost, %llu collided\n",
+           static_cast<unsigned long long>(medium_stats.packets_sent),
+           static_cast<unsigned long long>(medium_stats.packets_delivered),
+           static_cast<unsigned long long>(medium_stats.packets_lost),
+           static_cast<unsigned long long>(medium_stats.packets_collided));
+    printf("radio errors        %llu crc failures, %llu corrupted deliveries, %llu rx fifo overflows\n",
+           static_cast<unsigned long long>(medium_stats.crc_failures),
+           static_cast<unsigned long long>(medium_stats.corrupted_deliveries),
+           static_cast<unsigned long long>(medium_stats.rx_fifo_overflows));
+    if (options.ack)
+    {
+        // Both nodes count into the same statistics
+        printf("acks                %u packets sent, %u resent (%u fast), %u acks received, %u dropped, "
+               "%u expired\n",
+               logger.stats.ack_messages_sent, logger.stats.ack_messages_resent, logger.stats.ack_fast_retransmits,
+               logger.stats.ack_messages_received, logger.stats.ack_packets_dropped, logger.stats.ack_packets_expired);
+        printf("ack packets         %u sent, %u records piggybacked, %u duplicates suppressed\n",
+               logger.stats.acks_sent, logger.stats.acks_piggybacked, logger.stats.ack_duplicates_suppressed);
+        printf("round trip          srtt %u us, rto %u us\n", logger.stats.ack_srtt_us, logger.stats.ack_rto_us);
+        printf("congestion          cwnd %u packets, pacing %u packets/s, %u congestion events\n",
+               logger.stats.ack_cwnd, logger.stats.ack_pacing_pps, logger.stats.ack_congestion_events);
+    }
+    if (options.fec)
+    {
+        printf("fec                 %u parity sent, %u fragments recovered, group size %u, %.1f%% loss\n",
+               logger.stats.fec_parity_sent, logger.stats.fec_fragments_recovered, logger.stats.fec_group_size,
+               logger.stats.fec_loss_percent);
+    }
+    return 0;
+}
@@ -3,122 +3,1101 @@
 #include <iostream>
 #include "message_definitions.h"
 #include <cmath>
+#include <algorithm>
 #include "nrftime.h"
+#include "latency_trace.h"
 // #include <cstdlib>
 // #include <ctime>
 
-AckLayer::AckLayer(uint32_t packet_queue_size)
+namespace
 {
-    max_number_of_packets_ = packet_queue_size;
-    // Initialize the random number generator
-    std::srand(static_cast<unsigned int>(nerfnet::TimeNowUs()));
-    packet_number_ = static_cast<uint8_t>(std::rand() % 256);
-    LOGI("AckLayer initialized with packet number: %d", packet_number_);
+// Whether an ack record covers a fragment of its frame, see ACK_RECORDS_OFFSET
+bool IsAcknowledged(uint8_t cumulative, const uint8_t *bitmap, size_t bitmap_size, uint8_t fragment_index)
+{
+    if (fragment_index < cumulative)
+    {
+        return true;
+    }
+    if (fragment_index == cumulative)
+    {
+        return false;
+    }
+    size_t bit = fragment_index - cumulative - 1;
+    return bit < bitmap_size * 8 && (bitmap[bit / 8] & (1 << (bit % 8)));
 }
 
-void AckLayer::ReceiveFromDownstream(const std::vector<uint8_t> &data)
+// The offset in compact_payload where the records of a DataPacked packet end
+size_t PackedRecordsEnd(const DataPacket &packet)
+{
+    size_t offset = 0;
+    while (offset < COMPACT_PACKET_PAYLOAD_SIZE && packet.compact_payload[offset] != 0)
+    {
+        uint8_t marker = packet.compact_payload[offset];
+        size_t header_size = (marker & PACKED_RECORD_TAIL) ? PACKED_RECORD_TAIL_HEADER_SIZE : 1;
+        offset += header_size + (marker & PACKED_RECORD_LENGTH_MASK);
+    }
+    return std::min<size_t>(offset, COMPACT_PACKET_PAYLOAD_SIZE);
+}
+} // namespace
+
+AckLayer::AckLayer(uint32_t window_size)
+    : packet_slab_(kMaxQueuedPackets + window_size)
+{
+    max_number_of_packets_ = window_size;
+    uint32_t ring_size = 1;
+    while (ring_size < window_size * kRingSpan)
+    {
+        ring_size <<= 1;
+    }
+    pending_ring_.assign(ring_size, nullptr);
+    ring_mask_ = ring_size - 1;
+    // A frame misses fragments only while one of its packets waits in the
+    // sender's window, and frames enter the window in message_id order. With
+    // a peer window like ours the frames in flight from it map to distinct
+    // entries.
+    acked_frames_per_source_ = 1;
+    while (acked_frames_per_source_ < window_size * kMaxFramesPerPacket && acked_frames_per_source_ < 256)
+    {
+        acked_frames_per_source_ <<= 1;
+    }
+    acked_frames_.assign(kMaxNeighbours * acked_frames_per_source_, AckedFrame());
+    due_frames_.reserve(acked_frames_.size());
+    ack_timer_.callback = &AckLayer::AckDelayElapsed;
+    ack_timer_.context = this;
+}
+
+AckLayer::~AckLayer()
+{
+    ReleaseQueue(fragmented_packets_);
+    ReleaseWindow();
+}
+
+void AckLayer::ReceiveFromDownstream(PacketBuffer data)
 {
     if (!enabled_)
     {
-        SendUpstream(data);
+        SendUpstream(std::move(data));
         return;
     }
-    DataPacket packet = VectorToDataPacket(data);
+    if (ReceivePacket(data, nerfnet::TimeNowUs()))
+    {
+        SendUpstream(std::move(data));
+    }
+}
+
+bool AckLayer::ReceivePacket(const PacketBuffer &data, uint64_t now_us)
+{
+    const DataPacket &packet = AsDataPacket(data);
     switch (packet.packet_type)
     {
     case static_cast<uint8_t>(PacketType::Data):
+    case static_cast<uint8_t>(PacketType::DataFragment):
+        return RecordFragment(data, now_us);
+    case static_cast<uint8_t>(PacketType::DataPacked):
     {
-        // Handle data packet
-        //LOGI("Received packet %d", packet.number);
-        SendUpstream(data);
-        // Send an ack packet back
-        DataPacket ack_packet = packet;
-        ack_packet.packet_type = static_cast<uint8_t>(PacketType::DataAck);
-        INCREMENT_STATS(&stats, ack_messages_received);
-        SendDownstream(DataPacketToVector(ack_packet));
-        break;
+        // Packed packets are acknowledged on their own, there is no frame to track
+        if (packed_ack_count_ < packed_acks_.size())
+        {
+            packed_acks_[packed_ack_count_++] = packet.message_id;
+            ScheduleAcks(now_us);
+        }
+        SourceWindows *windows = WindowsOf(data.source(), now_us);
+        if (windows && windows->packs.Contains(packet.message_id))
+        {
+            INCREMENT_STATS(&stats, ack_duplicates_suppressed);
+            return false;
+        }
+        if (windows)
+        {
+            windows->packs.Add(packet.message_id);
+        }
+        // Ack records the peer put after the frames, the fragmentation layer
+        // skips them, and the tails of frames that complete them
+        size_t offset = PackedRecordsEnd(packet);
+        for (size_t record = 0; record < offset;)
+        {
+            const uint8_t *bytes = packet.compact_payload + record;
+            uint8_t marker = bytes[0];
+            size_t header_size = (marker & PACKED_RECORD_TAIL) ? PACKED_RECORD_TAIL_HEADER_SIZE : 1;
+            size_t length = marker & PACKED_RECORD_LENGTH_MASK;
+            if (record + header_size + length > COMPACT_PACKET_PAYLOAD_SIZE)
+            {
+                break;
+            }
+            if (marker & PACKED_RECORD_TAIL)
+            {
+                RecordPackedTail(data.source(), bytes[1], bytes[2], now_us);
+            }
+            else if (marker & PACKED_RECORD_ACK)
+            {
+                ReceiveAckRecords(bytes + header_size, length, data.source(), now_us);
+            }
+            record += header_size + length;
+        }
+        return true;
     }
+    case static_cast<uint8_t>(PacketType::DataParity):
+    case static_cast<uint8_t>(PacketType::FecReport):
+        return true;
     case static_cast<uint8_t>(PacketType::DataAck):
+        INCREMENT_STATS(&stats, ack_messages_received);
+        ReceiveAckRecords(packet.raw_data + ACK_RECORDS_OFFSET,
+                          std::min<size_t>(packet.raw_data[ACK_RECORDS_OFFSET - 1], ACK_RECORDS_SIZE), data.source(),
+                          now_us);
+        return false;
+    default:
+        LOGE("Unknown ack packet type: %d", packet.packet_type);
+        return false;
+    }
+}
+
+bool AckLayer::RecordFragment(const PacketBuffer &data, uint64_t now_us)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    SourceWindows *windows = WindowsOf(data.source(), now_us);
+    if (windows && windows->frames.Contains(packet.message_id))
+    {
+        // The frame went up whole already, the sender missed the ack of it
+        AckedFrame &frame = FindOrStartFrame(data.source(), packet.message_id, now_us);
+        frame.received.set();
+        MarkAckDue(frame);
+        frame.last_received_us = now_us;
+        ScheduleAcks(now_us);
+        INCREMENT_STATS(&stats, ack_duplicates_suppressed);
+        return false;
+    }
+
+    AckedFrame &frame = FindOrStartFrame(data.source(), packet.message_id, now_us);
+    bool duplicate = false;
+    if (packet.fragment_index < MAX_FRAGMENTS_PER_FRAME)
+    {
+        duplicate = frame.received.test(packet.fragment_index);
+        frame.received.set(packet.fragment_index);
+    }
+    if (packet.packet_type == static_cast<uint8_t>(PacketType::Data) && packet.final_packet)
+    {
+        frame.fragment_count = packet.fragment_index + 1;
+    }
+    MarkAckDue(frame);
+    frame.last_received_us = now_us;
+    ScheduleAcks(now_us);
+    if (duplicate)
+    {
+        INCREMENT_STATS(&stats, ack_duplicates_suppressed);
+        return false;
+    }
+    CheckFrameComplete(frame, now_us);
+    return true;
+}
+
+void AckLayer::FragmentRecovered(uint8_t source, uint8_t message_id, uint8_t fragment_index)
+{
+    if (!enabled_ || fragment_index >= MAX_FRAGMENTS_PER_FRAME)
+    {
+        return;
+    }
+    uint64_t now_us = nerfnet::TimeNowUs();
+    SourceWindows *windows = WindowsOf(source, now_us);
+    if (windows && windows->frames.Contains(message_id))
+    {
+        return;
+    }
+    AckedFrame &frame = FindOrStartFrame(source, message_id, now_us);
+    frame.received.set(fragment_index);
+    frame.last_received_us = now_us;
+    MarkAckDue(frame);
+    ScheduleAcks(now_us);
+    CheckFrameComplete(frame, now_us);
+}
+
+void AckLayer::RecordPackedTail(uint8_t source, uint8_t message_id, uint8_t fragment_index, uint64_t now_us)
+{
+    if (fragment_index >= MAX_FRAGMENTS_PER_FRAME)
+    {
+        return;
+    }
+    AckedFrame &frame = FindOrStartFrame(source, message_id, now_us);
+    frame.received.set(fragment_index);
+    frame.fragment_count = fragment_index + 1;
+    frame.last_received_us = now_us;
+    CheckFrameComplete(frame, now_us);
+}
+
+void AckLayer::CheckFrameComplete(AckedFrame &frame, uint64_t now_us)
+{
+    if (frame.fragment_count == 0 || frame.received.count() < frame.fragment_count)
+    {
+        return;
+    }
+    SourceWindows *windows = WindowsOf(frame.source, now_us);
+    if (windows)
+    {
+        windows->frames.Add(frame.message_id);
+    }
+}
+
+AckLayer::SourceWindows *AckLayer::WindowsOf(uint8_t source, uint64_t now_us)
+{
+    if (source >= duplicate_windows_.size())
+    {
+        return nullptr;
+    }
+    // A peer that restarted numbers its frames anew
+    SourceWindows &windows = duplicate_windows_[source];
+    if (now_us - windows.last_received_us > kAckedFrameTimeoutUs)
+    {
+        windows = SourceWindows();
+    }
+    windows.last_received_us = now_us;
+    return &windows;
+}
+
+bool AckLayer::DuplicateWindow::Contains(uint8_t message_id) const
+{
+    uint8_t behind = highest - message_id;
+    return valid && behind < kDuplicateWindowSize && (received & (1ULL << behind));
+}
+
+void AckLayer::DuplicateWindow::Add(uint8_t message_id)
+{
+    uint8_t ahead = message_id - highest;
+    if (!valid)
+    {
+        valid = true;
+        highest = message_id;
+        received = 1;
+    }
+    else if (ahead != 0 && ahead < 128)
+    {
+        received = ahead >= kDuplicateWindowSize ? 0 : received << ahead;
+        received |= 1;
+        highest = message_id;
+    }
+    else
+    {
+        uint8_t behind = highest - message_id;
+        if (behind < kDuplicateWindowSize)
+        {
+            received |= 1ULL << behind;
+        }
+    }
+}
+
+AckLayer::AckedFrame &AckLayer::FindOrStartFrame(uint8_t source, uint8_t message_id, uint64_t now_us)
+{
+    AckedFrame &frame = acked_frames_[(source % kMaxNeighbours) * acked_frames_per_source_ +
+                                      message_id % acked_frames_per_source_];
+    if (frame.in_use && frame.source == source && frame.message_id == message_id &&
+        now_us - frame.last_received_us < kAckedFrameTimeoutUs)
+    {
+        return frame;
+    }
+    // A frame replaced here is too far behind to still be in flight. It is
+    // acknowledged again from scratch if one of its fragments is
+    // retransmitted, the acks only ever state what arrived. One replaced with
+    // an ack due gets it now.
+    if (frame.ack_due)
+    {
+        FlushAcks();
+        SendAckBatch();
+    }
+    frame = AckedFrame();
+    frame.in_use = true;
+    frame.source = source;
+    frame.message_id = message_id;
+    return frame;
+}
+
+void AckLayer::MarkAckDue(AckedFrame &frame)
+{
+    if (!frame.ack_due)
     {
-        // Handle ack packet
-        //LOGI("Received ack packet for packet %d", packet.number);
+        frame.ack_due = true;
+        due_frames_.push_back(&frame);
+    }
+}
 
-        auto it = std::find_if(pending_packets_.begin(), pending_packets_.end(),
-                               [&packet](const AckPacket &pending)
-                               {
-                                   return pending.packet.valid_bytes == packet.valid_bytes &&
-                                          std::memcmp(pending.packet.payload, packet.payload, packet.valid_bytes) == 0;
-                               });
+void AckLayer::ScheduleAcks(uint64_t now_us)
+{
+    if (acks_due_ || ack_timer_.scheduled())
+    {
+        return;
+    }
+    // Everything received in a burst is acknowledged together
+    Timers().Schedule(&ack_timer_, now_us + kAckDelayUs);
+}
+
+void AckLayer::AckDelayElapsed(nerfnet::TimerWheel::Timer * /*timer*/, void *context)
+{
+    static_cast<AckLayer *>(context)->acks_due_ = true;
+}
+
+size_t AckLayer::EncodeAckRecord(const AckedFrame &frame, uint8_t *record)
+{
+    size_t cumulative = 0;
+    while (cumulative < MAX_FRAGMENTS_PER_FRAME && frame.received.test(cumulative))
+    {
+        cumulative++;
+    }
+    record[0] = frame.message_id;
+    record[1] = static_cast<uint8_t>(cumulative);
+    uint8_t *bitmap = record + ACK_RECORD_HEADER_SIZE;
+    std::memset(bitmap, 0, ACK_MAX_BITMAP_SIZE);
+    size_t bitmap_size = 0;
+    for (size_t index = cumulative + 1; index < MAX_FRAGMENTS_PER_FRAME; index++)
+    {
+        if (frame.received.test(index))
+        {
+            size_t bit = index - cumulative - 1;
+            bitmap[bit / 8] |= 1 << (bit % 8);
+            bitmap_size = bit / 8 + 1;
+        }
+    }
+    record[2] = static_cast<uint8_t>(bitmap_size);
+    return ACK_RECORD_HEADER_SIZE + bitmap_size;
+}
+
+void AckLayer::FlushAcks()
+{
+    acks_due_ = false;
+    if (ack_timer_.scheduled())
+    {
+        Timers().Cancel(&ack_timer_);
+    }
+    // Records go into the room left in the packed packets about to be sent,
+    // then into as few DataAck packets as hold the rest
+    size_t pack_index = 0;
+    size_t pack_lead = 0;
+    bool pack_started = false;
+    auto place = [&](const uint8_t *record, size_t size)
+    {
+        for (; pack_index < tx_batch_.size(); pack_index++, pack_started = false)
+        {
+            PacketBuffer &data = tx_batch_[pack_index];
+            if (AsDataPacket(data).packet_type != static_cast<uint8_t>(PacketType::DataPacked))
+            {
+                continue;
+            }
+            if (!pack_started)
+            {
+                pack_lead = PackedRecordsEnd(AsDataPacket(data));
+                if (pack_lead + 1 + size > COMPACT_PACKET_PAYLOAD_SIZE)
+                {
+                    continue;
+                }
+                // The pending packet stays as it is, a retransmit of it must
+                // not repeat acks that may be stale by then
+                PacketBuffer copy = PacketBuffer::CopyFrom(data.data(), data.size());
+                if (!copy.valid())
+                {
+                    break;
+                }
+                copy.set_trace_start_us(data.trace_start_us());
+                data = std::move(copy);
+                AsDataPacket(data).compact_payload[pack_lead] = PACKED_RECORD_ACK;
+                pack_started = true;
+            }
+            DataPacket &packet = AsDataPacket(data);
+            size_t length = packet.compact_payload[pack_lead] & PACKED_RECORD_LENGTH_MASK;
+            size_t offset = pack_lead + 1 + length;
+            if (offset + size > COMPACT_PACKET_PAYLOAD_SIZE)
+            {
+                continue;
+            }
+            std::memcpy(packet.compact_payload + offset, record, size);
+            if (offset + size < COMPACT_PACKET_PAYLOAD_SIZE)
+            {
+                packet.compact_payload[offset + size] = 0;
+            }
+            packet.compact_payload[pack_lead] = static_cast<uint8_t>(PACKED_RECORD_ACK | (length + size));
+            INCREMENT_STATS(&stats, acks_piggybacked);
+            return;
+        }
 
-        if (it != pending_packets_.end())
+        if (!ack_batch_.empty())
         {
-            pending_packets_.erase(it);
+            DataPacket &ack = AsDataPacket(ack_batch_.back());
+            size_t length = ack.raw_data[ACK_RECORDS_OFFSET - 1];
+            if (length + size <= ACK_RECORDS_SIZE)
+            {
+                std::memcpy(ack.raw_data + ACK_RECORDS_OFFSET + length, record, size);
+                ack.raw_data[ACK_RECORDS_OFFSET - 1] = static_cast<uint8_t>(length + size);
+                return;
+            }
         }
-        else
+        DataPacket ack = {};
+        ack.packet_type = static_cast<uint8_t>(PacketType::DataAck);
+        ack.raw_data[ACK_RECORDS_OFFSET - 1] = static_cast<uint8_t>(size);
+        std::memcpy(ack.raw_data + ACK_RECORDS_OFFSET, record, size);
+        PacketBuffer ack_buffer = DataPacketToBuffer(ack);
+        if (!ack_buffer.valid())
         {
-            LOGW("No matching packet found in pending queue for ack");
+            LOGW("Out of packet buffers, not acknowledging packet");
+            return;
         }
-        break;
+        INCREMENT_STATS(&stats, acks_sent);
+        ack_batch_.push_back(std::move(ack_buffer));
+    };
+
+    uint8_t record[ACK_RECORD_HEADER_SIZE + ACK_MAX_BITMAP_SIZE];
+    for (AckedFrame *frame : due_frames_)
+    {
+        frame->ack_due = false;
+        place(record, EncodeAckRecord(*frame, record));
     }
-    default:
-        LOGE("Unknown ack packet type: %d", packet.packet_type);
-        break;
+    due_frames_.clear();
+    for (size_t i = 0; i < packed_ack_count_; i++)
+    {
+        record[0] = packed_acks_[i];
+        record[1] = PACKED_FRAGMENT_INDEX;
+        place(record, ACK_RECORD_PACKED_SIZE);
+    }
+    packed_ack_count_ = 0;
+}
+
+void AckLayer::SendAckBatch()
+{
+    if (!ack_batch_.empty())
+    {
+        SendDownstreamBatch(ack_batch_);
+    }
+}
+
+void AckLayer::ReceiveAckRecords(const uint8_t *records, size_t size, uint8_t source, uint64_t now_us)
+{
+    while (size >= ACK_RECORD_PACKED_SIZE)
+    {
+        uint8_t message_id = records[0];
+        uint8_t cumulative = records[1];
+        if (cumulative == PACKED_FRAGMENT_INDEX)
+        {
+            ReceivePackedAck(message_id, source, now_us);
+            records += ACK_RECORD_PACKED_SIZE;
+            size -= ACK_RECORD_PACKED_SIZE;
+            continue;
+        }
+        size_t bitmap_size = size >= ACK_RECORD_HEADER_SIZE ? records[2] : 0;
+        size_t record_size = ACK_RECORD_HEADER_SIZE + bitmap_size;
+        if (size < ACK_RECORD_HEADER_SIZE || bitmap_size > ACK_MAX_BITMAP_SIZE || record_size > size)
+        {
+            LOGW("Malformed ack record for message %d", message_id);
+            return;
+        }
+        ReceiveFrameAck(message_id, cumulative, records + ACK_RECORD_HEADER_SIZE, bitmap_size, source, now_us);
+        records += record_size;
+        size -= record_size;
+    }
+}
+
+void AckLayer::RttEstimator::AddSample(uint32_t rtt_us)
+{
+    if (!measured)
+    {
+        measured = true;
+        srtt_us = rtt_us;
+        rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        uint32_t deviation = srtt_us > rtt_us ? srtt_us - rtt_us : rtt_us - srtt_us;
+        rttvar_us = (3 * rttvar_us + deviation) / 4;
+        srtt_us = (7 * srtt_us + rtt_us) / 8;
+    }
+    rto_us = std::clamp(srtt_us + std::max(kRttGranularityUs, 4 * rttvar_us), kMinRtoUs, kMaxRtoUs);
+}
+
+void AckLayer::ReceivePackedAck(uint8_t message_id, uint8_t source, uint64_t now_us)
+{
+    if (source >= kMaxNeighbours)
+    {
+        return;
+    }
+    neighbour_ = source;
+    AckPacket *pending = PendingAt(packed_sequences_[message_id]);
+    if (!pending || AsDataPacket(pending->packet).packet_type != static_cast<uint8_t>(PacketType::DataPacked) ||
+        AsDataPacket(pending->packet).message_id != message_id)
+    {
+        return;
+    }
+    // Karn's rule: a packet sent more than once gives no round trip sample,
+    // the ack could be for any of its transmissions
+    if (pending->times_sent_ == 1)
+    {
+        AddRttSample(source, now_us - pending->last_time_sent_, now_us);
+    }
+    ReleasePending(pending);
+    OnPacketsAcked(source, 1);
+}
+
+void AckLayer::ReceiveFrameAck(uint8_t message_id, uint8_t cumulative, const uint8_t *bitmap, size_t bitmap_size,
+                               uint8_t source, uint64_t now_us)
+{
+    if (source >= kMaxNeighbours)
+    {
+        return;
+    }
+    neighbour_ = source;
+
+    // A frame holds at most MAX_FRAGMENTS_PER_FRAME sequence numbers, those
+    // that left the window were acknowledged already
+    const FrameSequences &frame = frame_sequences_[message_id];
+    // The latest transmission the ack covers gives the round trip sample,
+    // unless it was a retransmit. Everything of the frame sent before it and
+    // still missing was lost.
+    uint32_t acknowledged = 0;
+    uint32_t latest_send_order = 0;
+    uint64_t latest_rtt_us = 0;
+    bool latest_sent_once = false;
+    for (uint32_t sequence = frame.first; sequence != frame.end; sequence++)
+    {
+        AckPacket *pending = PendingAt(sequence);
+        if (pending && IsAcknowledged(cumulative, bitmap, bitmap_size, AsDataPacket(pending->packet).fragment_index))
+        {
+            if (!acknowledged || pending->send_order_ > latest_send_order)
+            {
+                latest_send_order = pending->send_order_;
+                latest_rtt_us = now_us - pending->last_time_sent_;
+                latest_sent_once = pending->times_sent_ == 1;
+            }
+            acknowledged++;
+            ReleasePending(pending);
+        }
+    }
+    if (!acknowledged)
+    {
+        return;
+    }
+    if (latest_sent_once)
+    {
+        AddRttSample(source, latest_rtt_us, now_us);
+    }
+    OnPacketsAcked(source, acknowledged);
+    for (uint32_t sequence = frame.first; sequence != frame.end; sequence++)
+    {
+        AckPacket *pending = PendingAt(sequence);
+        if (pending && pending->send_order_ < latest_send_order && !pending->lost_)
+        {
+            pending->lost_ = true;
+            OnLoss(pending);
+            QueueRetransmit(pending);
+        }
+    }
+}
+
+void AckLayer::AddRttSample(uint8_t neighbour, uint64_t rtt_us, uint64_t now_us)
+{
+    RttEstimator &rtt = rtt_[neighbour];
+    uint32_t sample_us = static_cast<uint32_t>(std::min<uint64_t>(rtt_us, kMaxRtoUs));
+    rtt.AddSample(sample_us);
+    UPDATE_STATS(&stats, ack_srtt_us, rtt.srtt_us);
+    UPDATE_STATS(&stats, ack_rto_us, rtt.rto_us);
+
+    CongestionState &congestion = congestion_[neighbour];
+    if (sample_us <= congestion.min_rtt_us || now_us - congestion.min_rtt_time_us > kMinRttWindowUs)
+    {
+        congestion.min_rtt_us = sample_us;
+        congestion.min_rtt_time_us = now_us;
+    }
+    UpdateCongestionStats(neighbour);
+}
+
+bool AckLayer::Queueing(uint8_t neighbour) const
+{
+    const CongestionState &congestion = congestion_[neighbour];
+    return rtt_[neighbour].measured && rtt_[neighbour].srtt_us > congestion.min_rtt_us + kQueueingDelayUs;
+}
+
+void AckLayer::OnPacketsAcked(uint8_t neighbour, uint32_t count)
+{
+    // A queue building up holds the window where it is
+    CongestionState &congestion = congestion_[neighbour];
+    if (Queueing(neighbour))
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < count && congestion.cwnd < max_number_of_packets_; i++)
+    {
+        if (congestion.cwnd < congestion.ssthresh)
+        {
+            congestion.cwnd++;
+        }
+        else if (++congestion.acked >= congestion.cwnd)
+        {
+            congestion.acked = 0;
+            congestion.cwnd++;
+        }
+    }
+    UpdateCongestionStats(neighbour);
+}
+
+void AckLayer::OnLoss(const AckPacket *ack_packet)
+{
+    CongestionState &congestion = congestion_[ack_packet->neighbour_];
+    // Everything sent before the first loss was noticed is lost in the same event
+    if (ack_packet->send_order_ <= congestion.recovery_send_order)
+    {
+        return;
+    }
+    congestion.recovery_send_order = send_order_;
+    congestion.acked = 0;
+    if (ack_packet->timeouts_ > 1)
+    {
+        // The same packet timed out twice, the link is gone rather than lossy
+        congestion.ssthresh = std::max(congestion.cwnd / 2, kMinCwnd);
+        congestion.cwnd = kMinCwnd;
+        INCREMENT_STATS(&stats, ack_congestion_events);
+    }
+    else if (Queueing(ack_packet->neighbour_))
+    {
+        congestion.ssthresh = std::max(congestion.cwnd * 7 / 10, kMinCwnd);
+        congestion.cwnd = congestion.ssthresh;
+        INCREMENT_STATS(&stats, ack_congestion_events);
+    }
+    else
+    {
+        // Loss on the air, the window stays but stops growing exponentially
+        congestion.ssthresh = congestion.cwnd;
+    }
+    UpdateCongestionStats(ack_packet->neighbour_);
+}
+
+uint32_t AckLayer::PacingIntervalUs() const
+{
+    const RttEstimator &rtt = rtt_[neighbour_];
+    const CongestionState &congestion = congestion_[neighbour_];
+    if (!rtt.measured)
+    {
+        return 0;
+    }
+    uint32_t gain = congestion.cwnd < congestion.ssthresh ? kSlowStartPacingGain : kPacingGain;
+    return rtt.srtt_us * 100 / (gain * congestion.cwnd);
+}
+
+uint64_t AckLayer::PacingBudgetUs(uint64_t now_us) const
+{
+    uint64_t burst_us = std::max<uint64_t>(kPacingBurstUs, PacingIntervalUs());
+    return std::min(pacing_budget_us_ + (now_us - pacing_update_us_), burst_us);
+}
+
+bool AckLayer::CanPace(uint64_t now_us) const
+{
+    return PacingBudgetUs(now_us) >= PacingIntervalUs();
+}
+
+void AckLayer::Pace(uint64_t now_us)
+{
+    pacing_budget_us_ = PacingBudgetUs(now_us) - PacingIntervalUs();
+    pacing_update_us_ = now_us;
+}
+
+void AckLayer::UpdateCongestionStats(uint8_t neighbour)
+{
+    if (neighbour != neighbour_)
+    {
+        return;
+    }
+    uint32_t interval_us = PacingIntervalUs();
+    UPDATE_STATS(&stats, ack_cwnd, congestion_[neighbour].cwnd);
+    UPDATE_STATS(&stats, ack_pacing_pps, interval_us ? 1000000 / interval_us : 0);
+}
+
+void AckLayer::AddPending(AckPacket *ack_packet)
+{
+    const DataPacket &packet = AsDataPacket(ack_packet->packet);
+    uint32_t sequence = next_sequence_++;
+    ack_packet->sequence_ = sequence;
+    ack_packet->neighbour_ = neighbour_;
+    ack_packet->callback = &AckLayer::RetransmitTimeout;
+    ack_packet->context = this;
+    pending_ring_[sequence & ring_mask_] = ack_packet;
+    pending_count_++;
+    if (packet.packet_type == static_cast<uint8_t>(PacketType::DataPacked))
+    {
+        packed_sequences_[packet.message_id] = sequence;
+        return;
+    }
+    FrameSequences &frame = frame_sequences_[packet.message_id];
+    // Fragments of a frame follow each other, anything else means the
+    // message_id came around again
+    if (frame.end != sequence)
+    {
+        frame.first = sequence;
+    }
+    frame.end = sequence + 1;
+    newest_frame_id_ = packet.message_id;
+    AdvanceOldestFrame();
+}
+
+void AckLayer::AdvanceOldestFrame()
+{
+    // A frame is done once the window moved past its fragments
+    while (oldest_frame_id_ != newest_frame_id_ &&
+           static_cast<int32_t>(base_sequence_ - frame_sequences_[oldest_frame_id_].end) >= 0)
+    {
+        oldest_frame_id_++;
+    }
+}
+
+AckLayer::AckPacket *AckLayer::PendingAt(uint32_t sequence) const
+{
+    if (sequence - base_sequence_ >= next_sequence_ - base_sequence_)
+    {
+        return nullptr;
+    }
+    return pending_ring_[sequence & ring_mask_];
+}
+
+void AckLayer::ReleasePending(AckPacket *ack_packet)
+{
+    if (ack_packet->scheduled())
+    {
+        Timers().Cancel(ack_packet);
+    }
+    if (ack_packet->retransmit_queued_)
+    {
+        retransmit_queue_.Remove(ack_packet);
+    }
+    pending_ring_[ack_packet->sequence_ & ring_mask_] = nullptr;
+    packet_slab_.Delete(ack_packet);
+    pending_count_--;
+    while (base_sequence_ != next_sequence_ && !pending_ring_[base_sequence_ & ring_mask_])
+    {
+        base_sequence_++;
+    }
+    AdvanceOldestFrame();
+}
+
+void AckLayer::ReleaseWindow()
+{
+    while (retransmit_queue_.PopFront())
+    {
+    }
+    for (uint32_t sequence = base_sequence_; sequence != next_sequence_; sequence++)
+    {
+        AckPacket *&pending = pending_ring_[sequence & ring_mask_];
+        if (pending)
+        {
+            if (pending->scheduled())
+            {
+                Timers().Cancel(pending);
+            }
+            packet_slab_.Delete(pending);
+            pending = nullptr;
+        }
+    }
+    base_sequence_ = next_sequence_;
+    pending_count_ = 0;
+}
+
+void AckLayer::ReceiveFromUpstream(PacketBuffer data)
+{
+    nerfnet::TraceLatency(nerfnet::TraceStage::AckEnqueued, data);
+    if (!enabled_)
+    {
+        SendDownstream(std::move(data));
+        return;
+    }
+    QueuePacket(std::move(data), nerfnet::TimeNowUs());
+}
+
+void AckLayer::QueuePacket(PacketBuffer data, uint64_t now_us)
+{
+    AckPacket *ack_packet = packet_slab_.New();
+    if (!ack_packet)
+    {
+        LOGW("Ack queue full, dropping packet");
+        return;
+    }
+    // The fragments of a frame come down together, so they share the deadline
+    if (data.traffic_class() == TrafficClass::RealTime && real_time_deadline_us_ != 0)
+    {
+        ack_packet->deadline_us_ = now_us + real_time_deadline_us_;
+    }
+    ack_packet->packet = std::move(data);
+    fragmented_packets_.PushBack(ack_packet);
+}
+
+void AckLayer::ReleaseQueue(IntrusiveList<AckPacket> &queue)
+{
+    while (AckPacket *ack_packet = queue.PopFront())
+    {
+        packet_slab_.Delete(ack_packet);
+    }
+}
+
+void AckLayer::ReceiveBatchFromDownstream(PacketBatch &batch)
+{
+    if (!enabled_)
+    {
+        SendUpstreamBatch(batch);
+        return;
     }
+    // Acks are consumed here, the rest of the batch moves up in place
+    uint64_t now_us = nerfnet::TimeNowUs();
+    size_t kept = 0;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (!ReceivePacket(batch[i], now_us))
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            batch[kept] = std::move(batch[i]);
+        }
+        kept++;
+    }
+    batch.erase(batch.begin() + kept, batch.end());
+    SendUpstreamBatch(batch);
 }
 
-void AckLayer::ReceiveFromUpstream(const std::vector<uint8_t> &data)
+void AckLayer::ReceiveBatchFromUpstream(PacketBatch &batch)
 {
+    for (const PacketBuffer &data : batch)
+    {
+        nerfnet::TraceLatency(nerfnet::TraceStage::AckEnqueued, data);
+    }
     if (!enabled_)
     {
-        SendDownstream(data);
+        SendDownstreamBatch(batch);
         return;
     }
-    fragmented_packets_.emplace_back(VectorToDataPacket(data));
+    uint64_t now_us = nerfnet::TimeNowUs();
+    for (PacketBuffer &data : batch)
+    {
+        QueuePacket(std::move(data), now_us);
+    }
+    batch.clear();
 }
 
 void AckLayer::Reset()
 {
-    fragmented_packets_.clear();
-    pending_packets_.clear();
-    packet_number_ = static_cast<uint8_t>(std::rand() % 256);
+    ReleaseQueue(fragmented_packets_);
+    ReleaseWindow();
+    acked_frames_.assign(acked_frames_.size(), AckedFrame());
+    due_frames_.clear();
+    duplicate_windows_.fill(SourceWindows());
+    congestion_.fill(CongestionState());
+    packed_ack_count_ = 0;
+    acks_due_ = false;
+    if (ack_timer_.scheduled())
+    {
+        Timers().Cancel(&ack_timer_);
+    }
+}
+
+size_t AckLayer::TxCredits() const
+{
+    if (!enabled_)
+    {
+        return DownstreamTxCredits();
+    }
+    return (kMaxQueuedPackets - std::min(fragmented_packets_.size(), kMaxQueuedPackets)) * PACKET_SIZE;
+}
+
+bool AckLayer::NeedsAck(const PacketBuffer &data)
+{
+    uint8_t packet_type = AsDataPacket(data).packet_type;
+    return packet_type != static_cast<uint8_t>(PacketType::DataParity) &&
+           packet_type != static_cast<uint8_t>(PacketType::FecReport);
+}
+
+bool AckLayer::CanSendNextPacket() const
+{
+    const AckPacket *front = fragmented_packets_.Front();
+    uint32_t window = std::min(max_number_of_packets_, congestion_[neighbour_].cwnd);
+    return front &&
+           (!NeedsAck(front->packet) ||
+            (pending_count_ < window && next_sequence_ - base_sequence_ <= ring_mask_ &&
+             FitsFramesInFlight(front))) &&
+           DownstreamTxCredits() >= PACKET_SIZE;
+}
+
+bool AckLayer::FitsFramesInFlight(const AckPacket *ack_packet) const
+{
+    const DataPacket &packet = AsDataPacket(ack_packet->packet);
+    if (pending_count_ == 0 || packet.packet_type == static_cast<uint8_t>(PacketType::DataPacked))
+    {
+        return true;
+    }
+    // The tails in a packed packet are of frames up to kMaxFramesPerPacket
+    // older than the first frame sent after it
+    return static_cast<uint8_t>(packet.message_id - oldest_frame_id_) < kMaxFramesInFlight - kMaxFramesPerPacket;
+}
+
+void AckLayer::Transmit(AckPacket *ack_packet, uint64_t now_us)
+{
+    // The pending entry keeps a reference for retransmits, no copy is made.
+    tx_batch_.push_back(ack_packet->packet);
+    ack_packet->last_time_sent_ = now_us;
+    ack_packet->times_sent_++;
+    ack_packet->send_order_ = ++send_order_;
+    ack_packet->lost_ = false;
+    uint64_t rto_us = static_cast<uint64_t>(rtt_[ack_packet->neighbour_].rto_us) << ack_packet->timeouts_;
+    ack_packet->rto_us_ = static_cast<uint32_t>(std::min<uint64_t>(rto_us, kMaxRtoUs));
+    uint64_t timeout_us = now_us + ack_packet->rto_us_;
+    if (ack_packet->deadline_us_ != 0)
+    {
+        timeout_us = std::min(timeout_us, ack_packet->deadline_us_);
+    }
+    Timers().Schedule(ack_packet, timeout_us);
+}
+
+void AckLayer::QueueRetransmit(AckPacket *ack_packet)
+{
+    if (!ack_packet->retransmit_queued_)
+    {
+        ack_packet->retransmit_queued_ = true;
+        retransmit_queue_.PushBack(ack_packet);
+    }
+}
+
+void AckLayer::RetransmitTimeout(nerfnet::TimerWheel::Timer *timer, void *context)
+{
+    AckLayer *layer = static_cast<AckLayer *>(context);
+    AckPacket *ack_packet = static_cast<AckPacket *>(timer);
+    if (layer->DropIfStale(ack_packet, nerfnet::TimeNowUs()))
+    {
+        return;
+    }
+    if (ack_packet->timeouts_ < UINT8_MAX)
+    {
+        ack_packet->timeouts_++;
+    }
+    layer->OnLoss(ack_packet);
+    layer->QueueRetransmit(ack_packet);
+}
+
+uint32_t AckLayer::MaxRetransmits(const AckPacket *ack_packet) const
+{
+    if (ack_packet->packet.traffic_class() == TrafficClass::BoundedRetries)
+    {
+        return std::min(bounded_retransmits_, max_retransmits_);
+    }
+    return max_retransmits_;
+}
+
+bool AckLayer::Expired(const AckPacket *ack_packet, uint64_t now_us)
+{
+    return ack_packet->deadline_us_ != 0 && now_us >= ack_packet->deadline_us_;
+}
+
+bool AckLayer::DropIfStale(AckPacket *ack_packet, uint64_t now_us)
+{
+    if (Expired(ack_packet, now_us))
+    {
+        // The rest of the frame has the same deadline and goes with it
+        INCREMENT_STATS(&stats, ack_packets_expired);
+    }
+    else if (ack_packet->times_sent_ > MaxRetransmits(ack_packet))
+    {
+        // Giving up is what BoundedRetries packets are for
+        if (ack_packet->packet.traffic_class() != TrafficClass::BoundedRetries)
+        {
+            LOGE("Packet failed to send after %u attempts, dropping", ack_packet->times_sent_);
+        }
+        INCREMENT_STATS(&stats, ack_packets_dropped);
+    }
+    else
+    {
+        return false;
+    }
+    ReleasePending(ack_packet);
+    return true;
 }
 
 void AckLayer::Run()
 {
-    if (!fragmented_packets_.empty() && pending_packets_.size() < max_number_of_packets_)
+    if (!enabled_)
     {
-        // put another packet in the pending queue
-        DataPacket packet = fragmented_packets_.front();
-        fragmented_packets_.pop_front();
-        AckPacket ack_packet;
-        ack_packet.packet = packet;
-        ack_packet.packet.number = packet_number_++;
-        //LOGI("Adding packet %d to pending queue", ack_packet.packet.number);
-        INCREMENT_STATS(&stats, ack_messages_sent);
-        SendDownstream(DataPacketToVector(ack_packet.packet));
-        ack_packet.last_time_sent_ = nerfnet::TimeNowUs();
-        ack_packet.times_sent_ = 1;
-        pending_packets_.push_back(ack_packet);
+        return;
     }
+    uint64_t now_us = nerfnet::TimeNowUs();
+    size_t credits = DownstreamTxCredits() / PACKET_SIZE;
 
-    // Send the pending packets
-    for (auto it = pending_packets_.begin(); it != pending_packets_.end();)
+    // Retransmits first, they are older than anything still queued
+    while (credits > 0 && !retransmit_queue_.empty() && CanPace(now_us))
     {
-        if (it->times_sent_ > 30)
+        AckPacket *ack_packet = retransmit_queue_.PopFront();
+        ack_packet->retransmit_queued_ = false;
+        // Packets shown lost by acks reach their limit here, not at a timeout
+        if (DropIfStale(ack_packet, now_us))
         {
-            LOGE("Packet failed to send after 10 attempts, dropping");
-            pending_packets_.erase(it); // Update iterator after erase
-            return;
+            continue;
+        }
+        if (ack_packet->lost_)
+        {
+            INCREMENT_STATS(&stats, ack_fast_retransmits);
         }
+        INCREMENT_STATS(&stats, ack_messages_resent);
+        Transmit(ack_packet, now_us);
+        Pace(now_us);
+        credits--;
+    }
 
-        if (nerfnet::TimeNowUs() - it->last_time_sent_ > 80000) // 80 milliseconds
+    // Then as many new packets as the window and the radio take. Frames that
+    // waited out their deadline for the window are not sent at all.
+    for (AckPacket *front = fragmented_packets_.Front(); front && Expired(front, now_us);
+         front = fragmented_packets_.Front())
+    {
+        packet_slab_.Delete(fragmented_packets_.PopFront());
+        INCREMENT_STATS(&stats, ack_packets_expired);
+    }
+    while (credits > 0 && CanSendNextPacket() && CanPace(now_us))
+    {
+        // The slot moves into the window, or is freed once the packet is sent
+        AckPacket *ack_packet = fragmented_packets_.PopFront();
+        if (Expired(ack_packet, now_us))
         {
-            LOGW("Resending packet %d", it->packet.number);
-            INCREMENT_STATS(&stats, ack_messages_resent);
-            SendDownstream(DataPacketToVector(it->packet));
-            it->last_time_sent_ = nerfnet::TimeNowUs();
-            it->times_sent_++;
+            packet_slab_.Delete(ack_packet);
+            INCREMENT_STATS(&stats, ack_packets_expired);
+            continue;
         }
-        ++it;
+        credits--;
+        Pace(now_us);
+        if (!NeedsAck(ack_packet->packet))
+        {
+            tx_batch_.push_back(std::move(ack_packet->packet));
+            packet_slab_.Delete(ack_packet);
+            continue;
+        }
+        INCREMENT_STATS(&stats, ack_messages_sent);
+        AddPending(ack_packet);
+        Transmit(ack_packet, now_us);
+    }
+
+    // Acks ride along in the packets just built, or go out ahead of them
+    if (acks_due_)
+    {
+        FlushAcks();
+        SendAckBatch();
+    }
+    if (!tx_batch_.empty())
+    {
+        SendDownstreamBatch(tx_batch_);
+    }
+}
+
+uint64_t AckLayer::NextDeadlineUs() const
+{
+    if (!enabled_)
+    {
+        return kNoDeadline;
+    }
+    uint64_t now_us = nerfnet::TimeNowUs();
+    if (acks_due_)
+    {
+        return now_us;
+    }
+    if (CanSendNextPacket() || (!retransmit_queue_.empty() && DownstreamTxCredits() >= PACKET_SIZE))
+    {
+        // As soon as pacing lets the next packet go
+        uint64_t budget_us = PacingBudgetUs(now_us);
+        uint32_t interval_us = PacingIntervalUs();
+        return budget_us >= interval_us ? now_us : now_us + (interval_us - budget_us);
     }
+    // Retransmit timeouts and the ack delay are on the event loop's timers.
+    // Nothing waiting can be sent while the radio has no room, it wakes the
+    // loop once it has.
+    return kNoDeadline;
 }
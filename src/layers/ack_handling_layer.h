@@ -1,41 +1,374 @@
 #ifndef ACK_LAYER_H
 #define ACK_LAYER_H
 
-#include <vector>
+#include <array>
+#include <bitset>
 #include <cstdint>
-#include <unordered_map>
-#include <functional>
+#include <vector>
 #include "ILayer.h"
 #include "message_definitions.h"
-// Responsible for splitting up messages into packets for transmission
-class AckLayer : public ILayer{
+#include "slab.h"
+// Selective repeat ARQ for the fragments of frames. Up to a window of packets
+// are in flight at once, each is retransmitted on its own when it times out
+// or when an ack shows a packet sent after it arrived while it did not.
+//
+// Fragments are numbered by their message_id and fragment_index. The
+// receiver acknowledges every frame it touched with a record of how many
+// leading fragments arrived and a bitmap of the ones after, see
+// ACK_RECORDS_OFFSET. Records wait kAckDelayUs for the rest of the burst,
+// then go in the room left in packed packets going back and in as few
+// DataAck packets as hold the rest. A lost ack is covered
+// by the next one of the frame. The sender keeps its pending packets in a ring by a sequence
+// number of its own, the fragments of a frame get consecutive ones, so an
+// ack finds the packets it covers without searching the window.
+//
+// Retransmit timeouts follow the round trip time measured per neighbour,
+// smoothed as in RFC 6298 and only from packets sent once. Each timeout of
+// a packet doubles the next one. They and the ack delay run on the event
+// loop's timers, nothing scans the window for them.
+//
+// A congestion window per neighbour limits the packets in flight below the
+// configured window, and new packets and retransmits are paced at the window
+// per round trip. The radio loses packets without any congestion, so loss
+// only shrinks the window when the round trip time shows a queue or the same
+// packet times out twice. Otherwise it just ends slow start.
+//
+// Out of order fragments need no buffering here, reassembly keeps them until
+// the frame is complete, for as long as the rest of it may be retransmitted.
+// A retransmit that arrives after the original is acknowledged again and
+// dropped, so it neither starts a stray reassembly nor delivers a frame twice.
+// Parity packets and loss reports are sent once, they are worthless by the
+// time a retransmit would arrive.
+//
+// How long a packet is retransmitted for depends on the TrafficClass of its
+// frame. Reliable packets are sent up to the retransmit limit, BoundedRetries
+// ones a few times, and RealTime ones until the frame's deadline, when every
+// packet of it still waiting for an ack is dropped at once.
+class AckLayer final : public ILayer{
 public:
-    AckLayer(uint32_t packet_queue_size);
-    
-    void Run();
+    // How many message ids apart two frames from one sender may be while the
+    // receiver still misses fragments of both, the sender holds back newer
+    // frames. Reassembly above keeps that many frames per source, it tells
+    // older ids from newer ones by half the 8 bit id space.
+    static constexpr size_t kMaxFramesInFlight = 128;
+
+    // `window_size` is the most packets waiting for an ack at once
+    AckLayer(uint32_t window_size);
+    ~AckLayer();
 
-    void ReceiveFromDownstream(const std::vector<uint8_t>& data) override;
-    void ReceiveFromUpstream(const std::vector<uint8_t>& data) override;
+    void Run() override;
+    uint64_t NextDeadlineUs() const override;
+    // Room left in the queue of packets waiting for the window
+    size_t TxCredits() const override;
+
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    void ReceiveBatchFromDownstream(PacketBatch &batch) override;
+    void ReceiveBatchFromUpstream(PacketBatch &batch) override;
     void Reset() override;
 
     void Enable(bool enabled)
     {
         enabled_ = enabled;
     }
+
+    // Acknowledges a fragment the error correction layer above rebuilt, so
+    // the peer does not retransmit it, see ForwardErrorCorrectionLayer::SetAckLayer
+    void FragmentRecovered(uint8_t source, uint8_t message_id, uint8_t fragment_index);
+
+    // The retransmits of a packet after which it is dropped
+    void SetMaxRetransmits(uint32_t max_retransmits)
+    {
+        max_retransmits_ = max_retransmits;
+    }
+
+    // The retransmits of a TrafficClass::BoundedRetries packet, never more
+    // than the limit of the others
+    void SetBoundedRetransmits(uint32_t bounded_retransmits)
+    {
+        bounded_retransmits_ = bounded_retransmits;
+    }
+
+    // How long the packets of a TrafficClass::RealTime frame are sent for,
+    // from when the frame reached this layer. Zero keeps them until the
+    // retransmit limit like Reliable ones.
+    void SetRealTimeDeadlineUs(uint64_t deadline_us)
+    {
+        real_time_deadline_us_ = deadline_us;
+    }
+
+    // The longest a packet is sent for before it is dropped. Fragments are
+    // acknowledged as they arrive, so reassembly above keeps a frame at least
+    // this long for the rest of it.
+    uint64_t RetransmitHorizonUs() const
+    {
+        return static_cast<uint64_t>(max_retransmits_ + 1) * kMaxRtoUs;
+    }
 private:
     uint32_t max_number_of_packets_ = 1;
+    uint32_t max_retransmits_ = 30;
+    uint32_t bounded_retransmits_ = 4;
+    uint64_t real_time_deadline_us_ = 150000; // 150ms
+    // The retransmit timeout until a neighbour's round trip time is measured
+    static constexpr uint32_t kInitialRtoUs = 80000; // 80ms
+    // An ack waits up to a whole send slot of the peer, so the timeout never
+    // drops below two slots or gets closer than one slot to the round trip time
+    static constexpr uint32_t kMinRtoUs = 10000;    // 10ms
+    static constexpr uint32_t kRttGranularityUs = 5000; // 5ms
+    static constexpr uint32_t kMaxRtoUs = 2000000;  // 2s
+    // Round trip times are kept per pipe acks arrive on
+    static constexpr size_t kMaxNeighbours = 6;
+    // Congestion window limits, in packets
+    static constexpr uint32_t kInitialCwnd = 10;
+    static constexpr uint32_t kMinCwnd = 4;
+    // A smoothed round trip time this far over the smallest one means a
+    // queue, two radio slots so the slot a packet lands in does not count
+    static constexpr uint32_t kQueueingDelayUs = 10000; // 10ms
+    // How long the smallest round trip time is kept
+    static constexpr uint64_t kMinRttWindowUs = 10000000; // 10s
+    // Pacing may save up a radio send slot, the radio sends in bursts anyway
+    static constexpr uint64_t kPacingBurstUs = 5000; // 5ms
+    // The pacing rate over cwnd per round trip, in percent
+    static constexpr uint32_t kSlowStartPacingGain = 200;
+    static constexpr uint32_t kPacingGain = 125;
     bool enabled_ = true;
-    struct AckPacket
+    // The most packets that can wait for a slot in the pending window
+    static constexpr size_t kMaxQueuedPackets = 256;
+    // How many times the window size the sequence numbers in use may span, a
+    // packet waiting for a retransmit lets this many newer ones be sent past it
+    static constexpr uint32_t kRingSpan = 16;
+    // The most frames a radio packet carries fragments of, a DataPacked
+    // packet holds tail records of at least one byte each
+    static constexpr size_t kMaxFramesPerPacket = COMPACT_PACKET_PAYLOAD_SIZE / (PACKED_RECORD_TAIL_HEADER_SIZE + 1);
+    // The frames and packed packets per source duplicates are recognised among
+    static constexpr size_t kDuplicateWindowSize = 64;
+    // A frame that received nothing for this long is forgotten, so a reused
+    // message_id starts over
+    static constexpr uint64_t kAckedFrameTimeoutUs = 1000000; // 1s
+    // How long acks wait for more of the burst being received, under half a
+    // radio slot so they still go out in the peer's next listen slot
+    static constexpr uint64_t kAckDelayUs = 2000; // 2ms
+    // The packed packets acknowledged in one go
+    static constexpr size_t kMaxPackedAcks = 32;
+
+    // The timer is the packet's retransmit timeout
+    struct AckPacket : nerfnet::TimerWheel::Timer
     {
-        DataPacket packet;
-        uint64_t last_time_sent_;
-        uint32_t times_sent_;
+        PacketBuffer packet;
+        uint64_t last_time_sent_ = 0;
+        uint32_t times_sent_ = 0;
+        // Its position in the window
+        uint32_t sequence_ = 0;
+        // Increases with every transmission, an ack for a packet sent later
+        // than this one means this one was lost
+        uint32_t send_order_ = 0;
+        // Set when an ack showed the packet lost, it is sent again right away
+        bool lost_ = false;
+        // Whether it is in retransmit_queue_
+        bool retransmit_queued_ = false;
+        // The neighbour whose round trip time it is timed with
+        uint8_t neighbour_ = 0;
+        // The times it was sent again because no ack came
+        uint8_t timeouts_ = 0;
+        // The wait for an ack after the last transmission
+        uint32_t rto_us_ = kInitialRtoUs;
+        // When the frame stops being worth sending, zero if it never does
+        uint64_t deadline_us_ = 0;
+        // Link the queue of packets waiting for the window, then retransmit_queue_
+        AckPacket *next = nullptr;
+        AckPacket *prev = nullptr;
     };
 
-    std::deque<DataPacket> fragmented_packets_;
-    std::vector<AckPacket> pending_packets_;
+    // Jacobson/Karels round trip time estimate of one neighbour
+    struct RttEstimator
+    {
+        bool measured = false;
+        uint32_t srtt_us = 0;
+        uint32_t rttvar_us = 0;
+        uint32_t rto_us = kInitialRtoUs;
 
-    uint8_t packet_number_ = 0;
+        void AddSample(uint32_t rtt_us);
+    };
+
+    // The congestion window towards one neighbour
+    struct CongestionState
+    {
+        uint32_t cwnd = kInitialCwnd;
+        uint32_t ssthresh = UINT32_MAX;
+        // Packets acknowledged towards the next increase above ssthresh
+        uint32_t acked = 0;
+        // Losses of packets sent up to this send order belong to the last event
+        uint32_t recovery_send_order = 0;
+        uint32_t min_rtt_us = UINT32_MAX;
+        uint64_t min_rtt_time_us = 0;
+    };
+
+    // The fragments of a frame that arrived, echoed in every ack of it
+    struct AckedFrame
+    {
+        bool in_use = false;
+        uint8_t source = 0;
+        uint8_t message_id = 0;
+        // Set once the frame got a fragment in the batch being received
+        bool ack_due = false;
+        // The index of the final fragment plus one, zero until it arrived
+        uint8_t fragment_count = 0;
+        uint64_t last_received_us = 0;
+        std::bitset<MAX_FRAGMENTS_PER_FRAME> received;
+    };
+
+    // Queues a packet from upstream, dropping it if every slot is in use
+    void QueuePacket(PacketBuffer data, uint64_t now_us);
+    void ReleaseQueue(IntrusiveList<AckPacket> &queue);
+    // Whether a queued packet can enter the window and the radio can take it
+    bool CanSendNextPacket() const;
+    // Whether a packet keeps the frames in flight within kMaxFramesInFlight.
+    // Frames get their message_id in the order their packets enter the window,
+    // so a packet waiting for a retransmit holds back the frames far behind it.
+    bool FitsFramesInFlight(const AckPacket *ack_packet) const;
+    // Parity packets and loss reports are sent without waiting for an ack
+    static bool NeedsAck(const PacketBuffer &data);
+    // Appends a transmission of a pending packet to tx_batch_ and starts its
+    // timeout, which fires at the frame's deadline at the latest
+    void Transmit(AckPacket *ack_packet, uint64_t now_us);
+    void QueueRetransmit(AckPacket *ack_packet);
+    static void RetransmitTimeout(nerfnet::TimerWheel::Timer *timer, void *context);
+    // The retransmits the traffic class of a packet allows
+    uint32_t MaxRetransmits(const AckPacket *ack_packet) const;
+    static bool Expired(const AckPacket *ack_packet, uint64_t now_us);
+    // Releases a pending packet that is past its deadline or out of
+    // retransmits, returns false if it is neither
+    bool DropIfStale(AckPacket *ack_packet, uint64_t now_us);
+
+    // Handles a packet from the radio, returns whether it goes upstream
+    bool ReceivePacket(const PacketBuffer &data, uint64_t now_us);
+    // The message ids of the last kDuplicateWindowSize frames or packed
+    // packets from a source that were received whole. Ids are 8 bits and
+    // count up, one further behind than the window is taken for new.
+    struct DuplicateWindow
+    {
+        bool valid = false;
+        uint8_t highest = 0;
+        // Bit i is message id highest - i
+        uint64_t received = 0;
+
+        bool Contains(uint8_t message_id) const;
+        void Add(uint8_t message_id);
+    };
+    // Frames and packed packets are numbered apart
+    struct SourceWindows
+    {
+        uint64_t last_received_us = 0;
+        DuplicateWindow frames;
+        DuplicateWindow packs;
+    };
+
+    // Records a fragment that arrived and marks its frame for an ack, returns
+    // false if it arrived before
+    bool RecordFragment(const PacketBuffer &data, uint64_t now_us);
+    // Records the final fragment of a frame, which came in a packed packet
+    void RecordPackedTail(uint8_t source, uint8_t message_id, uint8_t fragment_index, uint64_t now_us);
+    // Adds a frame with every fragment received to the duplicate window
+    void CheckFrameComplete(AckedFrame &frame, uint64_t now_us);
+    // The duplicate windows of a source, nullptr for sources not tracked.
+    // Forgets them if the source was quiet for kAckedFrameTimeoutUs.
+    SourceWindows *WindowsOf(uint8_t source, uint64_t now_us);
+    AckedFrame &FindOrStartFrame(uint8_t source, uint8_t message_id, uint64_t now_us);
+    void MarkAckDue(AckedFrame &frame);
+    // Starts the ack delay, if it is not running yet
+    void ScheduleAcks(uint64_t now_us);
+    static void AckDelayElapsed(nerfnet::TimerWheel::Timer *timer, void *context);
+    // Writes the ack record of a frame, returns its size
+    static size_t EncodeAckRecord(const AckedFrame &frame, uint8_t *record);
+    // Writes an ack record for every frame and packed packet received since
+    // the last call, into the packed packets of tx_batch_ and into ack_batch_
+    void FlushAcks();
+    void SendAckBatch();
+    void ReceiveAckRecords(const uint8_t *records, size_t size, uint8_t source, uint64_t now_us);
+    void ReceivePackedAck(uint8_t message_id, uint8_t source, uint64_t now_us);
+    // Releases the pending packets an ack covers and marks the ones it shows lost
+    void ReceiveFrameAck(uint8_t message_id, uint8_t cumulative, const uint8_t *bitmap, size_t bitmap_size,
+                         uint8_t source, uint64_t now_us);
+    // Updates the round trip time of a neighbour and the statistics
+    void AddRttSample(uint8_t neighbour, uint64_t rtt_us, uint64_t now_us);
+
+    // Whether the round trip time to a neighbour shows a queue
+    bool Queueing(uint8_t neighbour) const;
+    // Grows the congestion window for packets an ack released
+    void OnPacketsAcked(uint8_t neighbour, uint32_t count);
+    // Shrinks the congestion window for a packet shown lost or timed out
+    void OnLoss(const AckPacket *ack_packet);
+    // The pacing gap between packets to neighbour_, zero before its round trip time is known
+    uint32_t PacingIntervalUs() const;
+    uint64_t PacingBudgetUs(uint64_t now_us) const;
+    bool CanPace(uint64_t now_us) const;
+    // Takes a packet's gap from the pacing budget
+    void Pace(uint64_t now_us);
+    void UpdateCongestionStats(uint8_t neighbour);
+
+    // Gives a packet the next sequence number and puts it in the window
+    void AddPending(AckPacket *ack_packet);
+    // The packet waiting for an ack with a sequence number, or nullptr if it
+    // is not in the window or was acknowledged
+    AckPacket *PendingAt(uint32_t sequence) const;
+    // Frees a pending packet and moves the window past the acknowledged ones
+    void ReleasePending(AckPacket *ack_packet);
+    // Moves oldest_frame_id_ past the frames the window moved past
+    void AdvanceOldestFrame();
+    void ReleaseWindow();
+
+    Slab<AckPacket> packet_slab_;
+    IntrusiveList<AckPacket> fragmented_packets_;
+    // The packets waiting for an ack, at their sequence number modulo the
+    // ring size, kRingSpan windows rounded up to a power of two
+    std::vector<AckPacket *> pending_ring_;
+    uint32_t ring_mask_ = 0;
+    uint32_t pending_count_ = 0;
+    // The sequence number of the oldest packet waiting for an ack, and the
+    // one the next packet gets
+    uint32_t base_sequence_ = 0;
+    uint32_t next_sequence_ = 0;
+    // The sequence numbers the fragments of the last frame with each
+    // message_id were given, and those of the last DataPacked packets
+    struct FrameSequences
+    {
+        uint32_t first = 0;
+        uint32_t end = 0;
+    };
+    std::array<FrameSequences, 256> frame_sequences_ = {};
+    std::array<uint32_t, 256> packed_sequences_ = {};
+    // The message_ids of the oldest frame the window has not moved past and
+    // of the newest frame in it
+    uint8_t oldest_frame_id_ = 0;
+    uint8_t newest_frame_id_ = 0;
+    uint32_t send_order_ = 0;
+    // The packets sent by the last Run, new ones and retransmits
+    PacketBatch tx_batch_;
+    // The acks for the packets being received
+    PacketBatch ack_batch_;
+    // The frames the receiver tracks the fragments of, acked_frames_per_source_
+    // of them per source, each at its message_id modulo that
+    std::vector<AckedFrame> acked_frames_;
+    size_t acked_frames_per_source_ = 0;
+    // The frames with ack_due set, in the order they got it
+    std::vector<AckedFrame *> due_frames_;
+    std::array<SourceWindows, kMaxNeighbours> duplicate_windows_;
+    // The message_ids of the packed packets received since the last acks
+    std::array<uint8_t, kMaxPackedAcks> packed_acks_ = {};
+    size_t packed_ack_count_ = 0;
+    nerfnet::TimerWheel::Timer ack_timer_;
+    // Set once the ack delay elapsed, the acks go out with the next Run
+    bool acks_due_ = false;
+    // Pending packets that timed out or were shown lost, in the order they did
+    IntrusiveList<AckPacket> retransmit_queue_;
+    std::array<RttEstimator, kMaxNeighbours> rtt_;
+    std::array<CongestionState, kMaxNeighbours> congestion_;
+    // Time saved up for sending, see kPacingBurstUs, as of pacing_update_us_
+    uint64_t pacing_budget_us_ = 0;
+    uint64_t pacing_update_us_ = 0;
+    // The neighbour the last ack came from. Data goes to a single neighbour,
+    // new packets are timed with its round trip time.
+    uint8_t neighbour_ = 0;
 };
 
 #endif // ACK_LAYER_H
@@ -0,0 +1,469 @@
+#include "forward_error_correction_layer.h"
+#include "ack_handling_layer.h"
+#include <algorithm>
+#include <cstring>
+#include "log.h"
+#include "nrftime.h"
+
+namespace
+{
+    // Middle fragments are always full, so their bytes after the compact
+    // header line up: the payload of a DataFragment, the length byte and
+    // payload of a Data packet that is not final
+    bool IsMiddleFragment(const DataPacket &packet)
+    {
+        return packet.packet_type == static_cast<uint8_t>(PacketType::DataFragment) ||
+               (packet.packet_type == static_cast<uint8_t>(PacketType::Data) && !packet.final_packet);
+    }
+
+    bool IsFinalFragment(const DataPacket &packet)
+    {
+        return packet.packet_type == static_cast<uint8_t>(PacketType::Data) && packet.final_packet;
+    }
+
+    size_t GroupSize(uint8_t group)
+    {
+        return static_cast<size_t>(MIN_PARITY_GROUP_SIZE) << (group >> PARITY_GROUP_SIZE_SHIFT);
+    }
+
+    size_t GroupStart(uint8_t group)
+    {
+        return (group & PARITY_GROUP_INDEX_MASK) * GroupSize(group);
+    }
+
+    void XorInto(uint8_t *out, const uint8_t *in)
+    {
+        for (size_t i = 0; i < COMPACT_PACKET_PAYLOAD_SIZE; i++)
+        {
+            out[i] ^= in[i];
+        }
+    }
+}
+
+ForwardErrorCorrectionLayer::ForwardErrorCorrectionLayer()
+{
+    // Like the reassembly buffers, taken up front and kept by their slot
+    for (Frame &frame : frames_)
+    {
+        frame.bytes = PacketBuffer::Allocate(kMaxProtectedFragments * COMPACT_PACKET_PAYLOAD_SIZE);
+    }
+}
+
+void ForwardErrorCorrectionLayer::ReceiveFromUpstream(PacketBuffer data)
+{
+    if (!enabled_ || group_size_ == 0 || !(DownstreamLinkFeatures() & LINK_FEATURE_FORWARD_ERROR_CORRECTION))
+    {
+        SendDownstream(std::move(data));
+        return;
+    }
+    ProtectFragment(std::move(data));
+    SendDownstreamBatch(tx_batch_);
+}
+
+void ForwardErrorCorrectionLayer::ReceiveBatchFromUpstream(PacketBatch &batch)
+{
+    if (!enabled_ || group_size_ == 0 || !(DownstreamLinkFeatures() & LINK_FEATURE_FORWARD_ERROR_CORRECTION))
+    {
+        SendDownstreamBatch(batch);
+        return;
+    }
+    for (PacketBuffer &data : batch)
+    {
+        ProtectFragment(std::move(data));
+    }
+    batch.clear();
+    SendDownstreamBatch(tx_batch_);
+}
+
+void ForwardErrorCorrectionLayer::ProtectFragment(PacketBuffer data)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    if (!IsMiddleFragment(packet) || packet.fragment_index >= kMaxProtectedFragments)
+    {
+        tx_batch_.push_back(std::move(data));
+        return;
+    }
+
+    // The group size is picked per frame, the receiver learns it from the parity packets
+    if (packet.message_id != tx_message_id_ || packet.fragment_index == 0)
+    {
+        tx_message_id_ = packet.message_id;
+        tx_group_size_ = group_size_;
+        tx_group_members_ = 0;
+    }
+    if (tx_group_size_ == 0)
+    {
+        tx_batch_.push_back(std::move(data));
+        return;
+    }
+    size_t position = packet.fragment_index % tx_group_size_;
+    if (position == 0)
+    {
+        tx_group_members_ = 0;
+        std::memset(tx_parity_, 0, sizeof(tx_parity_));
+    }
+    // A group that did not see all of its fragments in order gets no parity
+    if (position != tx_group_members_)
+    {
+        tx_group_members_ = 0;
+        tx_batch_.push_back(std::move(data));
+        return;
+    }
+    XorInto(tx_parity_, packet.compact_payload);
+    tx_group_members_++;
+    uint64_t trace_start_us = data.trace_start_us();
+    uint8_t fragment_index = packet.fragment_index;
+    tx_batch_.push_back(std::move(data));
+    if (tx_group_members_ < tx_group_size_)
+    {
+        return;
+    }
+    tx_group_members_ = 0;
+
+    PacketBuffer parity = PacketBuffer::Allocate(PACKET_SIZE);
+    if (!parity.valid())
+    {
+        LOGW("Out of packet buffers, not sending parity");
+        return;
+    }
+    DataPacket &parity_packet = AsDataPacket(parity);
+    std::memset(parity_packet.raw_data, 0, PACKET_SIZE);
+    parity_packet.packet_type = static_cast<uint8_t>(PacketType::DataParity);
+    parity_packet.message_id = tx_message_id_;
+    parity_packet.fragment_index =
+        static_cast<uint8_t>(((__builtin_ctz(tx_group_size_) - 1) << PARITY_GROUP_SIZE_SHIFT) |
+                             (fragment_index / tx_group_size_));
+    std::memcpy(parity_packet.compact_payload, tx_parity_, sizeof(tx_parity_));
+    parity.set_trace_start_us(trace_start_us);
+    tx_batch_.push_back(std::move(parity));
+    INCREMENT_STATS(&stats, fec_parity_sent);
+}
+
+size_t ForwardErrorCorrectionLayer::TxCredits() const
+{
+    size_t credits = DownstreamTxCredits();
+    if (!enabled_ || group_size_ == 0 || credits == kUnlimitedCredits)
+    {
+        return credits;
+    }
+    return credits / PACKET_SIZE * group_size_ / (group_size_ + 1) * PACKET_SIZE;
+}
+
+void ForwardErrorCorrectionLayer::ReceiveFromDownstream(PacketBuffer data)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    uint64_t now_us = nerfnet::TimeNowUs();
+    switch (packet.packet_type)
+    {
+    case static_cast<uint8_t>(PacketType::DataParity):
+        ReceiveParity(data, now_us);
+        break;
+    case static_cast<uint8_t>(PacketType::FecReport):
+        group_size_ = GroupSizeForLoss(packet.compact_payload[0]);
+        UPDATE_STATS(&stats, fec_group_size, group_size_);
+        break;
+    default:
+        ReceiveFragment(data, now_us);
+        SendUpstream(std::move(data));
+        break;
+    }
+    MaybeSendReport(now_us);
+}
+
+void ForwardErrorCorrectionLayer::ReceiveFragment(const PacketBuffer &data, uint64_t now_us)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    bool final_packet = IsFinalFragment(packet);
+    bool middle = IsMiddleFragment(packet) && packet.fragment_index < kMaxProtectedFragments;
+    if (!final_packet && !middle)
+    {
+        return;
+    }
+    Frame *frame = FindOrStartFrame(data.source(), packet.message_id, now_us);
+    if (!frame)
+    {
+        return;
+    }
+    frame->last_fragment_us = now_us;
+    if (final_packet)
+    {
+        frame->final_seen = true;
+        frame->middle_count = std::min<uint8_t>(packet.fragment_index, kMaxProtectedFragments);
+        return;
+    }
+    if (frame->received.test(packet.fragment_index))
+    {
+        return;
+    }
+    if (!frame->final_seen && packet.fragment_index >= frame->middle_count)
+    {
+        if (frame->fragments_received == 0)
+        {
+            frame->first_index = packet.fragment_index;
+        }
+        frame->fragments_received++;
+    }
+    frame->received.set(packet.fragment_index);
+    frame->middle_type = packet.packet_type;
+    if (!frame->final_seen)
+    {
+        frame->middle_count = std::max<uint8_t>(frame->middle_count, packet.fragment_index + 1);
+    }
+    std::memcpy(frame->bytes.data() + packet.fragment_index * COMPACT_PACKET_PAYLOAD_SIZE,
+                packet.compact_payload, COMPACT_PACKET_PAYLOAD_SIZE);
+    RecoverPending(*frame, packet.fragment_index, now_us);
+}
+
+void ForwardErrorCorrectionLayer::ReceiveParity(const PacketBuffer &data, uint64_t now_us)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    uint8_t group = packet.fragment_index;
+    if (GroupStart(group) + GroupSize(group) > kMaxProtectedFragments)
+    {
+        LOGW("Malformed parity for message %d, dropping it", packet.message_id);
+        return;
+    }
+    Frame *frame = FindOrStartFrame(data.source(), packet.message_id, now_us);
+    if (!frame)
+    {
+        return;
+    }
+    frame->last_fragment_us = now_us;
+    if (Recover(*frame, group, packet.compact_payload, now_us))
+    {
+        return;
+    }
+    // Wait for a retransmit of the other missing fragments
+    for (PendingParity &pending : frame->parities)
+    {
+        if (!pending.in_use)
+        {
+            pending.in_use = true;
+            pending.group = group;
+            std::memcpy(pending.bytes, packet.compact_payload, COMPACT_PACKET_PAYLOAD_SIZE);
+            return;
+        }
+    }
+}
+
+size_t ForwardErrorCorrectionLayer::CountMissing(const Frame &frame, uint8_t group, uint8_t *missing)
+{
+    size_t count = 0;
+    size_t start = GroupStart(group);
+    for (size_t i = start; i < start + GroupSize(group); i++)
+    {
+        if (!frame.received.test(i))
+        {
+            *missing = static_cast<uint8_t>(i);
+            count++;
+        }
+    }
+    return count;
+}
+
+bool ForwardErrorCorrectionLayer::Recover(Frame &frame, uint8_t group, const uint8_t *parity, uint64_t now_us)
+{
+    uint8_t missing = 0;
+    size_t missing_count = CountMissing(frame, group, &missing);
+    if (missing_count == 0)
+    {
+        return true;
+    }
+    if (missing_count > 1)
+    {
+        return false;
+    }
+
+    PacketBuffer rebuilt = PacketBuffer::Allocate(PACKET_SIZE);
+    if (!rebuilt.valid())
+    {
+        LOGW("Out of packet buffers, not rebuilding fragment %d of message %d", missing, frame.message_id);
+        return true;
+    }
+    DataPacket &packet = AsDataPacket(rebuilt);
+    packet.raw_data[0] = 0;
+    packet.packet_type = frame.middle_type;
+    packet.message_id = frame.message_id;
+    packet.fragment_index = missing;
+    std::memcpy(packet.compact_payload, parity, COMPACT_PACKET_PAYLOAD_SIZE);
+    size_t start = GroupStart(group);
+    for (size_t i = start; i < start + GroupSize(group); i++)
+    {
+        if (i != missing)
+        {
+            XorInto(packet.compact_payload, frame.bytes.data() + i * COMPACT_PACKET_PAYLOAD_SIZE);
+        }
+    }
+    std::memcpy(frame.bytes.data() + missing * COMPACT_PACKET_PAYLOAD_SIZE, packet.compact_payload,
+                COMPACT_PACKET_PAYLOAD_SIZE);
+    frame.received.set(missing);
+    if (!frame.final_seen)
+    {
+        frame.middle_count = std::max<uint8_t>(frame.middle_count, missing + 1);
+    }
+
+    rebuilt.set_source(frame.source);
+    rebuilt.set_trace_start_us(now_us);
+    INCREMENT_STATS(&stats, fec_fragments_recovered);
+    if (ack_layer_)
+    {
+        ack_layer_->FragmentRecovered(frame.source, frame.message_id, missing);
+    }
+    SendUpstream(std::move(rebuilt));
+    return true;
+}
+
+void ForwardErrorCorrectionLayer::RecoverPending(Frame &frame, uint8_t fragment_index, uint64_t now_us)
+{
+    for (PendingParity &pending : frame.parities)
+    {
+        if (pending.in_use && fragment_index >= GroupStart(pending.group) &&
+            fragment_index < GroupStart(pending.group) + GroupSize(pending.group) &&
+            Recover(frame, pending.group, pending.bytes, now_us))
+        {
+            pending.in_use = false;
+        }
+    }
+}
+
+ForwardErrorCorrectionLayer::Frame *ForwardErrorCorrectionLayer::FindOrStartFrame(uint8_t source, uint8_t message_id,
+                                                                                  uint64_t now_us)
+{
+    Frame *free_slot = nullptr;
+    Frame *oldest = nullptr;
+    for (Frame &frame : frames_)
+    {
+        if (frame.in_use && now_us - frame.last_fragment_us >= kFrameTimeoutUs)
+        {
+            FinishFrame(frame);
+        }
+        if (!frame.in_use)
+        {
+            if (!free_slot && frame.bytes.valid())
+            {
+                free_slot = &frame;
+            }
+            continue;
+        }
+        if (frame.source == source && frame.message_id == message_id)
+        {
+            return &frame;
+        }
+        if (!oldest || frame.last_fragment_us < oldest->last_fragment_us)
+        {
+            oldest = &frame;
+        }
+    }
+
+    if (!free_slot)
+    {
+        if (!oldest)
+        {
+            LOGW("Out of packet buffers, not collecting fragments for error correction");
+            return nullptr;
+        }
+        FinishFrame(*oldest);
+        free_slot = oldest;
+    }
+    free_slot->in_use = true;
+    free_slot->source = source;
+    free_slot->message_id = message_id;
+    return free_slot;
+}
+
+void ForwardErrorCorrectionLayer::FinishFrame(Frame &frame)
+{
+    if (frame.fragments_received > 0 && frame.middle_count > frame.first_index)
+    {
+        uint32_t expected = frame.middle_count - frame.first_index;
+        fragments_expected_ += expected;
+        fragments_lost_ += expected - std::min<uint32_t>(expected, frame.fragments_received);
+    }
+    frame.in_use = false;
+    frame.middle_count = 0;
+    frame.first_index = 0;
+    frame.final_seen = false;
+    frame.fragments_received = 0;
+    frame.received.reset();
+    for (PendingParity &pending : frame.parities)
+    {
+        pending.in_use = false;
+    }
+}
+
+void ForwardErrorCorrectionLayer::MaybeSendReport(uint64_t now_us)
+{
+    if (!enabled_ || fragments_expected_ == 0 || now_us - last_estimate_us_ < kEstimateIntervalUs ||
+        !(DownstreamLinkFeatures() & LINK_FEATURE_FORWARD_ERROR_CORRECTION))
+    {
+        return;
+    }
+    // Smoothed over a few intervals so one unlucky burst does not swing the group size
+    uint32_t loss = std::min<uint32_t>(fragments_lost_ * 256 / fragments_expected_, 255);
+    loss_ = (loss_ * 3 + loss) / 4;
+    fragments_expected_ = 0;
+    fragments_lost_ = 0;
+    last_estimate_us_ = now_us;
+    UPDATE_STATS(&stats, fec_loss_percent, loss_ * 100.0f / 256);
+
+    // Reports compete with the data for airtime, so they are only sent when
+    // the peer would change its group size, and now and then in case one
+    // of them was lost
+    uint8_t group_size = GroupSizeForLoss(static_cast<uint8_t>(loss_));
+    if (group_size == reported_group_size_ &&
+        (group_size == 0 || now_us - last_report_us_ < kReportRefreshIntervalUs))
+    {
+        return;
+    }
+    PacketBuffer report = PacketBuffer::Allocate(PACKET_SIZE);
+    if (!report.valid())
+    {
+        LOGW("Out of packet buffers, not sending a loss report");
+        return;
+    }
+    DataPacket &packet = AsDataPacket(report);
+    std::memset(packet.raw_data, 0, PACKET_SIZE);
+    packet.packet_type = static_cast<uint8_t>(PacketType::FecReport);
+    packet.compact_payload[0] = static_cast<uint8_t>(loss_);
+    reported_group_size_ = group_size;
+    last_report_us_ = now_us;
+    SendDownstream(std::move(report));
+}
+
+uint8_t ForwardErrorCorrectionLayer::GroupSizeForLoss(uint8_t loss)
+{
+    // With one parity per group a frame survives a single loss per group.
+    // Below about 1% loss that rarely pays for the extra airtime.
+    if (loss < 3)
+    {
+        return 0;
+    }
+    if (loss < 8)
+    {
+        return 16;
+    }
+    if (loss < 16)
+    {
+        return 8;
+    }
+    if (loss < 32)
+    {
+        return 4;
+    }
+    return 2;
+}
+
+void ForwardErrorCorrectionLayer::Reset()
+{
+    for (Frame &frame : frames_)
+    {
+        FinishFrame(frame);
+    }
+    group_size_ = 0;
+    tx_group_size_ = 0;
+    tx_group_members_ = 0;
+    fragments_expected_ = 0;
+    fragments_lost_ = 0;
+    loss_ = 0;
+    reported_group_size_ = 0;
+}
@@ -0,0 +1,149 @@
+#ifndef FORWARD_ERROR_CORRECTION_LAYER_H
+#define FORWARD_ERROR_CORRECTION_LAYER_H
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include "ILayer.h"
+#include "message_definitions.h"
+
+class AckLayer;
+
+// Sends a DataParity packet after every group of middle fragments of a frame,
+// the XOR of everything after their compact header. A receiver missing one
+// fragment of a group rebuilds it from the others and the parity, a round
+// trip before the ack layer's retransmit would arrive. With acks enabled the
+// ack layer is told with FragmentRecovered and acknowledges the fragment, so
+// the sender does not retransmit it. Without acks parity is the only
+// recovery there is.
+//
+// Groups are aligned to their size within the frame, middle fragments past
+// the last whole group and final fragments are not covered. The receiver
+// reports the fraction of fragments it lost in FecReport packets, and the
+// sender picks smaller groups as the loss grows. Both are only sent once the
+// link negotiated LINK_FEATURE_FORWARD_ERROR_CORRECTION.
+class ForwardErrorCorrectionLayer final : public ILayer
+{
+public:
+    ForwardErrorCorrectionLayer();
+
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    void ReceiveBatchFromUpstream(PacketBatch &batch) override;
+    // The downstream credits less the share parity packets take
+    size_t TxCredits() const override;
+    void Reset() override;
+
+    void Enable(bool enabled)
+    {
+        enabled_ = enabled;
+    }
+
+    // The ack layer told about every fragment rebuilt, or nullptr without acks
+    void SetAckLayer(AckLayer *ack_layer)
+    {
+        ack_layer_ = ack_layer;
+    }
+
+private:
+    // Fragments past this index are not protected, the receiver keeps the
+    // rest of a frame in one pooled buffer. Only the last few fragments of
+    // the largest frames without compact fragments are past it.
+    static constexpr size_t kMaxProtectedFragments = PACKET_BUFFER_MAX_FRAME_SIZE / COMPACT_PACKET_PAYLOAD_SIZE;
+    // The number of frames the receiver collects fragments of at once
+    static constexpr size_t kMaxFrames = 4;
+    // Parity packets that arrived with more than one fragment of their group missing
+    static constexpr size_t kMaxPendingParities = 4;
+    // A frame that received nothing for this long is done, lost fragments and all
+    static constexpr uint64_t kFrameTimeoutUs = 1000000; // 1s
+    // How often the receiver updates its estimate of the loss
+    static constexpr uint64_t kEstimateIntervalUs = 500000; // 500ms
+    // How often an unchanged estimate is reported again, unless it asks for no parity
+    static constexpr uint64_t kReportRefreshIntervalUs = 5000000; // 5s
+
+    struct PendingParity
+    {
+        bool in_use = false;
+        uint8_t group = 0;
+        uint8_t bytes[COMPACT_PACKET_PAYLOAD_SIZE];
+    };
+
+    // The middle fragments received of a frame. The bytes after the compact
+    // header of fragment i are kept at i * COMPACT_PACKET_PAYLOAD_SIZE.
+    struct Frame
+    {
+        bool in_use = false;
+        uint8_t source = 0;
+        uint8_t message_id = 0;
+        // The type of the middle fragments, the same for all of them
+        uint8_t middle_type = 0;
+        // The index of the final fragment once it passed, otherwise the
+        // highest middle fragment index plus one
+        uint8_t middle_count = 0;
+        // Loss is counted from the first fragment received, a late retransmit
+        // of a frame that was already finished does not look like a lost frame
+        uint8_t first_index = 0;
+        bool final_seen = false;
+        // Fragments that came over the air in the sender's first pass over
+        // the frame, which goes out in index order. Rebuilt ones and
+        // retransmits, those behind the highest index or after the final
+        // fragment, are not counted so they don't hide the loss.
+        uint8_t fragments_received = 0;
+        uint64_t last_fragment_us = 0;
+        std::bitset<kMaxProtectedFragments> received;
+        std::array<PendingParity, kMaxPendingParities> parities;
+        PacketBuffer bytes;
+    };
+
+    // Moves a fragment to tx_batch_, followed by the parity of its group if
+    // it is the last middle fragment of one
+    void ProtectFragment(PacketBuffer data);
+
+    void ReceiveFragment(const PacketBuffer &data, uint64_t now_us);
+    void ReceiveParity(const PacketBuffer &data, uint64_t now_us);
+    // Rebuilds the fragment missing from the group of a parity and hands it
+    // upstream. Returns false if more than one fragment is missing, the
+    // parity is of no more use once it returns true.
+    bool Recover(Frame &frame, uint8_t group, const uint8_t *parity, uint64_t now_us);
+    // Returns the number of fragments of a group not received yet, and the
+    // index of one of them in `missing`
+    static size_t CountMissing(const Frame &frame, uint8_t group, uint8_t *missing);
+    // Tries the parities waiting for a group that just received a fragment
+    void RecoverPending(Frame &frame, uint8_t fragment_index, uint64_t now_us);
+
+    // Finds the frame a fragment belongs to or starts a new one, finishing
+    // the oldest if every slot is in use
+    Frame *FindOrStartFrame(uint8_t source, uint8_t message_id, uint64_t now_us);
+    // Counts the fragments the frame lost towards the next report
+    void FinishFrame(Frame &frame);
+    void MaybeSendReport(uint64_t now_us);
+
+    // Maps the loss the peer reported to a group size, zero for no parity
+    static uint8_t GroupSizeForLoss(uint8_t loss);
+
+    bool enabled_ = true;
+    AckLayer *ack_layer_ = nullptr;
+
+    // The group size the next frame is sent with, set from the peer's reports
+    uint8_t group_size_ = 0;
+    // The frame being sent and the group its middle fragments are added to
+    uint8_t tx_message_id_ = 0;
+    uint8_t tx_group_size_ = 0;
+    uint8_t tx_group_members_ = 0;
+    uint8_t tx_parity_[COMPACT_PACKET_PAYLOAD_SIZE] = {};
+    // The fragments from upstream with the parity packets between them
+    PacketBatch tx_batch_;
+
+    std::array<Frame, kMaxFrames> frames_;
+    // The fragments expected and lost since the last report, and the smoothed
+    // loss in 256ths
+    uint32_t fragments_expected_ = 0;
+    uint32_t fragments_lost_ = 0;
+    uint32_t loss_ = 0;
+    uint64_t last_estimate_us_ = 0;
+    // The group size the last report asked the peer for, the peer starts without parity
+    uint8_t reported_group_size_ = 0;
+    uint64_t last_report_us_ = 0;
+};
+
+#endif // FORWARD_ERROR_CORRECTION_LAYER_H
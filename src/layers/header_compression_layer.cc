@@ -0,0 +1,566 @@
+#include "header_compression_layer.h"
+#include <cstring>
+#include "log.h"
+#include "nrftime.h"
+
+namespace
+{
+    constexpr uint8_t kProtocolTcp = 6;
+    constexpr uint8_t kProtocolUdp = 17;
+    constexpr size_t kIpHeaderSize = 20;
+    constexpr size_t kTcpHeaderSize = 20;
+    constexpr size_t kUdpHeaderSize = 8;
+    constexpr uint8_t kTcpFlagAck = 0x10;
+
+    // The change mask following the dispatch byte of a compressed header. The
+    // IP id is sent as its low 8 bits and the TCP sequence and ack numbers
+    // as their low 16 bits unless the mask says they are sent in full.
+    constexpr uint8_t kIpIdFull = 1 << 0;
+    constexpr uint8_t kSeqFull = 1 << 1;
+    constexpr uint8_t kAckFull = 1 << 2;
+    constexpr uint8_t kWindowChanged = 1 << 3;
+    // NOP, NOP, timestamp: both timestamps as their low 16 bits
+    constexpr uint8_t kTimestampOption = 1 << 4;
+    // Any other options, a length byte followed by the options
+    constexpr uint8_t kRawOptions = 1 << 5;
+
+    // How far below its reference a value sent as its low 16 bits may be,
+    // retransmissions go back in sequence space
+    constexpr uint32_t kLsbOffset = 1 << 14;
+
+    uint16_t Read16(const uint8_t *p)
+    {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+
+    uint32_t Read32(const uint8_t *p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    void Write16(uint8_t *p, uint16_t value)
+    {
+        p[0] = value >> 8;
+        p[1] = value & 0xFF;
+    }
+
+    void Write32(uint8_t *p, uint32_t value)
+    {
+        Write16(p, value >> 16);
+        Write16(p + 2, value & 0xFFFF);
+    }
+
+    bool FitsLsb16(uint32_t value, uint32_t reference)
+    {
+        return value - (reference - kLsbOffset) < 0x10000;
+    }
+
+    uint32_t DecodeLsb16(uint16_t lsb, uint32_t reference)
+    {
+        uint32_t base = reference - kLsbOffset;
+        return base + static_cast<uint16_t>(lsb - static_cast<uint16_t>(base));
+    }
+
+    // The ones' complement sum used by the IP, TCP and UDP checksums
+    uint32_t ChecksumAdd(uint32_t sum, const uint8_t *data, size_t size)
+    {
+        for (size_t i = 0; i + 1 < size; i += 2)
+        {
+            sum += (data[i] << 8) | data[i + 1];
+        }
+        if (size & 1)
+        {
+            sum += data[size - 1] << 8;
+        }
+        return sum;
+    }
+
+    uint16_t ChecksumFinish(uint32_t sum)
+    {
+        while (sum >> 16)
+        {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return static_cast<uint16_t>(~sum);
+    }
+
+    // Sums the pseudo header and the transport header and payload of a packet,
+    // checksum field included, so a correct checksum gives zero
+    uint16_t TransportChecksum(const uint8_t *packet, size_t size)
+    {
+        uint32_t sum = ChecksumAdd(0, packet + 12, 8);
+        sum += packet[9];
+        sum += static_cast<uint32_t>(size - kIpHeaderSize);
+        return ChecksumFinish(ChecksumAdd(sum, packet + kIpHeaderSize, size - kIpHeaderSize));
+    }
+
+    // Returns the size of the IPv4 and TCP/UDP headers of a packet that can be
+    // compressed, or zero. IP options and fragments are left alone.
+    size_t CompressibleHeaderSize(const uint8_t *packet, size_t size)
+    {
+        if (size < kIpHeaderSize || packet[0] != 0x45 || Read16(packet + 2) != size ||
+            (Read16(packet + 6) & 0x3FFF) != 0)
+        {
+            return 0;
+        }
+        if (packet[9] == kProtocolTcp)
+        {
+            if (size < kIpHeaderSize + kTcpHeaderSize)
+            {
+                return 0;
+            }
+            const uint8_t *tcp = packet + kIpHeaderSize;
+            size_t tcp_size = (tcp[12] >> 4) * 4;
+            // The reserved bits and NS share the byte with the data offset
+            if (tcp_size < kTcpHeaderSize || (tcp[12] & 0x0F) != 0 || size < kIpHeaderSize + tcp_size)
+            {
+                return 0;
+            }
+            return kIpHeaderSize + tcp_size;
+        }
+        if (packet[9] == kProtocolUdp)
+        {
+            if (size < kIpHeaderSize + kUdpHeaderSize || Read16(packet + kIpHeaderSize + 4) != size - kIpHeaderSize)
+            {
+                return 0;
+            }
+            return kIpHeaderSize + kUdpHeaderSize;
+        }
+        return 0;
+    }
+
+    // Protocol, addresses and ports
+    bool SameFlow(const uint8_t *a, const uint8_t *b)
+    {
+        return a[9] == b[9] && memcmp(a + 12, b + 12, 8) == 0 &&
+               memcmp(a + kIpHeaderSize, b + kIpHeaderSize, 4) == 0;
+    }
+
+    // The fields a compressed header does not carry: version, TOS, flags, TTL
+    // and the TCP urgent pointer. A change means sending the header in full.
+    bool SameStaticFields(const uint8_t *a, const uint8_t *b)
+    {
+        if (memcmp(a, b, 2) != 0 || memcmp(a + 6, b + 6, 3) != 0)
+        {
+            return false;
+        }
+        return a[9] != kProtocolTcp || Read16(a + kIpHeaderSize + 18) == Read16(b + kIpHeaderSize + 18);
+    }
+
+    // Reads the fields of a compressed header. Reading past the end marks the
+    // header malformed and yields zeros, so it is checked once at the end.
+    struct FieldReader
+    {
+        const uint8_t *data;
+        size_t size;
+        size_t pos;
+        bool malformed = false;
+
+        const uint8_t *Take(size_t length)
+        {
+            static const uint8_t kZeros[256] = {};
+            if (pos + length > size)
+            {
+                malformed = true;
+                return kZeros;
+            }
+            const uint8_t *field = data + pos;
+            pos += length;
+            return field;
+        }
+    };
+
+    bool IsTimestampOption(const uint8_t *options, size_t size)
+    {
+        return size == 12 && options[0] == 1 && options[1] == 1 && options[2] == 8 && options[3] == 10;
+    }
+}
+
+void HeaderCompressionLayer::ReceiveFromUpstream(PacketBuffer data)
+{
+    size_t header_size = 0;
+    if ((DownstreamLinkFeatures() & LINK_FEATURE_HEADER_COMPRESSION) && !data.IsShared())
+    {
+        header_size = CompressibleHeaderSize(data.data(), data.size());
+    }
+    if (header_size == 0)
+    {
+        SendDownstream(std::move(data));
+        return;
+    }
+
+    size_t cid = FindOrStartContext(data.data());
+    Context &context = compressor_contexts_[cid];
+    if (!context.valid || context.needs_refresh || context.packets_since_refresh >= kRefreshInterval ||
+        !SameStaticFields(context.header, data.data()))
+    {
+        memcpy(context.header, data.data(), header_size);
+        context.header_size = static_cast<uint8_t>(header_size);
+        context.valid = true;
+        context.needs_refresh = false;
+        context.packets_since_refresh = 0;
+        *data.Prepend(1) = FRAME_DISPATCH_HC_REFRESH | cid;
+        INCREMENT_STATS(&stats, header_context_refreshes);
+        SendDownstream(std::move(data));
+        return;
+    }
+
+    uint8_t compressed[kMaxHeaderSize];
+    size_t compressed_size = CompressHeader(cid, data.data(), header_size, compressed);
+    memcpy(context.header, data.data(), header_size);
+    context.header_size = static_cast<uint8_t>(header_size);
+    context.packets_since_refresh++;
+
+    // The compressed header is never longer than the original one, so it fits
+    // in the space the original header leaves behind
+    data.TrimFront(header_size);
+    memcpy(data.Prepend(compressed_size), compressed, compressed_size);
+    UPDATE_STATS(&stats, header_bytes_saved, logger.stats.header_bytes_saved + (header_size - compressed_size));
+    SendDownstream(std::move(data));
+}
+
+size_t HeaderCompressionLayer::FindOrStartContext(const uint8_t *header)
+{
+    size_t oldest = 0;
+    for (size_t cid = 0; cid < kMaxContexts; cid++)
+    {
+        Context &context = compressor_contexts_[cid];
+        if (context.valid && SameFlow(context.header, header))
+        {
+            context.last_used = ++use_counter_;
+            return cid;
+        }
+        if (!context.valid || (compressor_contexts_[oldest].valid && context.last_used < compressor_contexts_[oldest].last_used))
+        {
+            oldest = cid;
+        }
+    }
+    Context &context = compressor_contexts_[oldest];
+    context.valid = false;
+    context.last_used = ++use_counter_;
+    return oldest;
+}
+
+size_t HeaderCompressionLayer::CompressHeader(size_t cid, const uint8_t *header, size_t header_size, uint8_t *out) const
+{
+    const uint8_t *reference = compressor_contexts_[cid].header;
+    size_t reference_size = compressor_contexts_[cid].header_size;
+    size_t size = 0;
+    out[size++] = FRAME_DISPATCH_HC_COMPRESSED | cid;
+    uint8_t &mask = out[size++];
+    mask = 0;
+
+    const uint8_t *l4 = header + kIpHeaderSize;
+    const uint8_t *reference_l4 = reference + kIpHeaderSize;
+    uint8_t flags = l4[13];
+    if (header[9] == kProtocolTcp)
+    {
+        out[size++] = flags;
+    }
+
+    uint16_t ip_id = Read16(header + 4);
+    uint16_t reference_ip_id = Read16(reference + 4);
+    if (static_cast<uint16_t>(ip_id - reference_ip_id) < 0x100)
+    {
+        out[size++] = ip_id & 0xFF;
+    }
+    else
+    {
+        mask |= kIpIdFull;
+        Write16(out + size, ip_id);
+        size += 2;
+    }
+
+    if (header[9] == kProtocolUdp)
+    {
+        memcpy(out + size, l4 + 6, 2);
+        return size + 2;
+    }
+
+    uint32_t seq = Read32(l4 + 4);
+    if (FitsLsb16(seq, Read32(reference_l4 + 4)))
+    {
+        Write16(out + size, seq & 0xFFFF);
+        size += 2;
+    }
+    else
+    {
+        mask |= kSeqFull;
+        Write32(out + size, seq);
+        size += 4;
+    }
+
+    // The ack number is only sent with the ACK flag, without it the field
+    // still has to match as it is covered by the checksum
+    uint32_t ack = Read32(l4 + 8);
+    uint32_t reference_ack = Read32(reference_l4 + 8);
+    if ((flags & kTcpFlagAck) && FitsLsb16(ack, reference_ack))
+    {
+        Write16(out + size, ack & 0xFFFF);
+        size += 2;
+    }
+    else if ((flags & kTcpFlagAck) || ack != reference_ack)
+    {
+        mask |= kAckFull;
+        Write32(out + size, ack);
+        size += 4;
+    }
+
+    if (Read16(l4 + 14) != Read16(reference_l4 + 14))
+    {
+        mask |= kWindowChanged;
+        memcpy(out + size, l4 + 14, 2);
+        size += 2;
+    }
+
+    const uint8_t *options = l4 + kTcpHeaderSize;
+    size_t options_size = header_size - kIpHeaderSize - kTcpHeaderSize;
+    const uint8_t *reference_options = reference_l4 + kTcpHeaderSize;
+    size_t reference_options_size = reference_size - kIpHeaderSize - kTcpHeaderSize;
+    if (IsTimestampOption(options, options_size) && IsTimestampOption(reference_options, reference_options_size) &&
+        FitsLsb16(Read32(options + 4), Read32(reference_options + 4)) &&
+        FitsLsb16(Read32(options + 8), Read32(reference_options + 8)))
+    {
+        mask |= kTimestampOption;
+        Write16(out + size, Read32(options + 4) & 0xFFFF);
+        Write16(out + size + 2, Read32(options + 8) & 0xFFFF);
+        size += 4;
+    }
+    else if (options_size > 0)
+    {
+        mask |= kRawOptions;
+        out[size++] = static_cast<uint8_t>(options_size);
+        memcpy(out + size, options, options_size);
+        size += options_size;
+    }
+
+    memcpy(out + size, l4 + 16, 2);
+    return size + 2;
+}
+
+void HeaderCompressionLayer::ReceiveFromDownstream(PacketBuffer data)
+{
+    if (data.empty())
+    {
+        SendUpstream(std::move(data));
+        return;
+    }
+    uint8_t dispatch = data.data()[0];
+    switch (dispatch & FRAME_DISPATCH_MASK)
+    {
+    case FRAME_DISPATCH_HC_COMPRESSED:
+        ReceiveCompressed(std::move(data));
+        break;
+    case FRAME_DISPATCH_HC_REFRESH:
+        ReceiveRefresh(std::move(data));
+        break;
+    case FRAME_DISPATCH_HC_FEEDBACK:
+        compressor_contexts_[dispatch & 0x0F].needs_refresh = true;
+        break;
+    default:
+        SendUpstream(std::move(data));
+        break;
+    }
+}
+
+void HeaderCompressionLayer::ReceiveRefresh(PacketBuffer data)
+{
+    uint8_t cid = data.data()[0] & 0x0F;
+    data.TrimFront(1);
+    size_t header_size = CompressibleHeaderSize(data.data(), data.size());
+    if (header_size == 0 || data.source() >= kMaxSources)
+    {
+        LOGW("Dropping a malformed header compression refresh");
+        INCREMENT_STATS(&stats, header_decompression_failures);
+        return;
+    }
+    Context &context = decompressor_contexts_[data.source()][cid];
+    memcpy(context.header, data.data(), header_size);
+    context.header_size = static_cast<uint8_t>(header_size);
+    context.valid = true;
+    // The refresh answers any request in flight, the next failure asks again
+    context.last_feedback_us = 0;
+    SendUpstream(std::move(data));
+}
+
+void HeaderCompressionLayer::ReceiveCompressed(PacketBuffer data)
+{
+    uint8_t cid = data.data()[0] & 0x0F;
+    if (data.source() >= kMaxSources)
+    {
+        INCREMENT_STATS(&stats, header_decompression_failures);
+        return;
+    }
+    Context &context = decompressor_contexts_[data.source()][cid];
+    if (!context.valid)
+    {
+        SendFeedback(context, cid);
+        return;
+    }
+
+    FieldReader in{data.data(), data.size(), 1};
+    const uint8_t *reference_l4 = context.header + kIpHeaderSize;
+    bool tcp = context.header[9] == kProtocolTcp;
+    uint8_t header[kMaxHeaderSize];
+    uint8_t *l4 = header + kIpHeaderSize;
+    memcpy(header, context.header, kIpHeaderSize + (tcp ? kTcpHeaderSize : kUdpHeaderSize));
+    size_t header_size = kIpHeaderSize + kUdpHeaderSize;
+
+    uint8_t mask = *in.Take(1);
+    uint8_t flags = tcp ? *in.Take(1) : 0;
+    uint16_t reference_ip_id = Read16(context.header + 4);
+    if (mask & kIpIdFull)
+    {
+        memcpy(header + 4, in.Take(2), 2);
+    }
+    else
+    {
+        Write16(header + 4, reference_ip_id + static_cast<uint8_t>(*in.Take(1) - (reference_ip_id & 0xFF)));
+    }
+
+    if (!tcp)
+    {
+        memcpy(l4 + 6, in.Take(2), 2);
+    }
+    else
+    {
+        l4[13] = flags;
+        if (mask & kSeqFull)
+        {
+            memcpy(l4 + 4, in.Take(4), 4);
+        }
+        else
+        {
+            Write32(l4 + 4, DecodeLsb16(Read16(in.Take(2)), Read32(reference_l4 + 4)));
+        }
+
+        if (mask & kAckFull)
+        {
+            memcpy(l4 + 8, in.Take(4), 4);
+        }
+        else if (flags & kTcpFlagAck)
+        {
+            Write32(l4 + 8, DecodeLsb16(Read16(in.Take(2)), Read32(reference_l4 + 8)));
+        }
+
+        if (mask & kWindowChanged)
+        {
+            memcpy(l4 + 14, in.Take(2), 2);
+        }
+
+        size_t options_size = 0;
+        uint8_t *options = l4 + kTcpHeaderSize;
+        const uint8_t *reference_options = reference_l4 + kTcpHeaderSize;
+        size_t reference_options_size = context.header_size - kIpHeaderSize - kTcpHeaderSize;
+        if (mask & kTimestampOption)
+        {
+            if (!IsTimestampOption(reference_options, reference_options_size))
+            {
+                in.malformed = true;
+            }
+            const uint8_t *timestamps = in.Take(4);
+            options_size = 12;
+            memcpy(options, reference_options, 4);
+            Write32(options + 4, DecodeLsb16(Read16(timestamps), Read32(reference_options + 4)));
+            Write32(options + 8, DecodeLsb16(Read16(timestamps + 2), Read32(reference_options + 8)));
+        }
+        else if (mask & kRawOptions)
+        {
+            options_size = *in.Take(1);
+            if (options_size > kMaxHeaderSize - kIpHeaderSize - kTcpHeaderSize || options_size % 4 != 0)
+            {
+                in.malformed = true;
+                options_size = 0;
+            }
+            memcpy(options, in.Take(options_size), options_size);
+        }
+        header_size = kIpHeaderSize + kTcpHeaderSize + options_size;
+        l4[12] = static_cast<uint8_t>(((kTcpHeaderSize + options_size) / 4) << 4);
+        memcpy(l4 + 16, in.Take(2), 2);
+    }
+
+    size_t total_size = header_size + (in.size - in.pos);
+    if (in.malformed || total_size > PACKET_BUFFER_MAX_FRAME_SIZE)
+    {
+        LOGW("Dropping a malformed compressed header");
+        INCREMENT_STATS(&stats, header_decompression_failures);
+        SendFeedback(context, cid);
+        return;
+    }
+
+    Write16(header + 2, static_cast<uint16_t>(total_size));
+    Write16(header + 10, 0);
+    Write16(header + 10, ChecksumFinish(ChecksumAdd(0, header, kIpHeaderSize)));
+    if (!tcp)
+    {
+        Write16(l4 + 4, static_cast<uint16_t>(total_size - kIpHeaderSize));
+    }
+
+    // The header grows back in place when the headroom allows it, else the
+    // payload is copied behind the rebuilt header
+    data.TrimFront(in.pos);
+    if (data.headroom() >= header_size && !data.IsShared())
+    {
+        memcpy(data.Prepend(header_size), header, header_size);
+    }
+    else
+    {
+        PacketBuffer frame = PacketBuffer::Allocate(total_size);
+        if (!frame.valid())
+        {
+            LOGW("Out of packet buffers, dropping a compressed frame");
+            return;
+        }
+        memcpy(frame.data(), header, header_size);
+        memcpy(frame.data() + header_size, data.data(), data.size());
+        frame.set_trace_start_us(data.trace_start_us());
+        frame.set_source(data.source());
+        data = std::move(frame);
+    }
+
+    // A context that went out of sync rebuilds a header the checksum does not
+    // match. UDP may go without a checksum, then there is nothing to check.
+    bool has_checksum = tcp || Read16(l4 + 6) != 0;
+    if (has_checksum && TransportChecksum(data.data(), data.size()) != 0)
+    {
+        INCREMENT_STATS(&stats, header_decompression_failures);
+        SendFeedback(context, cid);
+        return;
+    }
+    memcpy(context.header, header, header_size);
+    context.header_size = static_cast<uint8_t>(header_size);
+    SendUpstream(std::move(data));
+}
+
+void HeaderCompressionLayer::SendFeedback(Context &context, uint8_t cid)
+{
+    uint64_t now_us = nerfnet::TimeNowUs();
+    if (context.last_feedback_us != 0 && now_us - context.last_feedback_us < kFeedbackIntervalUs)
+    {
+        return;
+    }
+    PacketBuffer feedback = PacketBuffer::Allocate(1);
+    if (!feedback.valid())
+    {
+        return;
+    }
+    context.last_feedback_us = now_us;
+    feedback.data()[0] = FRAME_DISPATCH_HC_FEEDBACK | cid;
+    SendDownstream(std::move(feedback));
+}
+
+void HeaderCompressionLayer::Reset()
+{
+    for (Context &context : compressor_contexts_)
+    {
+        context = Context();
+    }
+    for (auto &contexts : decompressor_contexts_)
+    {
+        for (Context &context : contexts)
+        {
+            context = Context();
+        }
+    }
+    use_counter_ = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef HEADER_COMPRESSION_LAYER_H
+#define HEADER_COMPRESSION_LAYER_H
+
+#include <array>
+#include <cstdint>
+#include "ILayer.h"
+#include "message_definitions.h"
+// Compresses the IPv4 and TCP/UDP headers of frames from the tunnel, in the
+// spirit of ROHC. Both ends keep a context per flow: the first packet of a flow
+// is sent in full and sets the context up, the following ones only carry the
+// fields that changed, with sequence numbers cut down to their low bits. The
+// rebuilt packet is checked against its transport checksum, and a context
+// that went out of sync is refreshed at the request of the receiver.
+//
+// Only used once the link negotiated LINK_FEATURE_HEADER_COMPRESSION, other
+// frames, IPv6 included, pass through untouched.
+class HeaderCompressionLayer final : public ILayer
+{
+public:
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    void Reset() override;
+
+private:
+    // Context ids are the low nibble of the dispatch byte
+    static constexpr size_t kMaxContexts = 16;
+    // Decompression contexts are kept per radio pipe the frames arrived on
+    static constexpr size_t kMaxSources = 8;
+    // A compressed context is refreshed after this many packets anyway, in
+    // case a refresh request got lost
+    static constexpr uint32_t kRefreshInterval = 64;
+    // How long to wait for a refresh before asking for it again
+    static constexpr uint64_t kFeedbackIntervalUs = 50000; // 50ms
+    // An IPv4 header without options followed by a TCP header with options
+    static constexpr size_t kMaxHeaderSize = 20 + 60;
+
+    struct Context
+    {
+        bool valid = false;
+        // The last header sent or rebuilt in the flow, the reference the next
+        // compressed header is encoded against
+        uint8_t header[kMaxHeaderSize];
+        uint8_t header_size = 0;
+        // Compressor only
+        bool needs_refresh = false;
+        uint32_t packets_since_refresh = 0;
+        uint64_t last_used = 0;
+        // Decompressor only
+        uint64_t last_feedback_us = 0;
+    };
+
+    // Returns the context of the flow of a packet, starting a new one in the
+    // least recently used slot if the flow has none
+    size_t FindOrStartContext(const uint8_t *header);
+    // Writes the compressed form of `header` to `out`, returning its size
+    size_t CompressHeader(size_t cid, const uint8_t *header, size_t header_size, uint8_t *out) const;
+
+    void ReceiveCompressed(PacketBuffer data);
+    void ReceiveRefresh(PacketBuffer data);
+    // Asks the peer to send the next packet of a context in full
+    void SendFeedback(Context &context, uint8_t cid);
+
+    std::array<Context, kMaxContexts> compressor_contexts_;
+    std::array<std::array<Context, kMaxContexts>, kMaxSources> decompressor_contexts_;
+    uint64_t use_counter_ = 0;
+};
+
+#endif // HEADER_COMPRESSION_LAYER_H
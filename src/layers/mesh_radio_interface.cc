@@ -17,44 +17,57 @@
 #include "mesh_radio_interface.h"
 
 #include <unistd.h>
+#include <cstdlib>
+#include <cstring>
 
 #include "log.h"
 #include "macros.h"
 #include "nrftime.h"
 #include <algorithm>
 #include "message_definitions.h"
+#include "latency_trace.h"
 namespace nerfnet
 {
 
   MeshRadioInterface::MeshRadioInterface(
-      uint16_t ce_pin, int tunnel_fd,
+      RadioDriver &radio, int tunnel_fd,
       uint32_t primary_addr, uint32_t secondary_addr, uint8_t channel,
       uint64_t poll_interval_us,
       uint32_t discovery_address,
       uint8_t power_level,
       bool lna,
       uint8_t data_rate)
-      : radio_(ce_pin, 0),
-        ce_pin_(ce_pin),
-        channel_(channel)
+      : radio_(radio),
+        channel_(channel),
+        frame_slab_(kMaxQueuedFrames)
   {
+    beacon_timer_.callback = &MeshRadioInterface::SetFlag;
+    beacon_timer_.context = &beacon_due_;
+    discovery_ack_timer_.callback = &MeshRadioInterface::SetFlag;
+    discovery_ack_timer_.context = &discovery_ack_timed_out_;
+    timing_timer_.callback = &MeshRadioInterface::SetFlag;
+    timing_timer_.context = &timing_timed_out_;
+
+    // Poll at least as often as it takes to fill the 3 entry RX FIFO
+    rx_poll_interval_us_ = std::min(poll_interval_us, kRxFifoDepth * RadioPacketAirTimeUs(data_rate));
 
     CHECK(channel_ < 128, "Channel must be between 0 and 127");
     CHECK(radio_.begin(), "Failed to start NRF24L01");
 
     radio_.setChannel(channel_);
     radio_.setPALevel(power_level, lna);
-    radio_.setDataRate((rf24_datarate_e)data_rate);
+    radio_.setDataRate((RadioDataRate)data_rate);
     radio_.setAddressWidth(3);
     radio_.enableDynamicPayloads();
     radio_.enableAckPayload();
     radio_.setAutoAck(false);
     radio_.setRetries(0, 0);
-    radio_.setCRCLength(RF24_CRC_8);
+    radio_.setCRCLength(RADIO_CRC_8);
 
     CHECK(radio_.isChipConnected(), "NRF24L01 is unavailable");
 
-    std::srand(static_cast<unsigned int>(std::time(nullptr)));
+    // Seeded from the microsecond clock so radios started in the same second pick different ids
+    std::srand(static_cast<unsigned int>(TimeNowUs()));
     node_id_ = min_discovery_node_id_ + (std::rand() % (256 - min_discovery_node_id_));
 
     LOGI("Starting mesh radio interface with node id %d | 0x%X", node_id_, node_id_);
@@ -141,6 +154,11 @@ namespace nerfnet
     if (state == comms_state_)
       return;
     last_state_change_time_ = TimeNowUs();
+    if (timing_timer_.scheduled())
+    {
+      Timers().Cancel(&timing_timer_);
+    }
+    timing_timed_out_ = false;
     switch (state)
     {
     case CommsNone:
@@ -148,6 +166,7 @@ namespace nerfnet
       break;
     case Timing:
       LOGI("Setting comms state to Timing");
+      Timers().Schedule(&timing_timer_, last_state_change_time_ + timing_timeout_us_);
       break;
     case Discovery:
       LOGI("Setting comms state to Discovery");
@@ -204,18 +223,53 @@ namespace nerfnet
     };
   }
 
+  uint64_t MeshRadioInterface::NextDeadlineUs() const
+  {
+    uint64_t now = TimeNowUs();
+    uint64_t poll_deadline = now + rx_poll_interval_us_;
+    // The slot handlers switch state once the period has strictly elapsed
+    uint64_t slot_end = last_state_change_time_ + send_receive_period_us_ + 1;
+
+    uint64_t deadline = kNoDeadline;
+    switch (radio_state)
+    {
+    case Listening:
+      deadline = std::min(slot_end, poll_deadline);
+      break;
+    case Sending:
+      deadline = packets_to_send_.empty() ? std::min(slot_end, poll_deadline) : now;
+      break;
+    case Continuous:
+      deadline = poll_deadline;
+      if (!packets_to_send_.empty())
+      {
+        deadline = std::min(deadline, continuous_comms_last_change_time_us_ + continuous_listen_time_us_);
+      }
+      break;
+    case RadioNone:
+      break;
+    }
+
+    if (comms_state_ == Timing || comms_state_ == Discovery)
+    {
+      deadline = std::min(deadline, poll_deadline);
+    }
+    return deadline;
+  }
+
   void MeshRadioInterface::TimingTask()
   {
-    if (TimeNowUs() - last_state_change_time_ > 5000000) // Wait for 3 seconds without a timing packet
+    if (timing_timed_out_)
     {
       LOGW("No timing messages received, going to discovery state");
       SetCommsState(Discovery);
       SetRadioState(Listening);
     }
 
-    if (TimeNowUs() - discovery_message_timer_ > 1000000)
+    if (beacon_due_)
     {
-      discovery_message_timer_ = TimeNowUs();
+      beacon_due_ = false;
+      Timers().Schedule(&beacon_timer_, TimeNowUs() + 1000000);
       radio_.stopListening();
       radio_.openWritingPipe(reading_pipe_addresses_[0]);
       radio_.flush_tx();
@@ -268,11 +322,12 @@ namespace nerfnet
 
   void MeshRadioInterface::DiscoveryTask()
   {
-    if (TimeNowUs() - discovery_message_timer_ > discovery_message_rate_us_ && comms_state_ == Discovery)
+    if (beacon_due_ && comms_state_ == Discovery)
     {
-      discovery_message_timer_ = TimeNowUs();
+      beacon_due_ = false;
+      Timers().Schedule(&beacon_timer_, TimeNowUs() + discovery_message_rate_us_);
 
-      if (number_of_discovery_messages_sent_ > max_discovery_messages_ && discovery_ack_received_time_us_ == 0)
+      if (number_of_discovery_messages_sent_ > max_discovery_messages_ && !discovery_ack_received_)
       {
         LOGI("No neighbors found, setting up node id to 0");
         SetNodeId(0);
@@ -287,14 +342,15 @@ namespace nerfnet
       std::memset(discovery_packet, 0, sizeof(DiscoveryPacket));
       discovery_packet->packet_type = static_cast<uint8_t>(PacketType::Discovery);
       discovery_packet->source_node_id = node_id_;
+      discovery_packet->features = LINK_FEATURES_SUPPORTED;
       InsertChecksum(*reinterpret_cast<GenericPacket *>(discovery_packet));
-      packets_to_send_.emplace_back(packet);
+      QueueFrame(packet);
       number_of_discovery_messages_sent_++;
     }
 
-    if (discovery_ack_received_time_us_ != 0)
+    if (discovery_ack_received_)
     {
-      if (TimeNowUs() - discovery_ack_received_time_us_ > discovery_ack_timeout_us_)
+      if (discovery_ack_timed_out_)
       {
         LOGI("Done listening for neighbors");
         // Look for next available node id to assign, making sure to not assign one in the neighbor list
@@ -304,7 +360,8 @@ namespace nerfnet
           {
             SetNodeId(i);
             LOGI("Setting up node id to 0x%X", node_id_);
-            discovery_ack_received_time_us_ = 0;
+            discovery_ack_received_ = false;
+            discovery_ack_timed_out_ = false;
             SetRadioState(Listening);
             SetCommsState(Running);
             return;
@@ -330,12 +387,13 @@ namespace nerfnet
       if (packet.source_node_id < node_id_)
       {
         // LOGI("Received discovery from node 0x%X, but this node is lower than me, resetting discovery counter", packet.source_node_id);
-        discovery_message_timer_ = 0;
+        RestartBeacon();
         number_of_discovery_messages_sent_ = 0;
         return;
       }
       return;
     }
+    neighbor_features_[packet.source_node_id] = packet.features;
 
     // Send back a packets with neightbor node ids, split them up between multiple packets if needed
     PacketFrame packet_frame;
@@ -344,11 +402,11 @@ namespace nerfnet
     std::memset(ack_packet, 0, sizeof(DiscoveryAckPacket));
     ack_packet->packet_type = static_cast<uint8_t>(PacketType::DiscoverResponse);
     ack_packet->source_node_id = node_id_;
-    ack_packet->num_valid_neighbors = neighbor_node_ids_.size();
+    ack_packet->features = LINK_FEATURES_SUPPORTED;
     int i = 0;
     for (auto it = neighbor_node_ids_.begin(); it != neighbor_node_ids_.end(); ++it)
     {
-      if (i < 29)
+      if (i < static_cast<int>(sizeof(ack_packet->neighbors)))
       {
         ack_packet->neighbors[i] = *it;
         i++;
@@ -359,9 +417,10 @@ namespace nerfnet
         break;
       }
     }
+    ack_packet->num_valid_neighbors = i;
     InsertChecksum(*reinterpret_cast<GenericPacket *>(ack_packet));
     // LOGI("Sending discovery ack packet to 0x%X", packet_frame.remote_pipe_address);
-    packets_to_send_.emplace_back(packet_frame);
+    QueueFrame(packet_frame);
     return;
   }
 
@@ -369,17 +428,28 @@ namespace nerfnet
   {
     LOGI("Received %d neighbors from 0x%X", packet.num_valid_neighbors, packet.source_node_id);
 
-    if (discovery_ack_received_time_us_ == 0)
+    if (!discovery_ack_received_)
     {
-      discovery_ack_received_time_us_ = TimeNowUs();
+      discovery_ack_received_ = true;
+      Timers().Schedule(&discovery_ack_timer_, TimeNowUs() + discovery_ack_timeout_us_);
     }
 
     // Add the node ids to the neighbor list
     neighbor_node_ids_.insert(packet.source_node_id);
-    for (int i = 0; i < packet.num_valid_neighbors; i++)
+    for (int i = 0; i < packet.num_valid_neighbors && i < static_cast<int>(sizeof(packet.neighbors)); i++)
     {
       neighbor_node_ids_.insert(packet.neighbors[i]);
     }
+    if (packet.num_valid_neighbors > sizeof(packet.neighbors))
+    {
+      // Only an older node lists more, its last neighbor is where the features are now
+      neighbor_node_ids_.insert(packet.features);
+      neighbor_features_[packet.source_node_id] = 0;
+    }
+    else
+    {
+      neighbor_features_[packet.source_node_id] = packet.features;
+    }
 
     return;
   }
@@ -393,7 +463,8 @@ namespace nerfnet
       return;
     }
     neighbor_node_ids_.insert(packet.source_node_id);
-    LOGI("Added node id 0x%X to neighbor list", packet.source_node_id);
+    neighbor_features_[packet.source_node_id] = packet.features;
+    LOGI("Added node id 0x%X to neighbor list with features 0x%X", packet.source_node_id, packet.features);
   }
 
   void MeshRadioInterface::SendNodeIdAnnouncement()
@@ -405,8 +476,9 @@ namespace nerfnet
     std::memset(discovery_packet, 0, sizeof(DiscoveryPacket));
     discovery_packet->packet_type = static_cast<uint8_t>(PacketType::NodeIdAnnouncement);
     discovery_packet->source_node_id = node_id_;
+    discovery_packet->features = LINK_FEATURES_SUPPORTED;
     InsertChecksum(*reinterpret_cast<GenericPacket *>(discovery_packet));
-    packets_to_send_.emplace_back(packet);
+    QueueFrame(packet);
   }
 
   void MeshRadioInterface::Receiver()
@@ -416,8 +488,14 @@ namespace nerfnet
       SetRadioState(Sending);
       return;
     }
+    ReceivePackets();
+  }
 
-    if (radio_.available())
+  void MeshRadioInterface::ReceivePackets()
+  {
+    // Drain the RX FIFO and hand its data packets upstream as one batch
+    uint8_t pipe = 0;
+    for (int i = 0; i < kRxFifoDepth && radio_.available(&pipe); i++)
     {
       GenericPacket received_packet;
       std::memset(&received_packet, 0, sizeof(received_packet));
@@ -428,7 +506,7 @@ namespace nerfnet
       {
         LOGE("Invalid checksum");
         radio_.flush_rx();
-        return;
+        break;
       }
 
       switch ((PacketType)received_packet.packet_type)
@@ -440,10 +518,22 @@ namespace nerfnet
         HandleDiscoveryAckPacket(*reinterpret_cast<DiscoveryAckPacket *>(&received_packet));
         break;
       case PacketType::Data:
+      case PacketType::DataFragment:
+      case PacketType::DataPacked:
+      case PacketType::DataParity:
+      case PacketType::FecReport:
       case PacketType::DataAck:
       {
         DataPacket *data_packet = reinterpret_cast<DataPacket *>(&received_packet);
-        SendUpstream(DataPacketToVector(*data_packet));
+        PacketBuffer buffer = DataPacketToBuffer(*data_packet);
+        if (!buffer.valid())
+        {
+          LOGW("Out of packet buffers, dropping received packet");
+          break;
+        }
+        buffer.set_trace_start_us(TimeNowUs());
+        buffer.set_source(pipe);
+        rx_batch_.push_back(std::move(buffer));
         break;
       }
       case PacketType::NodeIdAnnouncement:
@@ -475,6 +565,10 @@ namespace nerfnet
         break;
       }
     }
+    if (!rx_batch_.empty())
+    {
+      SendUpstreamBatch(rx_batch_);
+    }
   }
 
   void MeshRadioInterface::Sender()
@@ -484,27 +578,23 @@ namespace nerfnet
       SetRadioState(Listening);
       return;
     }
+    // The radio listens between bursts, so the RX FIFO fills during the send
+    // slot too and has to be drained before it overflows
+    ReceivePackets();
     if (packets_to_send_.empty())
       return;
 
-    std::optional<PacketFrame> packet1 = std::nullopt;
+    std::optional<PacketFrame> packet1 = PopFrame();
     std::optional<PacketFrame> packet2 = std::nullopt;
     std::optional<PacketFrame> packet3 = std::nullopt;
 
-    if (!packets_to_send_.empty())
-    {
-      packet1 = packets_to_send_.front();
-      packets_to_send_.pop_front();
-    }
-    if (!packets_to_send_.empty() && packets_to_send_.front().remote_pipe_address == packet1->remote_pipe_address)
+    if (packet1)
     {
-      packet2 = packets_to_send_.front();
-      packets_to_send_.pop_front();
+      packet2 = PopFrameTo(packet1->remote_pipe_address);
     }
-    if (!packets_to_send_.empty() && packets_to_send_.front().remote_pipe_address == packet1->remote_pipe_address)
+    if (packet2)
     {
-      packet3 = packets_to_send_.front();
-      packets_to_send_.pop_front();
+      packet3 = PopFrameTo(packet1->remote_pipe_address);
     }
 
     if (!packet1 && !packet2 && !packet3)
@@ -547,6 +637,7 @@ namespace nerfnet
     else
     {
       continuous_comms_last_change_time_us_ = TimeNowUs();
+      TraceSentFrames(packet1, packet2, packet3);
     }
 
     radio_.startListening();
@@ -560,71 +651,25 @@ namespace nerfnet
 
   void MeshRadioInterface::ContinuousSenderReceiver()
   {
+    ReceivePackets();
 
-    // Receiver
-    if (radio_.available())
-    {
-      GenericPacket received_packet;
-      std::memset(&received_packet, 0, sizeof(received_packet));
-      INCREMENT_STATS(&stats, radio_packets_received);
-      radio_.read(reinterpret_cast<uint8_t *>(&received_packet), 32);
-      if (!ValidateChecksum(received_packet))
-      {
-        LOGE("Invalid checksum");
-        radio_.flush_rx();
-        return;
-      }
-      switch ((PacketType)received_packet.packet_type)
-      {
-      case PacketType::Discovery:
-        HandleDiscoveryPacket(*reinterpret_cast<DiscoveryPacket *>(&received_packet));
-        break;
-      case PacketType::DiscoverResponse:
-        HandleDiscoveryAckPacket(*reinterpret_cast<DiscoveryAckPacket *>(&received_packet));
-        break;
-      case PacketType::Data:
-      case PacketType::DataAck:
-      {
-        DataPacket *data_packet = reinterpret_cast<DataPacket *>(&received_packet);
-        SendUpstream(DataPacketToVector(*data_packet));
-        break;
-      }
-      case PacketType::NodeIdAnnouncement:
-        HandleNodeIdAnnouncementPacket(*reinterpret_cast<DiscoveryPacket *>(&received_packet));
-        break;
-      case PacketType::Status:
-      {
-        LOGW("Received status packet");
-      }
-      default:
-        LOGE("Unknown packet type: %d", received_packet.packet_type);
-        break;
-      }
-    }
     // Sender
     if (packets_to_send_.empty())
       return;
     if (TimeNowUs() - continuous_comms_last_change_time_us_ < continuous_listen_time_us_)
       return;
 
-    std::optional<PacketFrame> packet1 = std::nullopt;
+    std::optional<PacketFrame> packet1 = PopFrame();
     std::optional<PacketFrame> packet2 = std::nullopt;
     std::optional<PacketFrame> packet3 = std::nullopt;
 
-    if (!packets_to_send_.empty())
-    {
-      packet1 = packets_to_send_.front();
-      packets_to_send_.pop_front();
-    }
-    if (!packets_to_send_.empty() && packets_to_send_.front().remote_pipe_address == packet1->remote_pipe_address)
+    if (packet1)
     {
-      packet2 = packets_to_send_.front();
-      packets_to_send_.pop_front();
+      packet2 = PopFrameTo(packet1->remote_pipe_address);
     }
-    if (!packets_to_send_.empty() && packets_to_send_.front().remote_pipe_address == packet1->remote_pipe_address)
+    if (packet2)
     {
-      packet3 = packets_to_send_.front();
-      packets_to_send_.pop_front();
+      packet3 = PopFrameTo(packet1->remote_pipe_address);
     }
 
     if (!packet1 && !packet2 && !packet3)
@@ -666,6 +711,7 @@ namespace nerfnet
     else
     {
       continuous_comms_last_change_time_us_ = TimeNowUs();
+      TraceSentFrames(packet1, packet2, packet3);
     }
 
     radio_.startListening();
@@ -677,41 +723,177 @@ namespace nerfnet
     }
   }
 
-  void MeshRadioInterface::ReceiveFromUpstream(const std::vector<uint8_t> &data)
+  void MeshRadioInterface::ReceiveFromUpstream(PacketBuffer data)
   {
     // return;
     //  LOGI("Mesh Radio Received %zu bytes from upstream", data.size());
 
     if (!neighbor_node_ids_.empty())
     {
-      DataPacket outgoing_packet = VectorToDataPacket(data);
-      PacketFrame packet;
-      packet.remote_pipe_address = base_address_ + ((*neighbor_node_ids_.begin()) << 8) + 0x01; // send to pipe one
-      DataPacket *data_packet = reinterpret_cast<DataPacket *>(&packet.data[0]);
-      *data_packet = outgoing_packet;
-      CHECK(data_packet->packet_type == (uint8_t)PacketType::Data || data_packet->packet_type == (uint8_t)PacketType::DataAck,
-            "Type must be data of ack data");
-      // data_packet->packet_type = static_cast<uint8_t>(PacketType::Data);
-      //  data_packet->source_id = node_id_;
-      InsertChecksum(*reinterpret_cast<GenericPacket *>(data_packet));
-      // LOGI("Packet: %d bytes, final: %d", data_packet->valid_bytes, data_packet->final_packet);
-      // LOGI("First few bytes of packet: %02X %02X %02X %02X %02X",
-      //   packet.data[0], packet.data[1], packet.data[2], packet.data[3], packet.data[4]);
-      packets_to_send_.emplace_back(packet);
+      EnqueueDataPacket(data, DataPipeAddress(*neighbor_node_ids_.begin()));
+    }
+    else
+    {
+      LOGE("Neighbor node IDs list is empty. Cannot send data.");
+    }
+  }
+
+  size_t MeshRadioInterface::TxCredits() const
+  {
+    if (neighbor_node_ids_.empty())
+    {
+      return 0;
+    }
+    size_t free_frames = frame_slab_.capacity() - frame_slab_.size();
+    if (free_frames <= kControlFrameReserve)
+    {
+      return 0;
+    }
+    return (free_frames - kControlFrameReserve) * PACKET_SIZE;
+  }
+
+  uint8_t MeshRadioInterface::LinkFeatures() const
+  {
+    if (neighbor_node_ids_.empty())
+    {
+      return 0;
+    }
+    auto it = neighbor_features_.find(*neighbor_node_ids_.begin());
+    return it == neighbor_features_.end() ? 0 : (it->second & LINK_FEATURES_SUPPORTED);
+  }
+
+  void MeshRadioInterface::ReceiveBatchFromUpstream(PacketBatch &batch)
+  {
+    if (!neighbor_node_ids_.empty())
+    {
+      // The whole burst goes to the same neighbor, so the sender can group it into writeFast triples
+      uint32_t remote_pipe_address = DataPipeAddress(*neighbor_node_ids_.begin());
+      for (const PacketBuffer &data : batch)
+      {
+        EnqueueDataPacket(data, remote_pipe_address);
+      }
     }
     else
     {
       LOGE("Neighbor node IDs list is empty. Cannot send data.");
     }
+    batch.clear();
+  }
+
+  uint32_t MeshRadioInterface::DataPipeAddress(uint8_t neighbor_node_id) const
+  {
+    return base_address_ + (neighbor_node_id << 8) + 1 + node_id_ % kNumDataPipes;
+  }
+
+  void MeshRadioInterface::TraceSentFrames(const std::optional<PacketFrame> &packet1,
+                                           const std::optional<PacketFrame> &packet2,
+                                           const std::optional<PacketFrame> &packet3)
+  {
+    for (const std::optional<PacketFrame> *packet : {&packet1, &packet2, &packet3})
+    {
+      if (*packet)
+      {
+        TraceLatency(TraceStage::OnAir, (*packet)->trace_start_us);
+      }
+    }
+  }
+
+  MeshRadioInterface::~MeshRadioInterface()
+  {
+    while (PopFrame())
+    {
+    }
+    for (nerfnet::TimerWheel::Timer *timer : {&beacon_timer_, &discovery_ack_timer_, &timing_timer_})
+    {
+      if (timer->scheduled())
+      {
+        Timers().Cancel(timer);
+      }
+    }
+  }
+
+  void MeshRadioInterface::RestartBeacon()
+  {
+    if (beacon_timer_.scheduled())
+    {
+      Timers().Cancel(&beacon_timer_);
+    }
+    beacon_due_ = true;
+  }
+
+  void MeshRadioInterface::SetFlag(nerfnet::TimerWheel::Timer * /*timer*/, void *context)
+  {
+    *static_cast<bool *>(context) = true;
+  }
+
+  void MeshRadioInterface::QueueFrame(const PacketFrame &frame)
+  {
+    PacketFrame *slot = frame_slab_.New(frame);
+    if (!slot)
+    {
+      LOGW("Radio send queue full, dropping frame");
+      return;
+    }
+    packets_to_send_.PushBack(slot);
+  }
+
+  std::optional<MeshRadioInterface::PacketFrame> MeshRadioInterface::PopFrame()
+  {
+    PacketFrame *slot = packets_to_send_.PopFront();
+    if (!slot)
+    {
+      return std::nullopt;
+    }
+    PacketFrame frame = *slot;
+    frame_slab_.Delete(slot);
+    return frame;
+  }
+
+  std::optional<MeshRadioInterface::PacketFrame> MeshRadioInterface::PopFrameTo(uint32_t remote_pipe_address)
+  {
+    PacketFrame *front = packets_to_send_.Front();
+    if (!front || front->remote_pipe_address != remote_pipe_address)
+    {
+      return std::nullopt;
+    }
+    return PopFrame();
+  }
+
+  void MeshRadioInterface::EnqueueDataPacket(const PacketBuffer &data, uint32_t remote_pipe_address)
+  {
+    PacketFrame packet;
+    packet.remote_pipe_address = remote_pipe_address;
+    packet.trace_start_us = data.trace_start_us();
+    TraceLatency(TraceStage::RadioEnqueued, data);
+    DataPacket *data_packet = reinterpret_cast<DataPacket *>(&packet.data[0]);
+    // The buffer may still be referenced upstream for retransmits, so the checksum goes into the frame copy
+    *data_packet = AsDataPacket(data);
+    CHECK(IsDataFragmentType(data_packet->packet_type) || data_packet->packet_type == (uint8_t)PacketType::DataAck ||
+              data_packet->packet_type == (uint8_t)PacketType::DataParity ||
+              data_packet->packet_type == (uint8_t)PacketType::FecReport,
+          "Type must be data of ack data");
+    // data_packet->packet_type = static_cast<uint8_t>(PacketType::Data);
+    //  data_packet->source_id = node_id_;
+    InsertChecksum(*reinterpret_cast<GenericPacket *>(data_packet));
+    // LOGI("Packet: %d bytes, final: %d", data_packet->valid_bytes, data_packet->final_packet);
+    QueueFrame(packet);
   }
 
   void MeshRadioInterface::Reset()
   {
-    packets_to_send_.clear();
+    while (PopFrame())
+    {
+    }
     neighbor_node_ids_.clear();
-    discovery_message_timer_ = 0;
+    neighbor_features_.clear();
+    RestartBeacon();
     number_of_discovery_messages_sent_ = 0;
-    discovery_ack_received_time_us_ = 0;
+    if (discovery_ack_timer_.scheduled())
+    {
+      Timers().Cancel(&discovery_ack_timer_);
+    }
+    discovery_ack_received_ = false;
+    discovery_ack_timed_out_ = false;
     SetCommsState(Discovery);
     writing_pipe_address_ = 0;
     for (int i = 0; i < 5; i++)
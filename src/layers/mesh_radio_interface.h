@@ -20,21 +20,21 @@
 #include <optional>
 #include <functional>
 
-#include "radio_interface.h"
 #include <vector>
-#include <deque>
+#include <unordered_map>
 #include <unordered_set>
-#include <RF24/RF24.h>
 #include "ILayer.h"
+#include "radio_driver.h"
+#include "slab.h"
 
 namespace nerfnet
 {
   // The mesh mode radio interface.
-  class MeshRadioInterface : public ILayer
+  class MeshRadioInterface final : public ILayer
   {
   public:
-    // Setup the mesh radio link.
-    MeshRadioInterface(uint16_t ce_pin,
+    // Setup the mesh radio link on an RF24 or simulated radio.
+    MeshRadioInterface(RadioDriver &radio,
                        int tunnel_fd,
                        uint32_t primary_addr,
                        uint32_t secondary_addr,
@@ -44,16 +44,28 @@ namespace nerfnet
                        uint8_t power_level,
                        bool lna,
                        uint8_t data_rate);
+    ~MeshRadioInterface();
 
     // Runs the interface
-    void Run();
+    void Run() override;
+
+    // The radio has no interrupt line wired up, so while listening the RX FIFO
+    // is polled often enough that it can not overflow
+    uint64_t NextDeadlineUs() const override;
+
+    // Free send queue slots in bytes of data packets, zero until a neighbor is known
+    size_t TxCredits() const override;
+
+    // The features this node and the neighbor data is sent to both support
+    uint8_t LinkFeatures() const override;
+
+    void ReceiveFromDownstream(PacketBuffer) override {}
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    void ReceiveBatchFromUpstream(PacketBatch &batch) override;
 
   private:
     // The radio interface
-    RF24 radio_;
-
-    // The CE pin for the radio
-    uint16_t ce_pin_;
+    RadioDriver &radio_;
 
     // The radio channel
     uint8_t channel_;
@@ -61,6 +73,9 @@ namespace nerfnet
     // The node id for this radio
     uint8_t node_id_ = 0;
 
+    // How often the RX FIFO is checked while listening
+    uint64_t rx_poll_interval_us_;
+
 #pragma region Discovery
 
     // The rate at which the radio will send discovery messages.
@@ -75,11 +90,17 @@ namespace nerfnet
     // The list of neighbor node ids.
     std::unordered_set<uint8_t> neighbor_node_ids_;
 
+    // The features each neighbor advertised, neighbors only known from
+    // another node's list are missing and get none
+    std::unordered_map<uint8_t, uint8_t> neighbor_features_;
+
     // The number of discovery messages sent.
     uint8_t number_of_discovery_messages_sent_ = 0;
 
-    // The time since the first discovery ack was received
-    uint64_t discovery_ack_received_time_us_ = 0;
+    // Started by the first discovery ack, the neighbor ids are in once it fires
+    nerfnet::TimerWheel::Timer discovery_ack_timer_;
+    bool discovery_ack_received_ = false;
+    bool discovery_ack_timed_out_ = false;
 
 #pragma endregion
 
@@ -127,7 +148,14 @@ namespace nerfnet
 
     uint64_t last_state_change_time_ = 0;
 
-    uint64_t discovery_message_timer_ = 0;
+    // Paces the discovery and timing messages, one is sent whenever beacon_due_ is set
+    nerfnet::TimerWheel::Timer beacon_timer_;
+    bool beacon_due_ = true;
+
+    // How long the Timing state waits for a timing ack before it gives up
+    const uint64_t timing_timeout_us_ = 5000000; // 5s
+    nerfnet::TimerWheel::Timer timing_timer_;
+    bool timing_timed_out_ = false;
 
 #pragma region PacketDefenitions
 
@@ -144,7 +172,8 @@ namespace nerfnet
       uint8_t checksum : 4;
       uint8_t packet_type : 4;
       uint8_t source_node_id;
-      uint8_t padding;
+      // The LINK_FEATURE_* bits the sender supports, zero from older nodes
+      uint8_t features;
       uint8_t payload[29];
     };
     static_assert(sizeof(DiscoveryPacket) == 32, "DiscoveryPacket size must be 32 bytes");
@@ -155,7 +184,10 @@ namespace nerfnet
       uint8_t packet_type : 4;
       uint8_t source_node_id;
       uint8_t num_valid_neighbors;
-      uint8_t neighbors[29];
+      uint8_t neighbors[28];
+      // Kept after the neighbor list, older nodes only read the valid neighbors.
+      // Older nodes listing 29 neighbors put the last one here instead.
+      uint8_t features;
     };
     static_assert(sizeof(DiscoveryAckPacket) == 32, "DiscoveryAckPacket size must be 32 bytes");
 
@@ -169,16 +201,44 @@ namespace nerfnet
     };
     static_assert(sizeof(TimeSynchPacket) == 32, "TimeSynchPacket size must be 32 bytes");
 
+    // Ordered largest member first so a frame and its queue link fill exactly one slab slot
     struct PacketFrame
     {
-      uint8_t packet_type;
-      uint64_t last_time_sent;
-      uint32_t remote_pipe_address;
       uint8_t data[32];
+      uint64_t last_time_sent = 0;
+      // Latency tracing start of the data packet in this frame, zero for control frames
+      uint64_t trace_start_us = 0;
+      PacketFrame *next = nullptr;
+      uint32_t remote_pipe_address = 0;
+      uint8_t packet_type = 0;
     };
+    static_assert(sizeof(PacketFrame) <= SLAB_CACHE_LINE_SIZE, "PacketFrame must fit in one cache line");
 #pragma endregion
 
-    std::deque<PacketFrame> packets_to_send_;
+    // The most frames that can wait for the radio
+    static constexpr size_t kMaxQueuedFrames = 512;
+
+    // Send queue slots kept out of the advertised credits, so acks and
+    // discovery frames still get queued while upstream fills the rest
+    static constexpr size_t kControlFrameReserve = 32;
+
+    Slab<PacketFrame> frame_slab_;
+    IntrusiveQueue<PacketFrame> packets_to_send_;
+
+    // Copies a frame into the send queue, dropping it if every slot is in use
+    void QueueFrame(const PacketFrame &frame);
+
+    // Takes the oldest frame off the send queue
+    std::optional<PacketFrame> PopFrame();
+
+    // Takes the oldest frame off the send queue if it goes to remote_pipe_address
+    std::optional<PacketFrame> PopFrameTo(uint32_t remote_pipe_address);
+
+    // The depth of the radio's RX FIFO
+    static constexpr int kRxFifoDepth = 3;
+
+    // Data packets drained from the RX FIFO, handed upstream as one batch
+    PacketBatch rx_batch_;
 
     void SetNodeId(uint8_t node_id);
 
@@ -192,19 +252,40 @@ namespace nerfnet
 
     void Sender();
     void Receiver();
+    // Drains the RX FIFO and hands the data packets upstream
+    void ReceivePackets();
 
     void DiscoveryTask();
 
     void TimingTask();
 
+    // Sends the next discovery or timing message right away
+    void RestartBeacon();
+    // The callback of the comms timers, sets the flag `context` points to
+    static void SetFlag(nerfnet::TimerWheel::Timer *timer, void *context);
+
     void HandleDiscoveryPacket(const DiscoveryPacket &packet);
     void HandleDiscoveryAckPacket(const DiscoveryAckPacket &packet);
     void HandleNodeIdAnnouncementPacket(const DiscoveryPacket &packet);
 
     void SendNodeIdAnnouncement();
 
-    void ReceiveFromDownstream(const std::vector<uint8_t> &data) override {}
-    void ReceiveFromUpstream(const std::vector<uint8_t> &data) override;
+    // Records the on-air latency of the frames that were just transmitted
+    void TraceSentFrames(const std::optional<PacketFrame> &packet1,
+                         const std::optional<PacketFrame> &packet2,
+                         const std::optional<PacketFrame> &packet3);
+
+    // Pipes 1 to 5 receive data. Each node sends its data to the pipe picked by
+    // its own node id, so the pipe a data packet arrives on tells the layers
+    // above which neighbour sent it, as long as no two neighbours share a node
+    // id modulo kNumDataPipes.
+    static constexpr uint8_t kNumDataPipes = 5;
+
+    // The address of the data pipe this node writes to on a neighbour
+    uint32_t DataPipeAddress(uint8_t neighbor_node_id) const;
+
+    // Copies a data packet into a frame for the remote pipe and queues it for sending
+    void EnqueueDataPacket(const PacketBuffer &data, uint32_t remote_pipe_address);
 
     void Reset() override;
 
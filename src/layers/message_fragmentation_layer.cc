@@ -2,73 +2,443 @@
 #include <cstring>
 #include <iostream>
 #include "message_definitions.h"
-#include <cmath>
+#include <algorithm>
 #include "nrftime.h"
+#include "latency_trace.h"
 // #include <cstdlib>
 // #include <ctime>
 
 MessageFragmentationLayer::MessageFragmentationLayer() {
     std::srand(static_cast<unsigned int>(nerfnet::TimeNowUs()));
     packet_number_ = static_cast<uint8_t>(std::rand() % 256);
+    SetReassemblyLimits(kDefaultFramesInFlight, kDefaultReassemblyTimeoutUs);
     LOGI("MessageFragmentationLayer initialized with packet number %d", packet_number_);
 }
 
-void MessageFragmentationLayer::ReceiveFromDownstream(const std::vector<uint8_t> &data)
+void MessageFragmentationLayer::ReceiveFromDownstream(PacketBuffer data)
+{
+    INCREMENT_STATS(&stats, fragments_received);
+    ReceiveFragment(data, nerfnet::TimeNowUs());
+}
+
+void MessageFragmentationLayer::ReceiveBatchFromDownstream(PacketBatch &batch)
+{
+    // The packets of a batch were drained from the radio together, one clock read covers them all
+    uint64_t now_us = nerfnet::TimeNowUs();
+    UPDATE_STATS(&stats, fragments_received, logger.stats.fragments_received + batch.size());
+    for (const PacketBuffer &data : batch) {
+        ReceiveFragment(data, now_us);
+    }
+    batch.clear();
+}
+
+void MessageFragmentationLayer::ReceiveFragment(const PacketBuffer &data, uint64_t now_us)
 {
     CHECK(data.size() == PACKET_SIZE, "Message Fragment data size must be 32 bytes");
-    DataPacket packet = VectorToDataPacket(data);
-    fragmented_packets_.push_back(packet);
-    //LOGI("MessageFragmentationLayer Received packet %d with size %zu, final: %d", packet.payload[10], packet.valid_bytes, packet.final_packet);
-    if(packet.final_packet) {
-        //LOGI("MessageFragmentationLayer Received final packet with %zu bytes", packet.valid_bytes);
-        std::vector<uint8_t> payload;
-        UPDATE_STATS(&stats, packet_size, fragmented_packets_.size());
-        // Combine all fragmented packets
-        for (const auto &frag_packet : fragmented_packets_) {
-            INCREMENT_STATS(&stats, fragments_received);
-            payload.insert(payload.end(), frag_packet.payload, frag_packet.payload + frag_packet.valid_bytes);
+    const DataPacket &packet = AsDataPacket(data);
+    nerfnet::TraceLatency(nerfnet::TraceStage::RadioReceived, data);
+    if (packet.packet_type == static_cast<uint8_t>(PacketType::DataPacked)) {
+        ReceivePacked(data, now_us);
+        return;
+    }
+
+    // Middle fragments of compact frames leave out the length, they are always full
+    bool compact = packet.packet_type == static_cast<uint8_t>(PacketType::DataFragment);
+    const uint8_t *fragment_payload = compact ? packet.compact_payload : packet.payload;
+    size_t length = compact ? COMPACT_PACKET_PAYLOAD_SIZE : packet.valid_bytes;
+    bool final_packet = !compact && packet.final_packet;
+    size_t stride = compact || (final_packet && packet.compact_frame) ? COMPACT_PACKET_PAYLOAD_SIZE
+                                                                      : PACKET_PAYLOAD_SIZE;
+    AddFragment(data, packet.message_id, packet.fragment_index, fragment_payload, length, final_packet, stride,
+                now_us);
+}
+
+void MessageFragmentationLayer::ReceivePacked(const PacketBuffer &data, uint64_t now_us)
+{
+    const DataPacket &packet = AsDataPacket(data);
+    const uint8_t *record = packet.compact_payload;
+    const uint8_t *end = record + COMPACT_PACKET_PAYLOAD_SIZE;
+    while (record < end && *record != 0) {
+        uint8_t marker = *record;
+        size_t length = marker & PACKED_RECORD_LENGTH_MASK;
+        size_t header_size = (marker & PACKED_RECORD_TAIL) ? PACKED_RECORD_TAIL_HEADER_SIZE : 1;
+        if (header_size + length > static_cast<size_t>(end - record)) {
+            LOGW("Malformed packed packet %d, dropping the rest of it", packet.message_id);
+            INCREMENT_STATS(&stats, reassembly_malformed);
+            return;
+        }
+        const uint8_t *bytes = record + header_size;
+        if (!(marker & PACKED_RECORD_TAIL) && (marker & PACKED_RECORD_ACK)) {
+            // Read by the ack layer on its way up
+        } else if (marker & PACKED_RECORD_TAIL) {
+            size_t stride = (marker & PACKED_RECORD_COMPACT) ? COMPACT_PACKET_PAYLOAD_SIZE : PACKET_PAYLOAD_SIZE;
+            AddFragment(data, record[1], record[2], bytes, length, true, stride, now_us);
+        } else {
+            PacketBuffer frame = PacketBuffer::CopyFrom(bytes, length);
+            if (frame.valid()) {
+                frame.set_trace_start_us(data.trace_start_us());
+                frame.set_source(data.source());
+                nerfnet::TraceLatency(nerfnet::TraceStage::Reassembled, frame);
+                SendUpstream(std::move(frame));
+            } else {
+                LOGW("Out of packet buffers, dropping received frame");
+                INCREMENT_STATS(&stats, reassembly_no_buffer);
+            }
+        }
+        record += header_size + length;
+    }
+}
+
+void MessageFragmentationLayer::AddFragment(const PacketBuffer &data, uint8_t message_id, uint8_t fragment_index,
+                                            const uint8_t *payload, size_t length, bool final_packet, size_t stride,
+                                            uint64_t now_us)
+{
+    // Only the final fragment of a frame may be short
+    size_t offset = fragment_index * stride;
+    if (length > stride || (!final_packet && length != stride) ||
+        offset + length > PACKET_BUFFER_MAX_FRAME_SIZE) {
+        LOGW("Malformed fragment %d of message %d, dropping it", fragment_index, message_id);
+        INCREMENT_STATS(&stats, reassembly_malformed);
+        return;
+    }
+
+    Reassembly *reassembly = FindOrStartReassembly(data, message_id, now_us);
+    if (!reassembly) {
+        return;
+    }
+    if (reassembly->received.test(fragment_index)) {
+        // A retransmit of a fragment we already have
+        return;
+    }
+    // The reassemblies stay in the order they last made progress, so only
+    // the first one can time out
+    active_reassemblies_.Remove(reassembly);
+    active_reassemblies_.PushBack(reassembly);
+    if (final_packet) {
+        reassembly->fragment_count = fragment_index + 1;
+        reassembly->length = offset + length;
+    }
+    std::memcpy(reassembly->frame.data() + offset, payload, length);
+    reassembly->received.set(fragment_index);
+    reassembly->fragments_received++;
+    reassembly->last_fragment_us = now_us;
+
+    if (reassembly->fragments_received != reassembly->fragment_count) {
+        return;
+    }
+    UPDATE_STATS(&stats, packet_size, reassembly->fragment_count);
+    PacketBuffer frame = std::move(reassembly->frame);
+    frame.TrimBack(frame.size() - reassembly->length);
+    frame.set_trace_start_us(reassembly->trace_start_us);
+    frame.set_source(reassembly->source);
+    ReleaseReassembly(*reassembly);
+    nerfnet::TraceLatency(nerfnet::TraceStage::Reassembled, frame);
+    SendUpstream(std::move(frame));
+}
+
+MessageFragmentationLayer::Reassembly &MessageFragmentationLayer::SlotOf(uint8_t source, uint8_t message_id)
+{
+    return reassemblies_[(source % kMaxSources) * frames_in_flight_ + (message_id & (frames_in_flight_ - 1))];
+}
+
+MessageFragmentationLayer::Reassembly *MessageFragmentationLayer::FindOrStartReassembly(const PacketBuffer &data,
+                                                                                       uint8_t message_id,
+                                                                                       uint64_t now_us)
+{
+    uint8_t source = data.source();
+    SourceState &state = sources_[source % kMaxSources];
+    if (state.reassemblies == 0) {
+        state.newest_id = message_id;
+    }
+    uint8_t ahead = static_cast<uint8_t>(message_id - state.newest_id);
+    if (ahead != 0 && ahead < 128) {
+        // A frame that lost a fragment would otherwise linger until its
+        // timeout, long enough for its message id to come around again and
+        // take the fragments of a new frame. The ones this frame leaves
+        // frames_in_flight_ behind are not going to complete.
+        size_t leaving = std::min<size_t>(ahead, frames_in_flight_);
+        for (size_t i = 1; i <= leaving; i++) {
+            uint8_t behind_id = static_cast<uint8_t>(state.newest_id - frames_in_flight_ + i);
+            Reassembly &behind = SlotOf(source, behind_id);
+            if (behind.in_use && behind.message_id == behind_id) {
+                LOGW("Message %d from %d fell behind, dropping it", behind_id, source);
+                INCREMENT_STATS(&stats, reassembly_evictions);
+                ReleaseReassembly(behind);
+            }
         }
+        state.newest_id = message_id;
+    } else if (static_cast<uint8_t>(state.newest_id - message_id) >= frames_in_flight_) {
+        LOGW("Message %d from %d fell behind, dropping it", message_id, source);
+        INCREMENT_STATS(&stats, reassembly_evictions);
+        return nullptr;
+    }
 
-        fragmented_packets_.clear();
+    // The frames of a source in flight have distinct slots, only a source
+    // beyond kMaxSources shares them
+    Reassembly &reassembly = SlotOf(source, message_id);
+    if (reassembly.in_use) {
+        if (reassembly.source == source && reassembly.message_id == message_id) {
+            return &reassembly;
+        }
+        LOGW("Too many frames in reassembly, dropping message %d from %d", reassembly.message_id,
+             reassembly.source);
+        INCREMENT_STATS(&stats, reassembly_evictions);
+        ReleaseReassembly(reassembly);
+    }
+    reassembly.frame = PacketBuffer::Allocate(PACKET_BUFFER_MAX_FRAME_SIZE);
+    if (!reassembly.frame.valid()) {
+        LOGW("Out of packet buffers, dropping received frame");
+        INCREMENT_STATS(&stats, reassembly_no_buffer);
+        return nullptr;
+    }
+    reassembly.in_use = true;
+    reassembly.source = source;
+    reassembly.message_id = message_id;
+    reassembly.trace_start_us = data.trace_start_us();
+    reassembly.last_fragment_us = now_us;
+    active_reassemblies_.PushBack(&reassembly);
+    state.reassemblies++;
+    return &reassembly;
+}
 
-        SendUpstream(payload);
-    } else {
-        //LOGI("MessageFragmentationLayer Received non-final packet with %zu bytes", packet.valid_bytes);
+void MessageFragmentationLayer::ReleaseReassembly(Reassembly &reassembly)
+{
+    // The buffer goes back to the pool, a slot only holds one while its frame
+    // is incomplete
+    active_reassemblies_.Remove(&reassembly);
+    sources_[reassembly.source % kMaxSources].reassemblies--;
+    reassembly.in_use = false;
+    reassembly.fragment_count = 0;
+    reassembly.fragments_received = 0;
+    reassembly.length = 0;
+    reassembly.received.reset();
+    reassembly.frame = PacketBuffer();
+}
+
+void MessageFragmentationLayer::SetReassemblyLimits(size_t frames_in_flight, uint64_t timeout_us)
+{
+    CHECK(frames_in_flight > 0 && frames_in_flight <= kMaxFramesInFlight,
+          "Reassembly keeps 1 to %zu frames in flight per source", kMaxFramesInFlight);
+    while (Reassembly *reassembly = active_reassemblies_.Front()) {
+        ReleaseReassembly(*reassembly);
     }
+    // A power of two, so the slot of a frame is its message_id masked
+    frames_in_flight_ = 1;
+    while (frames_in_flight_ < frames_in_flight) {
+        frames_in_flight_ <<= 1;
+    }
+    reassemblies_.clear();
+    reassemblies_.resize(kMaxSources * frames_in_flight_);
+    reassembly_timeout_us_ = timeout_us;
 }
 
-void MessageFragmentationLayer::ReceiveFromUpstream(const std::vector<uint8_t> &data)
+void MessageFragmentationLayer::Run()
+{
+    uint64_t now = nerfnet::TimeNowUs();
+    while (Reassembly *reassembly = active_reassemblies_.Front()) {
+        if (now - reassembly->last_fragment_us < reassembly_timeout_us_) {
+            break;
+        }
+        LOGW("Message %d from %d timed out with %d fragments", reassembly->message_id, reassembly->source,
+             reassembly->fragments_received);
+        INCREMENT_STATS(&stats, reassembly_timeouts);
+        ReleaseReassembly(*reassembly);
+    }
+    if (pack_.valid() && now >= pack_deadline_us_) {
+        TakePack();
+        SendFragmentBatch();
+    }
+}
+
+uint64_t MessageFragmentationLayer::NextDeadlineUs() const
+{
+    uint64_t deadline = kNoDeadline;
+    if (const Reassembly *reassembly = active_reassemblies_.Front()) {
+        deadline = reassembly->last_fragment_us + reassembly_timeout_us_;
+    }
+    if (pack_.valid()) {
+        deadline = std::min(deadline, pack_deadline_us_);
+    }
+    return deadline;
+}
+
+void MessageFragmentationLayer::ReceiveFromUpstream(PacketBuffer data)
 {
     // We will split up the message into smaller packets and send them downstream
     //LOGI("MessageFragmentationLayer Received %zu bytes from upstream", data.size());
-    int number_of_packets = std::ceil(static_cast<double>(data.size()) / PACKET_PAYLOAD_SIZE);
-    ///LOGI("MessageFragmentationLayer splitting into %d packets", number_of_packets);
-
-    for (int i = 0; i < number_of_packets; ++i) {
-        size_t offset = i * PACKET_PAYLOAD_SIZE;
-        size_t packet_size = std::min(static_cast<size_t>(PACKET_PAYLOAD_SIZE), data.size() - offset);
-        
-        DataPacket packet;
-        
-        std::vector<uint8_t> payload(data.begin() + offset, data.begin() + offset + packet_size);
-        std::memcpy(packet.payload, payload.data(), packet_size);
-        
-        packet.valid_bytes = packet_size;
-        packet.packet_type = static_cast<uint8_t>(PacketType::Data);
-        if(i == number_of_packets - 1) {
-            packet.final_packet = true;
+    // Only the final fragment carries the length, if the peer understands compact
+    // fragments the ones before it use the spare byte for payload
+    bool compact = (DownstreamLinkFeatures() & LINK_FEATURE_COMPACT_FRAGMENTS) != 0;
+    size_t stride = compact ? COMPACT_PACKET_PAYLOAD_SIZE : PACKET_PAYLOAD_SIZE;
+    size_t number_of_packets = 0;
+    if (data.size() > 0) {
+        size_t middle_bytes = data.size() > PACKET_PAYLOAD_SIZE ? data.size() - PACKET_PAYLOAD_SIZE : 0;
+        number_of_packets = (middle_bytes + stride - 1) / stride + 1;
+    }
+    ///LOGI("MessageFragmentationLayer splitting into %zu packets", number_of_packets);
+    if (number_of_packets > MAX_FRAGMENTS_PER_FRAME) {
+        LOGW("Frame of %zu bytes is too large to send, dropping it", data.size());
+        return;
+    }
+
+    // Short frames, and short final fragments, share packets if the peer can unpack them
+    bool packing = (DownstreamLinkFeatures() & LINK_FEATURE_PACKED_FRAMES) != 0;
+    if (packing && !data.empty() && data.size() <= kMaxPackedFrame) {
+        uint8_t marker = static_cast<uint8_t>(data.size());
+        AppendToPack(&marker, 1, data.data(), data.size(), data.trace_start_us(), data.traffic_class());
+        nerfnet::TraceLatency(nerfnet::TraceStage::Fragmented, data);
+        SendFragmentBatch();
+        return;
+    }
+    size_t tail_length = number_of_packets > 1 ? data.size() - (number_of_packets - 1) * stride : 0;
+    bool pack_tail = packing && number_of_packets > 1 && tail_length <= kMaxPackedTail;
+    size_t unpacked_packets = pack_tail ? number_of_packets - 1 : number_of_packets;
+    uint8_t message_id = packet_number_++;
+    // A frame completes with its final fragment. Frames whose tail is packed
+    // complete after the ones packed before them, others would overtake
+    // them unless the packed packet goes first.
+    if (!pack_tail) {
+        TakePack();
+    }
+    size_t frame_start = fragment_batch_.size();
+
+    // The packets are written back to back into as few pooled buffers as
+    // possible and handed down as slices of them
+    PacketBuffer packets;
+    const uint8_t *payload = data.data();
+    size_t remaining = data.size();
+    for (size_t i = 0; i < unpacked_packets; ++i) {
+        size_t slot = i % kPacketsPerBuffer;
+        if (slot == 0) {
+            size_t count = std::min(kPacketsPerBuffer, unpacked_packets - i);
+            packets = PacketBuffer::Allocate(count * PACKET_SIZE);
+            if (!packets.valid()) {
+                LOGW("Out of packet buffers, dropping frame");
+                // Only this frame's fragments, a pack taken above holds other frames
+                fragment_batch_.resize(frame_start);
+                SendFragmentBatch();
+                return;
+            }
+            packets.set_trace_start_us(data.trace_start_us());
+            packets.set_traffic_class(data.traffic_class());
+        }
+
+        DataPacket &packet = *reinterpret_cast<DataPacket *>(packets.data() + slot * PACKET_SIZE);
+        packet.checksum = 0;
+        packet.message_id = message_id;
+        packet.fragment_index = i;
+        if (i + 1 < number_of_packets) {
+            // A middle fragment, always full
+            if (compact) {
+                packet.packet_type = static_cast<uint8_t>(PacketType::DataFragment);
+                std::memcpy(packet.compact_payload, payload, COMPACT_PACKET_PAYLOAD_SIZE);
+            } else {
+                packet.packet_type = static_cast<uint8_t>(PacketType::Data);
+                packet.raw_data[PACKET_HEADER_SIZE - 1] = 0;
+                packet.valid_bytes = PACKET_PAYLOAD_SIZE;
+                std::memcpy(packet.payload, payload, PACKET_PAYLOAD_SIZE);
+            }
+            payload += stride;
+            remaining -= stride;
         } else {
-            packet.final_packet = false;
+            packet.packet_type = static_cast<uint8_t>(PacketType::Data);
+            packet.raw_data[PACKET_HEADER_SIZE - 1] = 0;
+            packet.valid_bytes = remaining;
+            packet.final_packet = true;
+            packet.compact_frame = compact;
+            std::memcpy(packet.payload, payload, remaining);
+            // Don't send stale bytes from the pool after the end of the frame
+            std::memset(packet.payload + remaining, 0, PACKET_PAYLOAD_SIZE - remaining);
         }
-        //packet.payload[10] = packet_number_++;
-        //LOGI("Pushing Packet %d with size %zu, final: %d, num: %d", i, packet.valid_bytes, packet.final_packet, packet.payload[10]);
-        INCREMENT_STATS(&stats, fragments_sent);
-        SendDownstream(DataPacketToVector(packet));
+
+        //LOGI("Pushing Packet %zu, num: %d", i, packet.message_id);
+        fragment_batch_.push_back(packets.Slice(slot * PACKET_SIZE, PACKET_SIZE));
+    }
+    // Counted once per frame, INCREMENT_STATS wakes the statistics table every time
+    UPDATE_STATS(&stats, fragments_sent, logger.stats.fragments_sent + unpacked_packets);
+    if (pack_tail) {
+        uint8_t header[PACKED_RECORD_TAIL_HEADER_SIZE] = {
+            static_cast<uint8_t>(PACKED_RECORD_TAIL | (compact ? PACKED_RECORD_COMPACT : 0) | tail_length),
+            message_id,
+            static_cast<uint8_t>(number_of_packets - 1),
+        };
+        AppendToPack(header, sizeof(header), payload, tail_length, data.trace_start_us(), data.traffic_class());
     }
+    nerfnet::TraceLatency(nerfnet::TraceStage::Fragmented, data);
+    SendFragmentBatch();
+}
+
+void MessageFragmentationLayer::AppendToPack(const uint8_t *header, size_t header_size, const uint8_t *bytes,
+                                             size_t length, uint64_t trace_start_us, TrafficClass traffic_class)
+{
+    size_t record_size = header_size + length;
+    if (pack_.valid() && pack_used_ + record_size > COMPACT_PACKET_PAYLOAD_SIZE) {
+        TakePack();
+    }
+    if (!pack_.valid()) {
+        pack_ = PacketBuffer::Allocate(PACKET_SIZE);
+        if (!pack_.valid()) {
+            LOGW("Out of packet buffers, dropping frame");
+            return;
+        }
+        // Zeroed, a zero marker ends the records
+        std::memset(pack_.data(), 0, PACKET_SIZE);
+        DataPacket &packet = AsDataPacket(pack_);
+        packet.packet_type = static_cast<uint8_t>(PacketType::DataPacked);
+        packet.message_id = pack_number_++;
+        packet.fragment_index = PACKED_FRAGMENT_INDEX;
+        pack_.set_trace_start_us(trace_start_us);
+        pack_.set_traffic_class(traffic_class);
+        pack_used_ = 0;
+        pack_deadline_us_ = nerfnet::TimeNowUs() + kPackFlushDelayUs;
+    }
+    // The packet is retransmitted as hard as the most reliable frame in it needs
+    pack_.set_traffic_class(std::min(pack_.traffic_class(), traffic_class));
+
+    uint8_t *record = AsDataPacket(pack_).compact_payload + pack_used_;
+    std::memcpy(record, header, header_size);
+    std::memcpy(record + header_size, bytes, length);
+    pack_used_ += record_size;
+    INCREMENT_STATS(&stats, frames_packed);
+    // Without room for even a one byte frame there is no point in waiting
+    if (pack_used_ + 2 > COMPACT_PACKET_PAYLOAD_SIZE) {
+        TakePack();
+    }
+}
+
+void MessageFragmentationLayer::TakePack()
+{
+    if (!pack_.valid()) {
+        return;
+    }
+    fragment_batch_.push_back(std::move(pack_));
+    pack_ = PacketBuffer();
+    pack_used_ = 0;
+    UPDATE_STATS(&stats, fragments_sent, logger.stats.fragments_sent + 1);
+}
+
+void MessageFragmentationLayer::SendFragmentBatch()
+{
+    if (!fragment_batch_.empty()) {
+        SendDownstreamBatch(fragment_batch_);
+    }
+}
+
+size_t MessageFragmentationLayer::TxCredits() const
+{
+    size_t credits = DownstreamTxCredits();
+    if (credits == kUnlimitedCredits) {
+        return credits;
+    }
+    return credits / PACKET_SIZE * PACKET_PAYLOAD_SIZE;
 }
 
 void MessageFragmentationLayer::Reset()
 {
-    fragmented_packets_.clear();
+    while (Reassembly *reassembly = active_reassemblies_.Front()) {
+        ReleaseReassembly(*reassembly);
+    }
+    pack_ = PacketBuffer();
+    pack_used_ = 0;
     packet_number_ = static_cast<uint8_t>(std::rand() % 256);
 }
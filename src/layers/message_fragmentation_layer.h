@@ -1,24 +1,134 @@
 #ifndef MESSAGE_FRAGMENTATION_LAYER_H
 #define MESSAGE_FRAGMENTATION_LAYER_H
 
+#include <array>
+#include <bitset>
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
 #include <functional>
 #include "ILayer.h"
 #include "message_definitions.h"
+#include "slab.h"
 // Responsible for splitting up messages into packets for transmission
-class MessageFragmentationLayer : public ILayer{
+class MessageFragmentationLayer final : public ILayer{
 public:
     MessageFragmentationLayer();
-    
-    void ReceiveFromDownstream(const std::vector<uint8_t>& data) override;
-    void ReceiveFromUpstream(const std::vector<uint8_t>& data) override;
+
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveBatchFromDownstream(PacketBatch &batch) override;
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    // The downstream credits converted from whole fragments to payload bytes
+    size_t TxCredits() const override;
+
+    // Expires reassemblies that stopped receiving fragments and sends packed
+    // frames that waited long enough for company
+    void Run() override;
+    uint64_t NextDeadlineUs() const override;
 
     void Reset() override;
+
+    // Keeps up to `frames_in_flight` frames from each source being
+    // reassembled, message ids that far apart, for `timeout_us` after their
+    // last fragment. An ack layer below acknowledges fragments as they
+    // arrive, and the peer never sends them again. Frames have to be kept for
+    // as long as it may still send the rest of them, see
+    // AckLayer::kMaxFramesInFlight and AckLayer::RetransmitHorizonUs.
+    void SetReassemblyLimits(size_t frames_in_flight, uint64_t timeout_us);
 private:
+    // The most radio packets written into one pooled buffer when sending
+    static constexpr size_t kPacketsPerBuffer = PACKET_BUFFER_MAX_FRAME_SIZE / PACKET_SIZE;
+
+    // The pipes data arrives on, reassemblies are kept per source
+    static constexpr size_t kMaxSources = 6;
+    // Without retransmits, a frame still missing fragments once this many
+    // newer frames from the same source started arriving is not going to
+    // complete
+    static constexpr size_t kDefaultFramesInFlight = 32;
+    // Message ids are 8 bits, only half of them tell older frames from newer
+    static constexpr size_t kMaxFramesInFlight = 128;
+    // How long a frame may wait for its missing fragments without retransmits
+    static constexpr uint64_t kDefaultReassemblyTimeoutUs = 1000000; // 1s
+
+    // On links that negotiated LINK_FEATURE_PACKED_FRAMES, frames this short
+    // share DataPacked packets with others instead of taking a packet each
+    static constexpr size_t kMaxPackedFrame = COMPACT_PACKET_PAYLOAD_SIZE - 1;
+    // The final fragment of a longer frame is packed if it is this short
+    static constexpr size_t kMaxPackedTail = PACKET_PAYLOAD_SIZE / 2;
+    // How long a packed packet waits for more frames before it is sent
+    static constexpr uint64_t kPackFlushDelayUs = 2000; // 2ms
+
+    // A frame being put back together. Fragments are copied to their offset in
+    // a buffer sized for the largest frame, so they may arrive in any order.
+    struct Reassembly
+    {
+        bool in_use = false;
+        uint8_t source = 0;
+        uint8_t message_id = 0;
+        // Zero until the final fragment says how many fragments the frame has
+        uint16_t fragment_count = 0;
+        uint16_t fragments_received = 0;
+        size_t length = 0;
+        std::bitset<MAX_FRAGMENTS_PER_FRAME> received;
+        // When the last fragment arrived, reassemblies that stop making
+        // progress time out
+        uint64_t last_fragment_us = 0;
+        uint64_t trace_start_us = 0;
+        PacketBuffer frame;
+        // Link active_reassemblies_
+        Reassembly *next = nullptr;
+        Reassembly *prev = nullptr;
+    };
+
+    // The newest message id and the number of the frames being reassembled
+    // from a source
+    struct SourceState
+    {
+        uint8_t newest_id = 0;
+        uint16_t reassemblies = 0;
+    };
+
+    void ReceiveFragment(const PacketBuffer &data, uint64_t now_us);
+    // Hands the frames of a DataPacked packet upstream and adds the tails in
+    // it to their reassemblies
+    void ReceivePacked(const PacketBuffer &data, uint64_t now_us);
+    // Copies the bytes of a fragment into the reassembly of its frame, handing
+    // the frame upstream once it is complete. `stride` is the payload size of
+    // the middle fragments of the frame.
+    void AddFragment(const PacketBuffer &data, uint8_t message_id, uint8_t fragment_index,
+                     const uint8_t *payload, size_t length, bool final_packet, size_t stride, uint64_t now_us);
+
+    // Finds the reassembly of a frame or starts a new one, dropping the frames
+    // of the source that fall frames_in_flight_ or more behind it. Returns
+    // nullptr if the frame itself is that far behind or no buffer is available.
+    Reassembly *FindOrStartReassembly(const PacketBuffer &data, uint8_t message_id, uint64_t now_us);
+    Reassembly &SlotOf(uint8_t source, uint8_t message_id);
+    void ReleaseReassembly(Reassembly &reassembly);
+
+    // Adds a record to the packed packet being filled, moving the packet to
+    // fragment_batch_ once it is full or the record does not fit
+    void AppendToPack(const uint8_t *header, size_t header_size, const uint8_t *bytes, size_t length,
+                      uint64_t trace_start_us, TrafficClass traffic_class);
+    // Moves the packed packet being filled, if any, to fragment_batch_
+    void TakePack();
+    void SendFragmentBatch();
+
     uint8_t packet_number_ = 0;
-    std::vector<DataPacket> fragmented_packets_;
+    // frames_in_flight_ slots per source, a frame at its message_id modulo that
+    std::vector<Reassembly> reassemblies_;
+    size_t frames_in_flight_ = 0;
+    uint64_t reassembly_timeout_us_ = kDefaultReassemblyTimeoutUs;
+    std::array<SourceState, kMaxSources> sources_ = {};
+    // The frames being reassembled, the one that received a fragment least
+    // recently first
+    IntrusiveList<Reassembly> active_reassemblies_;
+    // The fragments of the frame being sent, handed downstream in one batch
+    PacketBatch fragment_batch_;
+    // The DataPacked packet being filled, sent when full or at pack_deadline_us_
+    PacketBuffer pack_;
+    uint8_t pack_number_ = 0;
+    size_t pack_used_ = 0;
+    uint64_t pack_deadline_us_ = 0;
 };
 
 #endif // MESSAGE_FRAGMENTATION_LAYER_H
@@ -0,0 +1,389 @@
+#include "payload_compression_layer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "log.h"
+
+namespace
+{
+    // LZ4 block format: a token with the literal and match lengths, the
+    // literals, a little endian match offset and any length extensions.
+    // The last sequence holds only literals.
+    constexpr size_t kMinMatch = 4;
+    // A block ends in at least this many literals, and no match starts in the
+    // last kMatchSearchEnd bytes, like the reference implementation requires
+    constexpr size_t kLastLiterals = 5;
+    constexpr size_t kMatchSearchEnd = 12;
+    constexpr size_t kMaxOffset = 0xFFFF;
+
+    // Both ends decode as if every frame followed this text, so matches can
+    // reach back into it. Short frames have little to match against
+    // otherwise, a single JSON reading barely repeats itself. Changing the
+    // dictionary breaks compatibility with peers using the old one.
+    constexpr char kDictionary[] =
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+        "homeassistant/sensor/tele/stat/cmnd//state/status/availability"
+        "{\"id\":\"\",\"type\":\"\",\"name\":\"\",\"device\":\"\",\"sensor\":\"\",\"topic\":\"\","
+        "\"message\":\"\",\"unit\":\"\",\"value\":\"values\":[\"data\":{\"payload\":"
+        "\"temperature\":\"humidity\":\"pressure\":\"battery\":\"voltage\":\"current\":"
+        "\"power\":\"energy\":\"rssi\":\"snr\":\"lat\":\"lon\":\"alt\":\"speed\":\"count\":"
+        "\"level\":\"uptime\":\"time\":\"timestamp\":\"ts\":\"error\":null,\"online\":true,"
+        "\"enabled\":false,\"state\":\"on\",\"state\":\"off\",\"status\":\"ok\"},{\"";
+    constexpr size_t kDictionarySize = sizeof(kDictionary) - 1;
+
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t ElapsedNs(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    uint32_t Load32(const uint8_t *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    // Writes the part of a length that did not fit in its token nibble
+    uint8_t *WriteLength(uint8_t *op, size_t length)
+    {
+        for (length -= 15; length >= 255; length -= 255)
+        {
+            *op++ = 255;
+        }
+        *op++ = static_cast<uint8_t>(length);
+        return op;
+    }
+
+    bool ReadLength(const uint8_t *&ip, const uint8_t *in_end, size_t &length)
+    {
+        uint8_t byte;
+        do
+        {
+            if (ip >= in_end)
+            {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // The bytes a sequence takes at most, token and length extensions included
+    size_t SequenceBound(size_t literal_length, size_t match_length)
+    {
+        return 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1;
+    }
+
+    uint8_t *WriteLiterals(uint8_t *op, uint8_t &token, const uint8_t *literals, size_t length)
+    {
+        token = static_cast<uint8_t>(std::min<size_t>(length, 15) << 4);
+        if (length >= 15)
+        {
+            op = WriteLength(op, length);
+        }
+        memcpy(op, literals, length);
+        return op + length;
+    }
+}
+
+PayloadCompressionLayer::PayloadCompressionLayer()
+{
+    // A random sample of n bytes is expected to hold 256 * (1 - (255/256)^n)
+    // distinct values, text far fewer. Three quarters of that is the cut off.
+    for (size_t n = 0; n <= kSampleSize; n++)
+    {
+        double expected = 256.0 * (1.0 - std::pow(255.0 / 256.0, static_cast<double>(n)));
+        incompressible_distinct_[n] = static_cast<uint16_t>(expected * 3 / 4);
+    }
+
+    const uint8_t *dictionary = reinterpret_cast<const uint8_t *>(kDictionary);
+    for (size_t i = 0; i + kMinMatch <= kDictionarySize; i++)
+    {
+        dictionary_table_[Hash(Load32(dictionary + i))] = static_cast<uint16_t>(i + 1);
+    }
+}
+
+void PayloadCompressionLayer::ReceiveFromUpstream(PacketBuffer data)
+{
+    if (!enabled_ || !(DownstreamLinkFeatures() & LINK_FEATURE_PAYLOAD_COMPRESSION) ||
+        data.size() < kMinCompressSize)
+    {
+        SendDownstream(std::move(data));
+        return;
+    }
+
+    Clock::time_point start = Clock::now();
+    size_t size_in = data.size();
+    PacketBuffer compressed;
+    if (!LooksIncompressible(data.data(), data.size()))
+    {
+        compressed = PacketBuffer::Allocate(data.size());
+    }
+    // The block has to save at least a byte on top of the dispatch byte
+    size_t block_size = compressed.valid()
+                            ? Compress(data.data(), data.size(), compressed.data() + 1, data.size() - 2)
+                            : 0;
+    if (block_size == 0)
+    {
+        INCREMENT_STATS(&stats, incompressible_frames);
+    }
+    else
+    {
+        compressed.data()[0] = FRAME_DISPATCH_COMPRESSED;
+        compressed.TrimBack(compressed.size() - 1 - block_size);
+        compressed.set_trace_start_us(data.trace_start_us());
+        compressed.set_source(data.source());
+        compressed.set_traffic_class(data.traffic_class());
+        data = std::move(compressed);
+    }
+
+    frames_sent_++;
+    compress_ns_ += ElapsedNs(start);
+    bytes_in_ += size_in;
+    bytes_out_ += data.size();
+    UPDATE_STATS(&stats, compression_ratio, static_cast<float>(bytes_in_) / bytes_out_);
+    UPDATE_STATS(&stats, compress_ns_per_frame, static_cast<float>(compress_ns_) / frames_sent_);
+    SendDownstream(std::move(data));
+}
+
+void PayloadCompressionLayer::ReceiveFromDownstream(PacketBuffer data)
+{
+    if (data.empty() || (data.data()[0] & FRAME_DISPATCH_MASK) != FRAME_DISPATCH_COMPRESSED)
+    {
+        SendUpstream(std::move(data));
+        return;
+    }
+
+    Clock::time_point start = Clock::now();
+    PacketBuffer frame = PacketBuffer::Allocate(PACKET_BUFFER_MAX_FRAME_SIZE);
+    if (!frame.valid())
+    {
+        LOGW("Out of packet buffers, dropping a compressed frame");
+        return;
+    }
+    size_t size = Decompress(data.data() + 1, data.size() - 1, frame.data(), frame.size());
+    if (size == 0)
+    {
+        LOGW("Dropping a malformed compressed frame");
+        return;
+    }
+    frame.TrimBack(frame.size() - size);
+    frame.set_trace_start_us(data.trace_start_us());
+    frame.set_source(data.source());
+
+    frames_received_++;
+    decompress_ns_ += ElapsedNs(start);
+    UPDATE_STATS(&stats, decompress_ns_per_frame, static_cast<float>(decompress_ns_) / frames_received_);
+    SendUpstream(std::move(frame));
+}
+
+uint32_t PayloadCompressionLayer::Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - kHashBits);
+}
+
+bool PayloadCompressionLayer::LooksIncompressible(const uint8_t *data, size_t size) const
+{
+    // Sample the end of the frame, the start holds the headers
+    size_t sample = std::min(size, kSampleSize);
+    const uint8_t *p = data + size - sample;
+    uint64_t seen[4] = {};
+    size_t distinct = 0;
+    for (size_t i = 0; i < sample; i++)
+    {
+        uint64_t bit = 1ULL << (p[i] & 63);
+        if (!(seen[p[i] >> 6] & bit))
+        {
+            seen[p[i] >> 6] |= bit;
+            distinct++;
+        }
+    }
+    if (distinct <= incompressible_distinct_[sample])
+    {
+        return false;
+    }
+
+    // Many distinct byte values can still repeat as longer sequences, tables
+    // of binary readings do. Look for repeated 4 byte sequences at a coarse
+    // stride before giving up on the frame.
+    size_t probe_size = std::min(size, kProbeSize);
+    uint16_t seen_at[256] = {};
+    size_t probes = 0;
+    size_t repeats = 0;
+    for (size_t pos = 0; pos + kMinMatch <= probe_size; pos += kMinMatch)
+    {
+        uint32_t sequence = Load32(data + pos);
+        uint16_t &slot = seen_at[(sequence * 2654435761U) >> 24];
+        if (slot != 0 && Load32(data + slot - 1) == sequence)
+        {
+            repeats++;
+        }
+        slot = static_cast<uint16_t>(pos + 1);
+        probes++;
+    }
+    return repeats * 8 < probes;
+}
+
+size_t PayloadCompressionLayer::Compress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity)
+{
+    CHECK(size + kDictionarySize <= kMaxOffset, "Frame of %zu bytes is too large to compress", size);
+    if (++epoch_ == 0)
+    {
+        hash_table_.fill(0);
+        epoch_ = 1;
+    }
+    const uint32_t stamp = static_cast<uint32_t>(epoch_) << 16;
+
+    const uint8_t *const in_end = in + size;
+    const uint8_t *const match_end = in_end - kLastLiterals;
+    const uint8_t *const search_end = size > kMatchSearchEnd ? in_end - kMatchSearchEnd : in;
+    uint8_t *op = out;
+    uint8_t *const out_end = out + capacity;
+    const uint8_t *anchor = in;
+    const uint8_t *ip = in;
+
+    const uint8_t *const dictionary = reinterpret_cast<const uint8_t *>(kDictionary);
+    const uint8_t *const dictionary_end = dictionary + kDictionarySize;
+    while (ip < search_end)
+    {
+        uint32_t sequence = Load32(ip);
+        uint32_t hash = Hash(sequence);
+        uint32_t candidate = hash_table_[hash];
+        hash_table_[hash] = stamp | static_cast<uint32_t>(ip - in);
+
+        // Look earlier in the frame first, then in the dictionary. A match in
+        // the dictionary stops at its end.
+        const uint8_t *match = nullptr;
+        const uint8_t *match_stop = match_end;
+        size_t offset = 0;
+        if ((candidate & 0xFFFF0000) == stamp && Load32(in + (candidate & 0xFFFF)) == sequence)
+        {
+            match = in + (candidate & 0xFFFF);
+            offset = ip - match;
+        }
+        else if (dictionary_table_[hash] != 0 && Load32(dictionary + dictionary_table_[hash] - 1) == sequence)
+        {
+            match = dictionary + dictionary_table_[hash] - 1;
+            match_stop = std::min(match_end, ip + (dictionary_end - match));
+            offset = (ip - in) + (dictionary_end - match);
+        }
+        if (!match)
+        {
+            // Step faster through data that does not match, as LZ4 does
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const uint8_t *end = ip + kMinMatch;
+        while (end < match_stop && *end == match[end - ip])
+        {
+            end++;
+        }
+        size_t literal_length = ip - anchor;
+        size_t match_length = end - ip - kMinMatch;
+        if (SequenceBound(literal_length, match_length) > static_cast<size_t>(out_end - op))
+        {
+            return 0;
+        }
+
+        uint8_t *token = op++;
+        op = WriteLiterals(op, *token, anchor, literal_length);
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        *token |= static_cast<uint8_t>(std::min<size_t>(match_length, 15));
+        if (match_length >= 15)
+        {
+            op = WriteLength(op, match_length);
+        }
+        ip = anchor = end;
+    }
+
+    size_t literal_length = in_end - anchor;
+    if (1 + literal_length + literal_length / 255 + 1 > static_cast<size_t>(out_end - op))
+    {
+        return 0;
+    }
+    uint8_t *token = op++;
+    op = WriteLiterals(op, *token, anchor, literal_length);
+    return op - out;
+}
+
+size_t PayloadCompressionLayer::Decompress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity)
+{
+    const uint8_t *ip = in;
+    const uint8_t *const in_end = in + size;
+    uint8_t *op = out;
+    uint8_t *const out_end = out + capacity;
+    while (ip < in_end)
+    {
+        uint8_t token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !ReadLength(ip, in_end, literal_length))
+        {
+            return 0;
+        }
+        if (literal_length > static_cast<size_t>(in_end - ip) || literal_length > static_cast<size_t>(out_end - op))
+        {
+            return 0;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == in_end)
+        {
+            return op - out;
+        }
+
+        if (in_end - ip < 2)
+        {
+            return 0;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !ReadLength(ip, in_end, match_length))
+        {
+            return 0;
+        }
+        match_length += kMinMatch;
+        size_t produced = op - out;
+        if (offset == 0 || offset > produced + kDictionarySize || match_length > static_cast<size_t>(out_end - op))
+        {
+            return 0;
+        }
+        if (offset > produced)
+        {
+            // The match starts in the dictionary and may run on into the frame
+            size_t back = offset - produced;
+            size_t from_dictionary = std::min(back, match_length);
+            memcpy(op, kDictionary + kDictionarySize - back, from_dictionary);
+            op += from_dictionary;
+            match_length -= from_dictionary;
+        }
+        // Matches may overlap the bytes they produce
+        const uint8_t *match = op - offset;
+        if (offset >= match_length)
+        {
+            memcpy(op, match, match_length);
+        }
+        else
+        {
+            for (size_t i = 0; i < match_length; i++)
+            {
+                op[i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+    return 0;
+}
+
+void PayloadCompressionLayer::Reset()
+{
+    hash_table_.fill(0);
+    epoch_ = 0;
+}
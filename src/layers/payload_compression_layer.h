@@ -0,0 +1,74 @@
+#ifndef PAYLOAD_COMPRESSION_LAYER_H
+#define PAYLOAD_COMPRESSION_LAYER_H
+
+#include <array>
+#include <cstdint>
+#include "ILayer.h"
+#include "message_definitions.h"
+// Compresses whole frames into LZ4 blocks before they are fragmented. Text
+// like JSON or MQTT telemetry shrinks a few times over; frames that look
+// random in a byte sample, encrypted or already compressed data, are passed
+// on without running the compressor.
+//
+// Compressed frames start with FRAME_DISPATCH_COMPRESSED. Frames are only
+// compressed once the link negotiated LINK_FEATURE_PAYLOAD_COMPRESSION, and
+// received ones are always decompressed.
+class PayloadCompressionLayer final : public ILayer
+{
+public:
+    PayloadCompressionLayer();
+
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveFromUpstream(PacketBuffer data) override;
+    void Reset() override;
+
+    void Enable(bool enabled)
+    {
+        enabled_ = enabled;
+    }
+
+private:
+    // Shorter frames rarely save a radio packet
+    static constexpr size_t kMinCompressSize = 64;
+    // The number of bytes at the end of a frame the incompressibility check looks at
+    static constexpr size_t kSampleSize = 256;
+    // How much of a random looking frame is probed for repeated sequences
+    static constexpr size_t kProbeSize = 1024;
+    static constexpr size_t kHashBits = 12;
+
+    // Whether a byte sample of a frame has about as many distinct values as
+    // random data, and longer sequences do not repeat either
+    bool LooksIncompressible(const uint8_t *data, size_t size) const;
+
+    static uint32_t Hash(uint32_t sequence);
+
+    // Writes `size` bytes from `in` to `out` as an LZ4 block. Returns the
+    // size of the block, or zero if it would not fit in `capacity` bytes.
+    size_t Compress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity);
+    // Returns the size of the decoded block, or zero if it is malformed or
+    // does not fit in `capacity` bytes
+    static size_t Decompress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity);
+
+    bool enabled_ = true;
+
+    // Match candidates: the position of a 4 byte sequence in the low 16 bits
+    // and the frame it was seen in above, so the table needs no clearing
+    // between frames
+    std::array<uint32_t, 1 << kHashBits> hash_table_ = {};
+    uint16_t epoch_ = 0;
+    // Where each 4 byte sequence of the preset dictionary is, plus one
+    std::array<uint16_t, 1 << kHashBits> dictionary_table_ = {};
+
+    // Above this many distinct values a sample of that size looks random
+    std::array<uint16_t, kSampleSize + 1> incompressible_distinct_;
+
+    // Totals behind the statistics
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+    uint64_t frames_sent_ = 0;
+    uint64_t compress_ns_ = 0;
+    uint64_t frames_received_ = 0;
+    uint64_t decompress_ns_ = 0;
+};
+
+#endif // PAYLOAD_COMPRESSION_LAYER_H
@@ -1,25 +1,77 @@
 #include "tunnel_interface.h"
 #include "log.h"
+#include <algorithm>
 #include <cstring>
 #include <errno.h>
+#include <sys/eventfd.h>
 #include "nrftime.h"
-#include <queue>
+#include "alloc_counter.h"
+#include "latency_trace.h"
+#include "message_definitions.h"
 
 namespace nerfnet
 {
+    namespace
+    {
+        constexpr uint8_t kProtocolIcmp = 1;
+        constexpr uint8_t kProtocolTcp = 6;
+        constexpr uint8_t kProtocolUdp = 17;
+        constexpr uint8_t kProtocolIcmpv6 = 58;
+        // DSCP code points of interactive voice and video, RFC 4594: CS4,
+        // AF41-43, CS5, VOICE-ADMIT and EF
+        constexpr uint64_t kRealTimeDscps = (1ULL << 32) | (1ULL << 34) | (1ULL << 36) | (1ULL << 38) |
+                                            (1ULL << 40) | (1ULL << 44) | (1ULL << 46);
+        // Lower effort, RFC 8622, and the CS1 it replaces
+        constexpr uint64_t kLowerEffortDscps = (1ULL << 1) | (1ULL << 8);
+        constexpr uint8_t kTcpFlagSyn = 0x02;
+        constexpr size_t kTcpHeaderSize = 20;
+        constexpr uint8_t kTcpOptionEnd = 0;
+        constexpr uint8_t kTcpOptionNop = 1;
+        constexpr uint8_t kTcpOptionMss = 2;
+
+        uint16_t Read16(const uint8_t *p)
+        {
+            return static_cast<uint16_t>((p[0] << 8) | p[1]);
+        }
+
+        void Write16(uint8_t *p, uint16_t value)
+        {
+            p[0] = value >> 8;
+            p[1] = value & 0xFF;
+        }
+
+        // Updates a ones' complement checksum for a 16 bit field that changed, RFC 1624
+        uint16_t UpdateChecksum(uint16_t checksum, uint16_t old_value, uint16_t new_value)
+        {
+            uint32_t sum = static_cast<uint16_t>(~checksum) + static_cast<uint16_t>(~old_value) + new_value;
+            while (sum >> 16)
+            {
+                sum = (sum & 0xFFFF) + (sum >> 16);
+            }
+            return static_cast<uint16_t>(~sum);
+        }
+    }
 
     TunnelInterface::TunnelInterface(int tunnel_fd)
         : tunnel_fd_(tunnel_fd), running_(true)
     {
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        CHECK(event_fd_ >= 0, "Failed to create eventfd: %s (%d)", strerror(errno), errno);
+        // Blocking, the tunnel thread sleeps on it while the downstream ring is full
+        space_event_fd_ = eventfd(0, EFD_CLOEXEC);
+        CHECK(space_event_fd_ >= 0, "Failed to create eventfd: %s (%d)", strerror(errno), errno);
     }
 
     TunnelInterface::~TunnelInterface()
     {
         running_ = false;
+        SignalEventFd(space_event_fd_);
         if (tunnel_thread_.joinable())
         {
             tunnel_thread_.join();
         }
+        close(event_fd_);
+        close(space_event_fd_);
     }
 
     void TunnelInterface::Start()
@@ -29,46 +81,131 @@ namespace nerfnet
 
     void TunnelInterface::Run()
     {
-        std::lock_guard<std::mutex> lock(downstream_buffer_mutex_);
-        if (!downstream_buffer_.empty())
+        // Clear the wakeup, any frames still queued are covered by NextDeadlineUs
+        uint64_t events;
+        ssize_t bytes_read = read(event_fd_, &events, sizeof(events));
+        (void)bytes_read;
+
+        PacketBuffer data;
+        if (!CanSendDownstream())
+        {
+            if (!downstream_ring_.Empty() && !credit_stalled_)
+            {
+                INCREMENT_STATS(&stats, tx_credit_stalls);
+            }
+            credit_stalled_ = !downstream_ring_.Empty();
+        }
+        else if (PopDownstream(data))
         {
-            auto &data = downstream_buffer_.front();
-            SendDownstream(data);
-            downstream_buffer_.pop_front();
+            credit_stalled_ = false;
+            TraceLatency(TraceStage::TunnelRead, data);
+            ClampMss(data);
+            data.set_traffic_class(Classify(data));
+            SendDownstream(std::move(data));
+            UpdateHeapAllocationStats();
         }
 
         WriteToTunnel();
     }
 
+    bool TunnelInterface::PopDownstream(PacketBuffer &data)
+    {
+        // Only a full ring can have the tunnel thread waiting for space
+        bool was_full = downstream_ring_.Full();
+        if (!downstream_ring_.TryPop(data))
+        {
+            return false;
+        }
+        if (was_full)
+        {
+            SignalEventFd(space_event_fd_);
+        }
+        return true;
+    }
+
+    bool TunnelInterface::CanSendDownstream() const
+    {
+        const PacketBuffer *front = downstream_ring_.Front();
+        return front && front->size() <= DownstreamTxCredits();
+    }
+
+    void TunnelInterface::SignalEventFd(int fd)
+    {
+        uint64_t event = 1;
+        ssize_t bytes_written = write(fd, &event, sizeof(event));
+        (void)bytes_written;
+    }
+
+    void TunnelInterface::FrameBufferReleased(void *context)
+    {
+        SignalEventFd(static_cast<TunnelInterface *>(context)->space_event_fd_);
+    }
+
+    uint64_t TunnelInterface::NextDeadlineUs() const
+    {
+        // A frame without credits waits for a layer below to free space, the
+        // loop runs again at that layer's deadline
+        if (CanSendDownstream() || !upstream_ring_.Empty())
+        {
+            return TimeNowUs();
+        }
+        return kNoDeadline;
+    }
+
     void TunnelInterface::Reset()
     {
-        std::lock_guard<std::mutex> lock(upstream_buffer_mutex_);
-        upstream_buffer_.clear();
-        std::lock_guard<std::mutex> lock2(downstream_buffer_mutex_);
-        downstream_buffer_.clear();
+        PacketBuffer data;
+        while (upstream_ring_.TryPop(data))
+        {
+        }
+        while (PopDownstream(data))
+        {
+        }
     }
 
     void TunnelInterface::WriteToTunnel()
     {
-        std::lock_guard<std::mutex> lock(upstream_buffer_mutex_);
-        if (!upstream_buffer_.empty())
+        PacketBuffer data;
+        if (upstream_ring_.TryPop(data))
         {
-            auto &data = upstream_buffer_.front();
             //LOGI("Writing %zu bytes to tunnel", data.size());
             INCREMENT_STATS(&stats, packets_received);
             ssize_t bytes_written = write(tunnel_fd_, data.data(), data.size());
-            upstream_buffer_.pop_front();
+            TraceLatency(TraceStage::TunnelWrite, data);
+            UpdateHeapAllocationStats();
         }
     }
 
-    void TunnelInterface::TunnelThread()
+    void TunnelInterface::UpdateHeapAllocationStats()
     {
-        constexpr size_t kMaxBufferedFrames = 1024;
-        uint8_t buffer[3200];
+        uint64_t heap_allocations = ThreadHeapAllocations();
+        float allocations = static_cast<float>(heap_allocations - heap_allocations_at_last_frame_);
+        heap_allocations_at_last_frame_ = heap_allocations;
+        float alpha = 0.1f;
+        UPDATE_STATS(&stats, heap_allocations_per_frame,
+                     (1.0f - alpha) * logger.stats.heap_allocations_per_frame + alpha * allocations);
+    }
 
+    void TunnelInterface::TunnelThread()
+    {
         while (running_)
         {
-            int bytes_read = read(tunnel_fd_, buffer, sizeof(buffer));
+            // Read straight into a pooled buffer, this is the only copy the frame gets on its way down
+            PacketBuffer frame = PacketBuffer::Allocate(PACKET_BUFFER_MAX_FRAME_SIZE);
+            if (!frame.valid())
+            {
+                // The memory limit is reached, leave frames queued in the kernel until a buffer comes back
+                PacketBufferPool &pool = PacketBufferPool::ForSize(PACKET_BUFFER_MAX_FRAME_SIZE);
+                if (pool.NotifyOnRelease(&TunnelInterface::FrameBufferReleased, this))
+                {
+                    uint64_t events;
+                    ssize_t space_read = read(space_event_fd_, &events, sizeof(events));
+                    (void)space_read;
+                    pool.CancelNotifyOnRelease();
+                }
+                continue;
+            }
+            int bytes_read = read(tunnel_fd_, frame.data(), frame.size());
             if (bytes_read < 0)
             {
                 LOGE("Failed to read: %s (%d)", strerror(errno), errno);
@@ -76,21 +213,142 @@ namespace nerfnet
             }
             ///LOGI("Read %d bytes from tunnel", bytes_read);
             INCREMENT_STATS(&stats, packets_sent);
+            frame.TrimBack(frame.size() - bytes_read);
+            frame.set_trace_start_us(TimeNowUs());
+            while (!downstream_ring_.TryPush(std::move(frame)) && running_)
+            {
+                // Sleep until the protocol loop frees a slot
+                uint64_t events;
+                ssize_t space_read = read(space_event_fd_, &events, sizeof(events));
+                (void)space_read;
+            }
+            SignalEventFd(event_fd_);
+        }
+    }
+
+    void TunnelInterface::ClampMss(PacketBuffer &data) const
+    {
+        // MSS is counted from the end of headers without options
+        uint8_t *ip = data.data();
+        size_t size = data.size();
+        size_t ip_header_size = 0;
+        size_t base_header_size = 0;
+        uint8_t protocol = 0;
+        if (size >= 20 && (ip[0] >> 4) == 4)
+        {
+            ip_header_size = (ip[0] & 0x0F) * 4;
+            base_header_size = 20 + kTcpHeaderSize;
+            protocol = ip[9];
+            // Only the first fragment of an IP packet has the TCP header
+            if ((Read16(ip + 6) & 0x1FFF) != 0)
             {
-                std::lock_guard<std::mutex> lock(downstream_buffer_mutex_);
-                downstream_buffer_.push_back(std::vector<uint8_t>(&buffer[0], &buffer[bytes_read]));
+                return;
             }
+        }
+        else if (size >= 40 && (ip[0] >> 4) == 6)
+        {
+            ip_header_size = 40;
+            base_header_size = 40 + kTcpHeaderSize;
+            protocol = ip[6];
+        }
+        if (protocol != kProtocolTcp || size < ip_header_size + kTcpHeaderSize || data.IsShared())
+        {
+            return;
+        }
+        uint8_t *tcp = ip + ip_header_size;
+        size_t tcp_header_size = (tcp[12] >> 4) * 4;
+        if (!(tcp[13] & kTcpFlagSyn) || tcp_header_size < kTcpHeaderSize || ip_header_size + tcp_header_size > size)
+        {
+            return;
+        }
 
-            while (downstream_buffer_.size() > kMaxBufferedFrames && running_)
+        size_t option = kTcpHeaderSize;
+        while (option < tcp_header_size && tcp[option] != kTcpOptionEnd)
+        {
+            if (tcp[option] == kTcpOptionNop)
+            {
+                option++;
+                continue;
+            }
+            if (option + 1 >= tcp_header_size || tcp[option + 1] < 2 || option + tcp[option + 1] > tcp_header_size)
+            {
+                return;
+            }
+            if (tcp[option] == kTcpOptionMss && tcp[option + 1] == 4)
             {
-                SleepUs(1000);
+                break;
             }
+            option += tcp[option + 1];
+        }
+        if (option >= tcp_header_size || tcp[option] != kTcpOptionMss)
+        {
+            return;
+        }
+
+        // Both ends fragment with the same stride, so inbound SYNs are clamped like outbound ones
+        size_t stride = (DownstreamLinkFeatures() & LINK_FEATURE_COMPACT_FRAGMENTS) ? COMPACT_PACKET_PAYLOAD_SIZE
+                                                                                     : PACKET_PAYLOAD_SIZE;
+        uint16_t mss = Read16(tcp + option + 2);
+        size_t frame_size = FullFragmentFrameSize(std::min(mtu_, base_header_size + mss), stride);
+        if (frame_size <= base_header_size || frame_size - base_header_size >= mss)
+        {
+            return;
+        }
+        uint16_t clamped_mss = static_cast<uint16_t>(frame_size - base_header_size);
+        Write16(tcp + option + 2, clamped_mss);
+        Write16(tcp + 16, UpdateChecksum(Read16(tcp + 16), mss, clamped_mss));
+        INCREMENT_STATS(&stats, tcp_mss_clamped);
+    }
+
+    TrafficClass TunnelInterface::Classify(const PacketBuffer &data)
+    {
+        const uint8_t *ip = data.data();
+        size_t size = data.size();
+        uint8_t dscp = 0;
+        uint8_t protocol = 0;
+        if (size >= 20 && (ip[0] >> 4) == 4)
+        {
+            dscp = ip[1] >> 2;
+            protocol = ip[9];
+        }
+        else if (size >= 40 && (ip[0] >> 4) == 6)
+        {
+            dscp = static_cast<uint8_t>(((ip[0] & 0x0F) << 2) | (ip[1] >> 6));
+            protocol = ip[6];
+        }
+        else
+        {
+            return TrafficClass::Reliable;
+        }
+
+        // The marking goes first, a voice call over TCP is still stale once late
+        if (kRealTimeDscps & (1ULL << dscp))
+        {
+            return TrafficClass::RealTime;
+        }
+        if ((kLowerEffortDscps & (1ULL << dscp)) || protocol == kProtocolUdp || protocol == kProtocolIcmp ||
+            protocol == kProtocolIcmpv6)
+        {
+            return TrafficClass::BoundedRetries;
+        }
+        return TrafficClass::Reliable;
+    }
+
+    void TunnelInterface::ReceiveFromDownstream(PacketBuffer data)
+    {
+        ClampMss(data);
+        if (!upstream_ring_.TryPush(std::move(data)))
+        {
+            LOGW("Tunnel write ring full, dropping frame");
         }
     }
 
-    void TunnelInterface::ReceiveFromDownstream(const std::vector<uint8_t> &data)
+    void TunnelInterface::ReceiveBatchFromDownstream(PacketBatch &batch)
     {
-        std::lock_guard<std::mutex> lock(upstream_buffer_mutex_);
-        upstream_buffer_.push_back(data);
+        for (PacketBuffer &data : batch)
+        {
+            ReceiveFromDownstream(std::move(data));
+        }
+        batch.clear();
     }
 } // namespace nerfnet
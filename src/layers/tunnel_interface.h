@@ -5,51 +5,96 @@
 #include <unistd.h>
 #include <cstddef>
 #include <thread>
-#include <mutex>
 #include <vector>
-#include <deque>
 #include <atomic>
 #include <functional>
 #include "ILayer.h"
+#include "spsc_ring.h"
 
 namespace nerfnet {
 
 
 
-class TunnelInterface : public ILayer {
+class TunnelInterface final : public ILayer {
 public:
     TunnelInterface(int tunnel_fd);
     ~TunnelInterface();
 
     void Start();
-    void Run();
+    void Run() override;
     void Reset() override;
+    uint64_t NextDeadlineUs() const override;
+
+    // Signalled by the tunnel thread whenever it queues a frame
+    int EventFd() const override { return event_fd_; }
     // Reads data from the tunnel and sends it to the mesh
 
     // Writes data from the upstream buffer to the tunnel
     void WriteToTunnel();
+
+    void ReceiveFromDownstream(PacketBuffer data) override;
+    void ReceiveBatchFromDownstream(PacketBatch &batch) override;
+    void ReceiveFromUpstream(PacketBuffer) override {}
+
+    // The MTU of the tunnel device. The MSS option of TCP SYN packets passing
+    // through either way is lowered so that full segments fit in it and fill
+    // every fragment they are split into.
+    void SetMtu(size_t mtu) { mtu_ = mtu; }
 private:
+    // The MTU of a tun device nobody configured
+    static constexpr size_t kDefaultMtu = 1500;
     void TunnelThread();
 
     // The file descriptor for the tunnel
     int tunnel_fd_;
 
+    // The eventfd the tunnel thread wakes the event loop with
+    int event_fd_;
+
     // The thread for the tunnel that reads data from the tunnel and puts it in the downstream buffer
     std::thread tunnel_thread_;
 
-    // The buffer for data coming from the downstream that needs to be written to the tunnel
-    std::deque<std::vector<uint8_t>> upstream_buffer_;
-    // The buffer for data coming from the tunnel that needs to be sent downstream
-    std::deque<std::vector<uint8_t>> downstream_buffer_;
-    // The mutex for the upstream buffer
-    std::mutex upstream_buffer_mutex_;
-    // The mutex for the downstream buffer
-    std::mutex downstream_buffer_mutex_;
-    // The condition variable for the upstream buffer
+    // Frames coming from downstream that need to be written to the tunnel. Filled
+    // and drained by the protocol loop.
+    SpscRing<PacketBuffer, 256> upstream_ring_;
+    // Frames read from the tunnel that need to be sent downstream. The tunnel
+    // thread produces, the protocol loop consumes. Kept short: once it is full
+    // the tunnel thread stops reading and the backlog waits in the kernel queue.
+    SpscRing<PacketBuffer, 16> downstream_ring_;
+    // Signalled by the protocol loop when it frees a slot in a full downstream
+    // ring, and when a frame buffer comes back while the tunnel thread waits for one
+    int space_event_fd_;
+    // Whether the tunnel thread keeps running
     std::atomic<bool> running_;
 
-    void ReceiveFromDownstream(const std::vector<uint8_t>& data) override;
-    void ReceiveFromUpstream(const std::vector<uint8_t>& data) override {}
+    // Heap allocations made by the protocol loop when the last frame was forwarded
+    uint64_t heap_allocations_at_last_frame_ = 0;
+
+    // Set while the oldest frame from the tunnel waits for downstream credits
+    bool credit_stalled_ = false;
+
+    size_t mtu_ = kDefaultMtu;
+
+    // Rewrites the MSS option of a TCP SYN packet, see SetMtu
+    void ClampMss(PacketBuffer &data) const;
+
+    // The traffic class of a frame read from the tunnel, from its DSCP
+    // marking and IP protocol. TCP is Reliable unless its marking says otherwise.
+    static TrafficClass Classify(const PacketBuffer &data);
+
+    // Pops a frame read from the tunnel, waking the tunnel thread if it waits for space
+    bool PopDownstream(PacketBuffer &data);
+
+    // Whether the oldest frame read from the tunnel fits in the downstream credits
+    bool CanSendDownstream() const;
+
+    // Adds one to an eventfd counter
+    static void SignalEventFd(int fd);
+    // Wakes the tunnel thread, see PacketBufferPool::NotifyOnRelease
+    static void FrameBufferReleased(void *context);
+
+    // Attributes the heap allocations made since the last forwarded frame to this one
+    void UpdateHeapAllocationStats();
 };
 
 } // namespace nerfnet
@@ -31,14 +31,47 @@
 #include "tunnel_interface.h"
 #include "log.h"
 #include "config_parser.h"
+#include "header_compression_layer.h"
 #include "message_fragmentation_layer.h"
+#include "forward_error_correction_layer.h"
+#include "payload_compression_layer.h"
 #include "ack_handling_layer.h"
+#include "layer_stack.h"
+#include "event_loop.h"
+#include "latency_trace.h"
+#include "memory_budget.h"
+#include "rf24_radio_driver.h"
 // A description of the program.
 constexpr char kDescription[] =
     "A tool for creating a network tunnel over cheap NRF24L01 radios.";
 
 // The version of the program.
 constexpr char kVersion[] = "0.0.1";
+
+// Where the per stage latency histograms are written on SIGUSR1.
+constexpr char kLatencyDumpPath[] = "/tmp/nrfnet_latency.txt";
+
+// The tunnel MTU when tunnel_mtu is not configured, before it is rounded down
+// to the fragment geometry.
+constexpr uint32_t kDefaultTunnelMtu = 1500;
+
+// The memory the packet path may use when memory_limit_kb is not configured.
+constexpr uint32_t kDefaultMemoryLimitKb = 8 * 1024;
+
+// The fragments in flight unacknowledged when ack_window is not configured.
+constexpr uint32_t kDefaultAckWindow = 16;
+
+// The retransmits of a fragment before it is dropped, when ack_max_retransmits
+// is not configured.
+constexpr uint32_t kDefaultAckMaxRetransmits = 30;
+
+// The retransmits of a UDP or ICMP fragment, when ack_bounded_retransmits is
+// not configured.
+constexpr uint32_t kDefaultAckBoundedRetransmits = 4;
+
+// How long the fragments of a frame marked for voice or video are sent for,
+// when ack_real_time_deadline_ms is not configured.
+constexpr uint32_t kDefaultAckRealTimeDeadlineMs = 150;
 // Stats object to hold the stats
 
 Logger::LogPrinter logger;
@@ -152,6 +185,21 @@ void SetInterfaceFlags(const std::string_view &device_name, int flags)
   close(fd);
 }
 
+// Sets the MTU of a given interface. Quits and logs the error on failure.
+void SetInterfaceMtu(const std::string_view &device_name, int mtu)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(fd >= 0, "Failed to open socket: %s (%d)", strerror(errno), errno);
+
+  struct ifreq ifr = {};
+  ifr.ifr_mtu = mtu;
+  strncpy(ifr.ifr_name, std::string(device_name).c_str(), IFNAMSIZ);
+  int status = ioctl(fd, SIOCSIFMTU, &ifr);
+  CHECK(status >= 0, "Failed to set tunnel interface mtu: %s (%d)",
+        strerror(errno), errno);
+  close(fd);
+}
+
 void SetIPAddress(const std::string_view &device_name,
                   const std::string_view &ip, const std::string &ip_mask)
 {
@@ -221,14 +269,43 @@ int main(int argc, char **argv)
 
   if (mode == RadioMode::Mesh)
   {
+    // Slabs and packet buffer pools reserve against this as they are created
+    MemoryBudget::SetLimit(static_cast<size_t>(config.memory_limit_kb.value_or(kDefaultMemoryLimitKb)) * 1024);
+    LOGI("Packet memory limited to %zu kB", MemoryBudget::Limit() / 1024);
+
+    // Frames of the MTU fill every fragment they are split into. Both ends
+    // of a link running this version negotiate compact fragments.
+    uint32_t tunnel_mtu = config.tunnel_mtu.value_or(kDefaultTunnelMtu);
+    CHECK(tunnel_mtu <= PACKET_BUFFER_MAX_FRAME_SIZE, "tunnel_mtu must be at most %d", PACKET_BUFFER_MAX_FRAME_SIZE);
+    tunnel_mtu = FullFragmentFrameSize(tunnel_mtu, COMPACT_PACKET_PAYLOAD_SIZE);
+    SetInterfaceMtu(config.interface_name.value(), tunnel_mtu);
+    LOGI("tunnel '%s' mtu set to %u", config.interface_name.value().c_str(), tunnel_mtu);
+
     nerfnet::TunnelInterface tunnel_interface(tunnel_fd);
+    tunnel_interface.SetMtu(tunnel_mtu);
 
+    HeaderCompressionLayer header_compression_layer;
+    PayloadCompressionLayer payload_compression_layer;
+    payload_compression_layer.Enable(config.payload_compression.value_or(true));
     MessageFragmentationLayer fragmentation_layer;
-
-    AckLayer ack_layer(1);
-    ack_layer.Enable(false);
+    ForwardErrorCorrectionLayer fec_layer;
+    fec_layer.Enable(config.forward_error_correction.value_or(true));
+
+    AckLayer ack_layer(config.ack_window.value_or(kDefaultAckWindow));
+    ack_layer.Enable(config.acknowledgements.value_or(true));
+    ack_layer.SetMaxRetransmits(config.ack_max_retransmits.value_or(kDefaultAckMaxRetransmits));
+    ack_layer.SetBoundedRetransmits(config.ack_bounded_retransmits.value_or(kDefaultAckBoundedRetransmits));
+    ack_layer.SetRealTimeDeadlineUs(config.ack_real_time_deadline_ms.value_or(kDefaultAckRealTimeDeadlineMs) * 1000ULL);
+    if (config.acknowledgements.value_or(true))
+    {
+        // Acknowledged fragments are never sent again, reassembly keeps them
+        // for as long as the rest of their frame may be retransmitted
+        fragmentation_layer.SetReassemblyLimits(AckLayer::kMaxFramesInFlight, ack_layer.RetransmitHorizonUs());
+        fec_layer.SetAckLayer(&ack_layer);
+    }
+    nerfnet::Rf24RadioDriver radio(config.ce_pin.value(), 0);
     nerfnet::MeshRadioInterface radio_interface(
-        config.ce_pin.value(),
+        radio,
         0,
         0x55, 0x66,
         config.channel.value(),
@@ -238,22 +315,27 @@ int main(int argc, char **argv)
         config.low_noise_amplifier.value(),
         config.data_rate.value());
 
-    tunnel_interface.SetDownstreamLayer(&fragmentation_layer);
-    fragmentation_layer.SetDownstreamLayer(&ack_layer);
-    ack_layer.SetDownstreamLayer(&radio_interface);
-    radio_interface.SetDownstreamLayer(nullptr); // Bottom Layer
-    radio_interface.SetUpstreamLayer(&ack_layer);
-    ack_layer.SetUpstreamLayer(&fragmentation_layer);
-    fragmentation_layer.SetUpstreamLayer(&tunnel_interface);
-    tunnel_interface.SetUpstreamLayer(nullptr); // Top Layer
+    // Top layer first, the stack wires every neighbour when it is built
+    LayerStack<nerfnet::TunnelInterface,
+               HeaderCompressionLayer,
+               PayloadCompressionLayer,
+               MessageFragmentationLayer,
+               ForwardErrorCorrectionLayer,
+               AckLayer,
+               nerfnet::MeshRadioInterface>
+        layer_stack(tunnel_interface, header_compression_layer, payload_compression_layer,
+                    fragmentation_layer, fec_layer, ack_layer, radio_interface);
 
     tunnel_interface.Start();
-    while (1)
-    {
-      tunnel_interface.Run();
-      ack_layer.Run();
-      radio_interface.Run();
-    }
+
+    // Sleeps until a layer deadline passes or the tunnel thread queues a frame
+    nerfnet::InstallLatencyDumpHandler(kLatencyDumpPath);
+    nerfnet::EventLoop event_loop;
+    event_loop.AddLayer(&tunnel_interface);
+    event_loop.AddLayer(&fragmentation_layer);
+    event_loop.AddLayer(&ack_layer);
+    event_loop.AddLayer(&radio_interface);
+    event_loop.Run();
   }
   else if (mode == RadioMode::Automatic)
   {
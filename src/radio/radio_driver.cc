@@ -0,0 +1,22 @@
+#include "radio_driver.h"
+
+namespace nerfnet
+{
+
+    uint64_t RadioPacketAirTimeUs(uint8_t data_rate)
+    {
+        // Preamble, 3 byte address, 9 bit packet control field, 32 byte payload and 1 byte CRC
+        constexpr uint64_t kPacketBits = (1 + 3 + 32 + 1) * 8 + 9;
+        switch (data_rate)
+        {
+        case RADIO_1MBPS:
+            return kPacketBits;
+        case RADIO_250KBPS:
+            return kPacketBits * 4;
+        case RADIO_2MBPS:
+        default:
+            return kPacketBits / 2;
+        }
+    }
+
+} // namespace nerfnet
@@ -0,0 +1,73 @@
+#ifndef RADIO_DRIVER_H
+#define RADIO_DRIVER_H
+
+#include <cstdint>
+
+namespace nerfnet {
+
+// Data rates, numbered like RF24's rf24_datarate_e so config values carry over.
+enum RadioDataRate : uint8_t
+{
+    RADIO_1MBPS = 0,
+    RADIO_2MBPS = 1,
+    RADIO_250KBPS = 2,
+};
+
+// CRC lengths, numbered like RF24's rf24_crclength_e.
+enum RadioCrcLength : uint8_t
+{
+    RADIO_CRC_DISABLED = 0,
+    RADIO_CRC_8 = 1,
+    RADIO_CRC_16 = 2,
+};
+
+// The depth of the nRF24L01 TX and RX FIFOs.
+constexpr int kRadioFifoDepth = 3;
+
+// Returns the on-air time of one 32 byte packet with a 3 byte address.
+uint64_t RadioPacketAirTimeUs(uint8_t data_rate);
+
+// The subset of the RF24 API the mesh radio uses. The methods keep RF24's
+// names and semantics so the hardware driver is a thin wrapper and a
+// simulated radio can stand in for it.
+class RadioDriver
+{
+public:
+    virtual ~RadioDriver() = default;
+
+    virtual bool begin() = 0;
+    virtual bool isChipConnected() = 0;
+
+    virtual void setChannel(uint8_t channel) = 0;
+    virtual void setPALevel(uint8_t level, bool lna_enable) = 0;
+    virtual bool setDataRate(RadioDataRate data_rate) = 0;
+    virtual void setAddressWidth(uint8_t address_width) = 0;
+    virtual void setCRCLength(RadioCrcLength length) = 0;
+    virtual void enableDynamicPayloads() = 0;
+    virtual void enableAckPayload() = 0;
+    virtual void setAutoAck(bool enable) = 0;
+    virtual void setRetries(uint8_t delay, uint8_t count) = 0;
+
+    virtual void openReadingPipe(uint8_t pipe, uint64_t address) = 0;
+    virtual void openWritingPipe(uint64_t address) = 0;
+    virtual void startListening() = 0;
+    virtual void stopListening() = 0;
+
+    // Returns true if the RX FIFO holds a packet, and which pipe it came in on.
+    virtual bool available() = 0;
+    virtual bool available(uint8_t *pipe) = 0;
+    virtual void read(void *buffer, uint8_t length) = 0;
+
+    // Queues a packet in the TX FIFO, waiting for space if it is full.
+    virtual bool writeFast(const void *buffer, uint8_t length) = 0;
+
+    // Waits until the TX FIFO has been sent, returns false on a timeout.
+    virtual bool txStandBy() = 0;
+
+    virtual uint8_t flush_rx() = 0;
+    virtual uint8_t flush_tx() = 0;
+};
+
+}  // namespace nerfnet
+
+#endif // RADIO_DRIVER_H
@@ -0,0 +1,65 @@
+#ifndef RF24_RADIO_DRIVER_H
+#define RF24_RADIO_DRIVER_H
+
+#include <RF24/RF24.h>
+#include "radio_driver.h"
+
+namespace nerfnet {
+
+static_assert(int(RADIO_1MBPS) == int(RF24_1MBPS) && int(RADIO_2MBPS) == int(RF24_2MBPS) &&
+                  int(RADIO_250KBPS) == int(RF24_250KBPS),
+              "RadioDataRate must match rf24_datarate_e");
+static_assert(int(RADIO_CRC_DISABLED) == int(RF24_CRC_DISABLED) && int(RADIO_CRC_8) == int(RF24_CRC_8) &&
+                  int(RADIO_CRC_16) == int(RF24_CRC_16),
+              "RadioCrcLength must match rf24_crclength_e");
+
+// Drives an nRF24L01 through librf24.
+class Rf24RadioDriver final : public RadioDriver
+{
+public:
+    Rf24RadioDriver(uint16_t ce_pin, uint16_t csn_pin)
+        : radio_(ce_pin, csn_pin)
+    {
+    }
+
+    bool begin() override { return radio_.begin(); }
+    bool isChipConnected() override { return radio_.isChipConnected(); }
+
+    void setChannel(uint8_t channel) override { radio_.setChannel(channel); }
+    void setPALevel(uint8_t level, bool lna_enable) override { radio_.setPALevel(level, lna_enable); }
+    bool setDataRate(RadioDataRate data_rate) override
+    {
+        return radio_.setDataRate(static_cast<rf24_datarate_e>(data_rate));
+    }
+    void setAddressWidth(uint8_t address_width) override { radio_.setAddressWidth(address_width); }
+    void setCRCLength(RadioCrcLength length) override
+    {
+        radio_.setCRCLength(static_cast<rf24_crclength_e>(length));
+    }
+    void enableDynamicPayloads() override { radio_.enableDynamicPayloads(); }
+    void enableAckPayload() override { radio_.enableAckPayload(); }
+    void setAutoAck(bool enable) override { radio_.setAutoAck(enable); }
+    void setRetries(uint8_t delay, uint8_t count) override { radio_.setRetries(delay, count); }
+
+    void openReadingPipe(uint8_t pipe, uint64_t address) override { radio_.openReadingPipe(pipe, address); }
+    void openWritingPipe(uint64_t address) override { radio_.openWritingPipe(address); }
+    void startListening() override { radio_.startListening(); }
+    void stopListening() override { radio_.stopListening(); }
+
+    bool available() override { return radio_.available(); }
+    bool available(uint8_t *pipe) override { return radio_.available(pipe); }
+    void read(void *buffer, uint8_t length) override { radio_.read(buffer, length); }
+
+    bool writeFast(const void *buffer, uint8_t length) override { return radio_.writeFast(buffer, length); }
+    bool txStandBy() override { return radio_.txStandBy(); }
+
+    uint8_t flush_rx() override { return radio_.flush_rx(); }
+    uint8_t flush_tx() override { return radio_.flush_tx(); }
+
+private:
+    RF24 radio_;
+};
+
+}  // namespace nerfnet
+
+#endif // RF24_RADIO_DRIVER_H
@@ -0,0 +1,327 @@
+#include "simulated_radio.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "log.h"
+#include "nrftime.h"
+
+namespace nerfnet
+{
+
+    namespace
+    {
+        // The time the PLL takes to settle when switching from RX to TX.
+        constexpr uint64_t kTxSettleUs = 130;
+
+        void SleepUntilUs(uint64_t deadline_us)
+        {
+            std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+                std::chrono::microseconds(deadline_us)));
+        }
+    }
+
+    SimulatedMedium::SimulatedMedium(const SimulatedMediumConfig &config)
+        : config_(config), rng_(config.seed)
+    {
+    }
+
+    SimulatedMediumStats SimulatedMedium::stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    void SimulatedMedium::Attach(SimulatedRadio *radio)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        radios_.push_back(radio);
+    }
+
+    void SimulatedMedium::Detach(SimulatedRadio *radio)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        radios_.erase(std::remove(radios_.begin(), radios_.end(), radio), radios_.end());
+    }
+
+    uint64_t SimulatedMedium::StartTransmission(const SimulatedRadio *sender, uint8_t channel, uint64_t end_us)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t now_us = TimeNowUs();
+        Transmission transmission = {next_transmission_id_++, sender, channel, now_us, end_us, false};
+        for (Transmission &other : transmissions_)
+        {
+            if (config_.collisions && other.channel == channel && other.end_us > now_us)
+            {
+                other.collided = true;
+                transmission.collided = true;
+            }
+        }
+        transmissions_.push_back(transmission);
+        stats_.packets_sent++;
+        return transmission.id;
+    }
+
+    void SimulatedMedium::FinishTransmission(uint64_t id, const SimulatedRadio *sender, uint64_t address,
+                                             const uint8_t *data, uint8_t length)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(transmissions_.begin(), transmissions_.end(),
+                               [id](const Transmission &transmission)
+                               { return transmission.id == id; });
+        CHECK(it != transmissions_.end(), "Unknown transmission %llu", static_cast<unsigned long long>(id));
+        Transmission transmission = *it;
+        transmissions_.erase(it);
+        if (transmission.collided)
+        {
+            stats_.packets_collided++;
+            return;
+        }
+
+        for (SimulatedRadio *radio : radios_)
+        {
+            uint8_t pipe;
+            if (radio == sender || !radio->Receives(transmission.channel, address, &pipe))
+            {
+                continue;
+            }
+            uint8_t received[SimulatedRadio::kMaxPayloadSize];
+            std::memcpy(received, data, length);
+            if (Impair(received, length, radio->crc_length_) && radio->Deliver(pipe, received, length))
+            {
+                stats_.packets_delivered++;
+            }
+        }
+    }
+
+    bool SimulatedMedium::Impair(uint8_t *data, uint8_t length, uint8_t crc_length)
+    {
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        if (config_.loss_rate > 0.0 && uniform(rng_) < config_.loss_rate)
+        {
+            stats_.packets_lost++;
+            return false;
+        }
+
+        if (config_.bit_error_rate > 0.0)
+        {
+            std::binomial_distribution<int> bit_errors(length * 8, config_.bit_error_rate);
+            int flips = bit_errors(rng_);
+            if (flips > 0)
+            {
+                // A corrupted packet slips past an n bit CRC once in 2^n
+                double crc_escape = crc_length == RADIO_CRC_DISABLED ? 1.0 : 1.0 / (1 << (8 * crc_length));
+                if (uniform(rng_) >= crc_escape)
+                {
+                    stats_.crc_failures++;
+                    return false;
+                }
+                std::uniform_int_distribution<int> bit(0, length * 8 - 1);
+                for (int i = 0; i < flips; i++)
+                {
+                    int position = bit(rng_);
+                    data[position / 8] ^= 1 << (position % 8);
+                }
+                stats_.corrupted_deliveries++;
+            }
+        }
+        return true;
+    }
+
+    SimulatedRadio::SimulatedRadio(SimulatedMedium &medium)
+        : medium_(medium)
+    {
+        medium_.Attach(this);
+    }
+
+    SimulatedRadio::~SimulatedRadio()
+    {
+        medium_.Detach(this);
+    }
+
+    void SimulatedRadio::setChannel(uint8_t channel)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        channel_ = channel;
+    }
+
+    bool SimulatedRadio::setDataRate(RadioDataRate data_rate)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        data_rate_ = data_rate;
+        return true;
+    }
+
+    void SimulatedRadio::setAddressWidth(uint8_t address_width)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        address_width_ = std::min<uint8_t>(std::max<uint8_t>(address_width, 3), 5);
+    }
+
+    void SimulatedRadio::setCRCLength(RadioCrcLength length)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        crc_length_ = length;
+    }
+
+    void SimulatedRadio::openReadingPipe(uint8_t pipe, uint64_t address)
+    {
+        if (pipe >= kNumPipes)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        pipe_open_[pipe] = true;
+        pipe_addresses_[pipe] = address;
+    }
+
+    void SimulatedRadio::openWritingPipe(uint64_t address)
+    {
+        writing_address_ = address;
+    }
+
+    void SimulatedRadio::startListening()
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        listening_ = true;
+    }
+
+    void SimulatedRadio::stopListening()
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        listening_ = false;
+        tx_ready_us_ = TimeNowUs() + kTxSettleUs;
+    }
+
+    bool SimulatedRadio::available()
+    {
+        uint8_t pipe;
+        return available(&pipe);
+    }
+
+    bool SimulatedRadio::available(uint8_t *pipe)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        if (rx_fifo_.empty())
+        {
+            return false;
+        }
+        if (pipe)
+        {
+            *pipe = rx_fifo_.front().pipe;
+        }
+        return true;
+    }
+
+    void SimulatedRadio::read(void *buffer, uint8_t length)
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        if (rx_fifo_.empty())
+        {
+            std::memset(buffer, 0, length);
+            return;
+        }
+        const Payload &payload = rx_fifo_.front();
+        uint8_t copied = std::min(length, payload.length);
+        std::memcpy(buffer, payload.data, copied);
+        std::memset(static_cast<uint8_t *>(buffer) + copied, 0, length - copied);
+        rx_fifo_.pop_front();
+    }
+
+    bool SimulatedRadio::writeFast(const void *buffer, uint8_t length)
+    {
+        if (tx_fifo_.full())
+        {
+            TransmitOne();
+        }
+        Payload payload = {};
+        payload.length = std::min(length, kMaxPayloadSize);
+        std::memcpy(payload.data, buffer, payload.length);
+        tx_fifo_.push_back(payload);
+        return true;
+    }
+
+    bool SimulatedRadio::txStandBy()
+    {
+        while (!tx_fifo_.empty())
+        {
+            TransmitOne();
+        }
+        return true;
+    }
+
+    uint8_t SimulatedRadio::flush_rx()
+    {
+        std::lock_guard<std::mutex> lock(medium_.mutex_);
+        rx_fifo_.clear();
+        return 0;
+    }
+
+    uint8_t SimulatedRadio::flush_tx()
+    {
+        tx_fifo_.clear();
+        return 0;
+    }
+
+    void SimulatedRadio::TransmitOne()
+    {
+        uint8_t channel;
+        uint8_t data_rate;
+        {
+            std::lock_guard<std::mutex> lock(medium_.mutex_);
+            channel = channel_;
+            data_rate = data_rate_;
+        }
+        // The first packet after leaving RX waits for the PLL, later ones follow back to back
+        SleepUntilUs(tx_ready_us_);
+        uint64_t end_us = TimeNowUs() + RadioPacketAirTimeUs(data_rate);
+        uint64_t id = medium_.StartTransmission(this, channel, end_us);
+        SleepUntilUs(end_us);
+        const Payload &payload = tx_fifo_.front();
+        medium_.FinishTransmission(id, this, writing_address_, payload.data, payload.length);
+        tx_fifo_.pop_front();
+    }
+
+    bool SimulatedRadio::Receives(uint8_t channel, uint64_t address, uint8_t *pipe) const
+    {
+        if (!listening_ || channel != channel_)
+        {
+            return false;
+        }
+        uint64_t mask = (1ULL << (8 * address_width_)) - 1;
+        for (uint8_t i = 0; i < kNumPipes; i++)
+        {
+            if (!pipe_open_[i])
+            {
+                continue;
+            }
+            // Pipes 2 to 5 only have their own low byte, the rest is shared with pipe 1
+            uint64_t pipe_address = i < 2 ? pipe_addresses_[i]
+                                          : (pipe_addresses_[1] & ~0xFFULL) | (pipe_addresses_[i] & 0xFF);
+            if ((pipe_address & mask) == (address & mask))
+            {
+                *pipe = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool SimulatedRadio::Deliver(uint8_t pipe, const uint8_t *data, uint8_t length)
+    {
+        if (rx_fifo_.full())
+        {
+            medium_.stats_.rx_fifo_overflows++;
+            return false;
+        }
+        Payload payload = {};
+        payload.pipe = pipe;
+        payload.length = length;
+        std::memcpy(payload.data, data, length);
+        rx_fifo_.push_back(payload);
+        return true;
+    }
+
+} // namespace nerfnet
@@ -0,0 +1,185 @@
+#ifndef SIMULATED_RADIO_H
+#define SIMULATED_RADIO_H
+
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "radio_driver.h"
+
+namespace nerfnet {
+
+class SimulatedRadio;
+
+// The impairments a SimulatedMedium applies to every packet.
+struct SimulatedMediumConfig
+{
+    // The probability that a packet never reaches a receiver.
+    double loss_rate = 0.0;
+    // The probability that any one bit of a packet is flipped.
+    double bit_error_rate = 0.0;
+    // Whether packets that overlap in time on a channel destroy each other.
+    bool collisions = true;
+    uint32_t seed = 1;
+};
+
+// Counters kept by the medium, for reporting.
+struct SimulatedMediumStats
+{
+    uint64_t packets_sent = 0;
+    uint64_t packets_delivered = 0;
+    uint64_t packets_lost = 0;
+    uint64_t packets_collided = 0;
+    // Corrupted packets the receiver's CRC caught and discarded
+    uint64_t crc_failures = 0;
+    // Corrupted packets that passed the 8 bit CRC and were delivered
+    uint64_t corrupted_deliveries = 0;
+    uint64_t rx_fifo_overflows = 0;
+};
+
+// The air shared by a set of simulated radios. Time is real time: a packet
+// occupies its channel for its air time at the sender's data rate, and is
+// handed to every listening radio with a matching pipe address once it has
+// been sent. Radios may be driven from different threads.
+class SimulatedMedium
+{
+public:
+    explicit SimulatedMedium(const SimulatedMediumConfig &config);
+
+    SimulatedMedium(const SimulatedMedium &) = delete;
+    SimulatedMedium &operator=(const SimulatedMedium &) = delete;
+
+    SimulatedMediumStats stats() const;
+
+private:
+    friend class SimulatedRadio;
+
+    struct Transmission
+    {
+        uint64_t id;
+        const SimulatedRadio *sender;
+        uint8_t channel;
+        uint64_t start_us;
+        uint64_t end_us;
+        bool collided;
+    };
+
+    void Attach(SimulatedRadio *radio);
+    void Detach(SimulatedRadio *radio);
+
+    // Puts a packet on the air from now until end_us and returns its id.
+    uint64_t StartTransmission(const SimulatedRadio *sender, uint8_t channel, uint64_t end_us);
+
+    // Delivers a packet once its air time has passed.
+    void FinishTransmission(uint64_t id, const SimulatedRadio *sender, uint64_t address,
+                            const uint8_t *data, uint8_t length);
+
+    // Returns true if the packet should reach this receiver and applies bit errors to it.
+    bool Impair(uint8_t *data, uint8_t length, uint8_t crc_length);
+
+    const SimulatedMediumConfig config_;
+
+    // Guards the medium and the receive side of every attached radio.
+    mutable std::mutex mutex_;
+    std::vector<SimulatedRadio *> radios_;
+    std::vector<Transmission> transmissions_;
+    uint64_t next_transmission_id_ = 1;
+    std::mt19937 rng_;
+    SimulatedMediumStats stats_;
+};
+
+// An nRF24L01 on a SimulatedMedium: 3 deep TX and RX FIFOs, six reading
+// pipes, channels and data rates. Auto acknowledgement and retries are not
+// modelled, the mesh radio runs without them.
+class SimulatedRadio final : public RadioDriver
+{
+public:
+    explicit SimulatedRadio(SimulatedMedium &medium);
+    ~SimulatedRadio() override;
+
+    bool begin() override { return true; }
+    bool isChipConnected() override { return true; }
+
+    void setChannel(uint8_t channel) override;
+    void setPALevel(uint8_t /*level*/, bool /*lna_enable*/) override {}
+    bool setDataRate(RadioDataRate data_rate) override;
+    void setAddressWidth(uint8_t address_width) override;
+    void setCRCLength(RadioCrcLength length) override;
+    void enableDynamicPayloads() override {}
+    void enableAckPayload() override {}
+    void setAutoAck(bool /*enable*/) override {}
+    void setRetries(uint8_t /*delay*/, uint8_t /*count*/) override {}
+
+    void openReadingPipe(uint8_t pipe, uint64_t address) override;
+    void openWritingPipe(uint64_t address) override;
+    void startListening() override;
+    void stopListening() override;
+
+    bool available() override;
+    bool available(uint8_t *pipe) override;
+    void read(void *buffer, uint8_t length) override;
+
+    bool writeFast(const void *buffer, uint8_t length) override;
+    bool txStandBy() override;
+
+    uint8_t flush_rx() override;
+    uint8_t flush_tx() override;
+
+private:
+    friend class SimulatedMedium;
+
+    static constexpr int kNumPipes = 6;
+    static constexpr uint8_t kMaxPayloadSize = 32;
+
+    struct Payload
+    {
+        uint8_t pipe;
+        uint8_t length;
+        uint8_t data[kMaxPayloadSize];
+    };
+
+    // A hardware FIFO, fixed size so the radio never allocates.
+    struct Fifo
+    {
+        Payload entries[kRadioFifoDepth];
+        int head = 0;
+        int count = 0;
+
+        bool empty() const { return count == 0; }
+        bool full() const { return count == kRadioFifoDepth; }
+        const Payload &front() const { return entries[head]; }
+        void push_back(const Payload &payload) { entries[(head + count++) % kRadioFifoDepth] = payload; }
+        void pop_front() { head = (head + 1) % kRadioFifoDepth; count--; }
+        void clear() { head = count = 0; }
+    };
+
+    // Sends the packet at the head of the TX FIFO, blocking for its air time.
+    void TransmitOne();
+
+    // Called by the medium with its mutex held.
+    bool Receives(uint8_t channel, uint64_t address, uint8_t *pipe) const;
+    // Returns false if the RX FIFO is full and the packet is lost.
+    bool Deliver(uint8_t pipe, const uint8_t *data, uint8_t length);
+
+    SimulatedMedium &medium_;
+
+    // Owned by the thread driving the radio.
+    Fifo tx_fifo_;
+    uint64_t writing_address_ = 0;
+    // When the transmitter is ready after the last switch out of RX
+    uint64_t tx_ready_us_ = 0;
+
+    // Read by the medium, guarded by its mutex.
+    uint8_t channel_ = 76;
+    uint8_t data_rate_ = RADIO_1MBPS;
+    uint8_t address_width_ = 5;
+    uint8_t crc_length_ = RADIO_CRC_16;
+    bool listening_ = false;
+    bool pipe_open_[kNumPipes] = {};
+    uint64_t pipe_addresses_[kNumPipes] = {};
+    Fifo rx_fifo_;
+};
+
+}  // namespace nerfnet
+
+#endif // SIMULATED_RADIO_H
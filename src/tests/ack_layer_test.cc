@@ -0,0 +1,466 @@
+// Runs two AckLayers against each other over a wire that drops chosen
+// packets, and checks that every fragment reaches the other end exactly once.
+// Then does the same with reassembly above them, for whole frames. Exits
+// non-zero on the first failed check.
+//
+//     ack_layer_test
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <utility>
+
+#include "ILayer.h"
+#include "ack_handling_layer.h"
+#include "layer_stack.h"
+#include "log.h"
+#include "message_definitions.h"
+#include "message_fragmentation_layer.h"
+#include "nrftime.h"
+#include "timer_wheel.h"
+
+Logger::LogPrinter logger;
+
+namespace
+{
+    constexpr uint32_t kWindow = 16;
+    // Long enough for the initial retransmit timeout to pass a few times
+    constexpr uint64_t kSettleUs = 500000;
+    constexpr uint64_t kPollUs = 50;
+
+    // Stands in for the fragmentation layer, keeps what comes up
+    class SinkLayer final : public ILayer
+    {
+    public:
+        void ReceiveFromDownstream(PacketBuffer data) override
+        {
+            received.push_back(std::move(data));
+        }
+
+        void ReceiveFromUpstream(PacketBuffer /*data*/) override {}
+
+        void Reset() override {}
+
+        PacketBatch received;
+    };
+
+    // Stands in for the radio, keeps what goes down until the link moves it
+    class WireLayer final : public ILayer
+    {
+    public:
+        void ReceiveFromDownstream(PacketBuffer /*data*/) override {}
+
+        void ReceiveFromUpstream(PacketBuffer data) override
+        {
+            sent.push_back(std::move(data));
+        }
+
+        void Reset() override {}
+
+        PacketBatch sent;
+    };
+
+    struct Node
+    {
+        explicit Node(uint32_t window)
+            : ack(window), stack(top, ack, wire)
+        {
+        }
+
+        SinkLayer top;
+        AckLayer ack;
+        WireLayer wire;
+        LayerStack<SinkLayer, AckLayer, WireLayer> stack;
+    };
+
+    // A node that fragments frames and reassembles them, set up like the
+    // daemon does with acknowledgements on
+    struct FramedNode
+    {
+        explicit FramedNode(uint32_t window)
+            : ack(window), stack(top, fragmentation, ack, wire)
+        {
+            fragmentation.SetReassemblyLimits(AckLayer::kMaxFramesInFlight, ack.RetransmitHorizonUs());
+        }
+
+        SinkLayer top;
+        MessageFragmentationLayer fragmentation;
+        AckLayer ack;
+        WireLayer wire;
+        LayerStack<SinkLayer, MessageFragmentationLayer, AckLayer, WireLayer> stack;
+    };
+
+    using DropFilter = std::function<bool(const DataPacket &packet)>;
+
+    // Node a sends to node b, both ack what they receive
+    template <typename NodeType>
+    class BasicLink
+    {
+    public:
+        explicit BasicLink(uint32_t window = kWindow)
+            : a(window), b(window)
+        {
+            a.ack.SetTimerWheel(&timers_);
+            b.ack.SetTimerWheel(&timers_);
+        }
+
+        // Runs both ends like the event loop does, moving the packets sent
+        // since the last pass to the other end unless a filter drops them
+        void RunFor(uint64_t duration_us)
+        {
+            uint64_t end_us = nerfnet::TimeNowUs() + duration_us;
+            while (nerfnet::TimeNowUs() < end_us)
+            {
+                timers_.Advance(nerfnet::TimeNowUs());
+                Run(a);
+                Run(b);
+                sent_to_b += Deliver(a.wire.sent, b, drop_to_b);
+                sent_to_a += Deliver(b.wire.sent, a, drop_to_a);
+                nerfnet::SleepUs(kPollUs);
+            }
+        }
+
+        NodeType a;
+        NodeType b;
+        DropFilter drop_to_b;
+        DropFilter drop_to_a;
+        size_t sent_to_b = 0;
+        size_t sent_to_a = 0;
+
+    private:
+        static void Run(Node &node)
+        {
+            node.ack.Run();
+        }
+
+        static void Run(FramedNode &node)
+        {
+            node.fragmentation.Run();
+            node.ack.Run();
+        }
+
+        static size_t Deliver(PacketBatch &sent, NodeType &to, const DropFilter &drop)
+        {
+            size_t count = sent.size();
+            PacketBatch batch;
+            for (PacketBuffer &data : sent)
+            {
+                if (!drop || !drop(AsDataPacket(data)))
+                {
+                    batch.push_back(std::move(data));
+                }
+            }
+            sent.clear();
+            if (!batch.empty())
+            {
+                to.ack.ReceiveBatchFromDownstream(batch);
+            }
+            return count;
+        }
+
+        nerfnet::TimerWheel timers_;
+    };
+
+    using Link = BasicLink<Node>;
+    using FramedLink = BasicLink<FramedNode>;
+
+    PacketBuffer Fragment(uint8_t message_id, uint8_t fragment_index, bool final_packet)
+    {
+        DataPacket packet = {};
+        packet.packet_type = static_cast<uint8_t>(final_packet ? PacketType::Data : PacketType::DataFragment);
+        packet.message_id = message_id;
+        packet.fragment_index = fragment_index;
+        if (final_packet)
+        {
+            packet.valid_bytes = 1;
+            packet.final_packet = true;
+            packet.compact_frame = true;
+        }
+        packet.raw_data[PACKET_SIZE - 1] = static_cast<uint8_t>(message_id ^ fragment_index);
+        PacketBuffer data = DataPacketToBuffer(packet);
+        CHECK(data.valid(), "Failed to allocate a fragment");
+        return data;
+    }
+
+    void SendFrame(Node &node, uint8_t message_id, size_t fragments)
+    {
+        PacketBatch batch;
+        for (size_t i = 0; i < fragments; i++)
+        {
+            batch.push_back(Fragment(message_id, static_cast<uint8_t>(i), i + 1 == fragments));
+        }
+        node.ack.ReceiveBatchFromUpstream(batch);
+    }
+
+    // How often each fragment was passed up, by message_id and fragment_index
+    std::map<std::pair<uint8_t, uint8_t>, int> Delivered(const SinkLayer &top)
+    {
+        std::map<std::pair<uint8_t, uint8_t>, int> delivered;
+        for (const PacketBuffer &data : top.received)
+        {
+            const DataPacket &packet = AsDataPacket(data);
+            CHECK(packet.raw_data[PACKET_SIZE - 1] == (packet.message_id ^ packet.fragment_index),
+                  "Fragment %d of message %d came up with the wrong bytes", packet.fragment_index,
+                  packet.message_id);
+            delivered[{packet.message_id, packet.fragment_index}]++;
+        }
+        return delivered;
+    }
+
+    void CheckDeliveredOnce(const SinkLayer &top, uint8_t first_message_id, size_t frames, size_t fragments)
+    {
+        std::map<std::pair<uint8_t, uint8_t>, int> delivered = Delivered(top);
+        for (size_t frame = 0; frame < frames; frame++)
+        {
+            for (size_t i = 0; i < fragments; i++)
+            {
+                uint8_t message_id = static_cast<uint8_t>(first_message_id + frame);
+                int count = delivered[{message_id, static_cast<uint8_t>(i)}];
+                CHECK(count == 1, "Fragment %zu of message %d came up %d times", i, message_id, count);
+            }
+        }
+        CHECK(delivered.size() == frames * fragments, "%zu fragments came up, expected %zu", delivered.size(),
+              frames * fragments);
+    }
+
+    // Once everything is acknowledged the sender goes quiet
+    template <typename LinkType>
+    void CheckIdle(LinkType &link)
+    {
+        size_t sent = link.sent_to_b;
+        link.RunFor(kSettleUs);
+        CHECK(link.sent_to_b == sent, "Sender still sent %zu packets after everything arrived",
+              link.sent_to_b - sent);
+    }
+
+    void TestLossless()
+    {
+        Link link;
+        uint32_t resent = logger.stats.ack_messages_resent;
+        for (uint8_t frame = 0; frame < 4; frame++)
+        {
+            SendFrame(link.a, frame, 6);
+        }
+        link.RunFor(kSettleUs);
+        CheckDeliveredOnce(link.b.top, 0, 4, 6);
+        CHECK(logger.stats.ack_messages_resent == resent, "%u packets resent without loss",
+              logger.stats.ack_messages_resent - resent);
+        CheckIdle(link);
+    }
+
+    void TestLostFragments()
+    {
+        // The first transmission of three fragments is lost, the acks of the
+        // ones after them show the gaps
+        Link link;
+        std::map<uint8_t, int> transmissions;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            int sent = transmissions[packet.fragment_index]++;
+            return sent == 0 && (packet.fragment_index == 1 || packet.fragment_index == 4 ||
+                                 packet.fragment_index == 5);
+        };
+        uint32_t resent = logger.stats.ack_messages_resent;
+        uint32_t fast = logger.stats.ack_fast_retransmits;
+        SendFrame(link.a, 7, 10);
+        link.RunFor(kSettleUs);
+        CheckDeliveredOnce(link.b.top, 7, 1, 10);
+        // Selective repeat: only the lost fragments are sent again
+        uint32_t resent_count = logger.stats.ack_messages_resent - resent;
+        CHECK(resent_count >= 3 && resent_count < 10, "%u packets resent for 3 lost", resent_count);
+        CHECK(logger.stats.ack_fast_retransmits > fast, "Lost fragments waited for their timeout");
+        CheckIdle(link);
+    }
+
+    void TestLostFinalFragment()
+    {
+        // Nothing after the final fragment shows it lost, it times out
+        Link link;
+        int final_sent = 0;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            return packet.fragment_index == 2 && final_sent++ < 2;
+        };
+        SendFrame(link.a, 200, 3);
+        link.RunFor(kSettleUs);
+        CheckDeliveredOnce(link.b.top, 200, 1, 3);
+        CheckIdle(link);
+    }
+
+    void TestPackedPacket()
+    {
+        // Packed packets are acknowledged by message_id alone
+        Link link;
+        int sent = 0;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            return packet.packet_type == static_cast<uint8_t>(PacketType::DataPacked) && sent++ == 0;
+        };
+        DataPacket packet = {};
+        packet.packet_type = static_cast<uint8_t>(PacketType::DataPacked);
+        packet.message_id = 9;
+        packet.fragment_index = PACKED_FRAGMENT_INDEX;
+        link.a.ack.ReceiveFromUpstream(DataPacketToBuffer(packet));
+        link.RunFor(kSettleUs);
+        CHECK(link.b.top.received.size() == 1, "Packed packet came up %zu times", link.b.top.received.size());
+        CheckIdle(link);
+    }
+
+    bool IsAck(const DataPacket &packet)
+    {
+        return packet.packet_type == static_cast<uint8_t>(PacketType::DataAck);
+    }
+
+    void TestLostAcks()
+    {
+        // The sender resends what arrived, the receiver acks it again and
+        // keeps it to itself
+        Link link;
+        int acks = 0;
+        link.drop_to_a = [&](const DataPacket &packet) {
+            return IsAck(packet) && acks++ < 2;
+        };
+        uint32_t suppressed = logger.stats.ack_duplicates_suppressed;
+        SendFrame(link.a, 30, 5);
+        // Each timeout doubles the next one
+        link.RunFor(kSettleUs * 2);
+        CheckDeliveredOnce(link.b.top, 30, 1, 5);
+        CHECK(logger.stats.ack_duplicates_suppressed > suppressed, "No duplicate reached the receiver");
+        CheckIdle(link);
+    }
+
+    void TestManyFramesInFlight()
+    {
+        // More incomplete frames than a small table tracks. The first fragment
+        // of every frame is lost and so are the acks for a while, so the
+        // second fragments are resent after the receiver got them.
+        constexpr uint32_t kLargeWindow = 64;
+        constexpr uint8_t kFrames = 30;
+        Link link(kLargeWindow);
+        // Slow start opens the congestion window up to the whole window
+        for (uint8_t frame = 0; frame < 100; frame++)
+        {
+            SendFrame(link.a, frame, 1);
+        }
+        link.RunFor(kSettleUs);
+        CheckDeliveredOnce(link.b.top, 0, 100, 1);
+        link.b.top.received.clear();
+
+        std::map<std::pair<uint8_t, uint8_t>, int> transmissions;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            return packet.fragment_index == 0 && transmissions[{packet.message_id, packet.fragment_index}]++ == 0;
+        };
+        uint64_t acks_from_us = nerfnet::TimeNowUs() + 30000;
+        link.drop_to_a = [&](const DataPacket &packet) {
+            return IsAck(packet) && nerfnet::TimeNowUs() < acks_from_us;
+        };
+        for (uint8_t frame = 0; frame < kFrames; frame++)
+        {
+            SendFrame(link.a, static_cast<uint8_t>(100 + frame), 2);
+        }
+        link.RunFor(kSettleUs * 2);
+        CheckDeliveredOnce(link.b.top, 100, kFrames, 2);
+        CheckIdle(link);
+    }
+
+    // A frame of `size` bytes, every byte of it depends on its id
+    void SendFramed(FramedNode &node, uint8_t frame_id, size_t size)
+    {
+        PacketBuffer frame = PacketBuffer::Allocate(size);
+        CHECK(frame.valid(), "Failed to allocate a frame");
+        for (size_t i = 0; i < size; i++)
+        {
+            frame.data()[i] = static_cast<uint8_t>(frame_id + i * 7);
+        }
+        node.fragmentation.ReceiveFromUpstream(std::move(frame));
+    }
+
+    void CheckFramesDeliveredOnce(const SinkLayer &top, uint8_t first_frame_id, size_t frames, size_t size)
+    {
+        std::map<uint8_t, int> delivered;
+        for (const PacketBuffer &frame : top.received)
+        {
+            CHECK(frame.size() == size, "Frame of %zu bytes came up, expected %zu", frame.size(), size);
+            uint8_t frame_id = frame.data()[0];
+            for (size_t i = 0; i < size; i++)
+            {
+                CHECK(frame.data()[i] == static_cast<uint8_t>(frame_id + i * 7), "Frame %d came up with the wrong bytes",
+                      frame_id);
+            }
+            delivered[frame_id]++;
+        }
+        for (size_t frame = 0; frame < frames; frame++)
+        {
+            uint8_t frame_id = static_cast<uint8_t>(first_frame_id + frame);
+            CHECK(delivered[frame_id] == 1, "Frame %d came up %d times", frame_id, delivered[frame_id]);
+        }
+        CHECK(delivered.size() == frames, "%zu frames came up, expected %zu", delivered.size(), frames);
+    }
+
+    bool IsFinalFragment(const DataPacket &packet)
+    {
+        return packet.packet_type == static_cast<uint8_t>(PacketType::Data) && packet.final_packet;
+    }
+
+    void TestReassemblyOutlastsBackoff()
+    {
+        // The final fragment is lost until each timeout doubled the next one
+        // past a second, the fragments before it were acknowledged long ago
+        FramedLink link;
+        int final_sent = 0;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            return IsFinalFragment(packet) && final_sent++ < 8;
+        };
+        SendFramed(link.a, 1, 100);
+        uint64_t deadline_us = nerfnet::TimeNowUs() + 10000000;
+        while (link.b.top.received.empty() && nerfnet::TimeNowUs() < deadline_us)
+        {
+            link.RunFor(kSettleUs);
+        }
+        CHECK(final_sent > 8, "The final fragment was sent %d times", final_sent);
+        CheckFramesDeliveredOnce(link.b.top, 1, 1, 100);
+        CheckIdle(link);
+    }
+
+    void TestManyFramesReassembled()
+    {
+        // More frames wait for a lost final fragment than one per packet in
+        // the window, their first fragments acknowledged
+        constexpr uint32_t kLargeWindow = 64;
+        constexpr uint8_t kFrames = 40;
+        constexpr size_t kFrameSize = 40;
+        FramedLink link(kLargeWindow);
+        // Slow start opens the congestion window up to the whole window
+        for (uint8_t frame = 0; frame < 100; frame++)
+        {
+            SendFramed(link.a, frame, kFrameSize);
+        }
+        link.RunFor(kSettleUs);
+        CheckFramesDeliveredOnce(link.b.top, 0, 100, kFrameSize);
+        link.b.top.received.clear();
+
+        std::map<uint8_t, int> transmissions;
+        link.drop_to_b = [&](const DataPacket &packet) {
+            return IsFinalFragment(packet) && transmissions[packet.message_id]++ < 3;
+        };
+        for (uint8_t frame = 0; frame < kFrames; frame++)
+        {
+            SendFramed(link.a, static_cast<uint8_t>(100 + frame), kFrameSize);
+        }
+        link.RunFor(kSettleUs * 4);
+        CheckFramesDeliveredOnce(link.b.top, 100, kFrames, kFrameSize);
+        CheckIdle(link);
+    }
+}
+
+int main()
+{
+    TestLossless();
+    TestLostFragments();
+    TestLostFinalFragment();
+    TestPackedPacket();
+    TestLostAcks();
+    TestManyFramesInFlight();
+    TestReassemblyOutlastsBackoff();
+    TestManyFramesReassembled();
+    printf("ack_layer_test passed\n");
+    return 0;
+}
@@ -0,0 +1,259 @@
+// Round trips frames through PayloadCompressionLayer and feeds it hand made
+// and broken LZ4 blocks. Exits non-zero on the first failed check.
+//
+//     payload_compression_test
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ILayer.h"
+#include "layer_stack.h"
+#include "log.h"
+#include "message_definitions.h"
+#include "payload_compression_layer.h"
+
+Logger::LogPrinter logger;
+
+namespace
+{
+    // Stands in for the layers around the compression layer and keeps what
+    // it is handed
+    class SinkLayer final : public ILayer
+    {
+    public:
+        void ReceiveFromDownstream(PacketBuffer data) override
+        {
+            received.push_back(std::move(data));
+        }
+
+        void ReceiveFromUpstream(PacketBuffer data) override
+        {
+            sent.push_back(std::move(data));
+        }
+
+        uint8_t LinkFeatures() const override
+        {
+            return LINK_FEATURE_PAYLOAD_COMPRESSION;
+        }
+
+        void Reset() override {}
+
+        PacketBatch sent;
+        PacketBatch received;
+    };
+
+    // A run of the preset dictionary, a frame of it is one dictionary match
+    const char kDictionaryRun[] =
+        "\"temperature\":\"humidity\":\"pressure\":\"battery\":\"voltage\":\"current\":";
+    // The last bytes of the preset dictionary
+    const char kDictionaryTail[] = "},{\"";
+
+    std::vector<uint8_t> Bytes(const PacketBuffer &data)
+    {
+        return std::vector<uint8_t>(data.data(), data.data() + data.size());
+    }
+
+    PacketBuffer Frame(const std::vector<uint8_t> &bytes)
+    {
+        PacketBuffer frame = PacketBuffer::CopyFrom(bytes.data(), bytes.size());
+        CHECK(frame.valid(), "Failed to allocate a frame");
+        return frame;
+    }
+
+    std::vector<uint8_t> Text(const std::string &text)
+    {
+        return std::vector<uint8_t>(text.begin(), text.end());
+    }
+
+    // Deterministic bytes that look random
+    std::vector<uint8_t> Noise(size_t size, uint32_t seed)
+    {
+        std::vector<uint8_t> bytes(size);
+        for (uint8_t &byte : bytes)
+        {
+            seed = seed * 1664525 + 1013904223;
+            byte = static_cast<uint8_t>(seed >> 24);
+        }
+        return bytes;
+    }
+
+    class Harness
+    {
+    public:
+        Harness()
+            : stack_(top_, compression_, bottom_)
+        {
+        }
+
+        // Compresses a frame, returns what reached the layer below
+        std::vector<uint8_t> Send(const std::vector<uint8_t> &frame)
+        {
+            compression_.ReceiveFromUpstream(Frame(frame));
+            CHECK(bottom_.sent.size() == 1, "Expected one frame downstream, got %zu", bottom_.sent.size());
+            std::vector<uint8_t> bytes = Bytes(bottom_.sent.front());
+            bottom_.sent.clear();
+            return bytes;
+        }
+
+        // Decompresses a frame, returns whether anything reached the layer
+        // above and what it was
+        bool Receive(const std::vector<uint8_t> &frame, std::vector<uint8_t> *out)
+        {
+            compression_.ReceiveFromDownstream(Frame(frame));
+            CHECK(top_.received.size() <= 1, "Expected at most one frame upstream, got %zu", top_.received.size());
+            if (top_.received.empty())
+            {
+                return false;
+            }
+            *out = Bytes(top_.received.front());
+            top_.received.clear();
+            return true;
+        }
+
+        void RoundTrip(const std::vector<uint8_t> &frame, size_t max_compressed_size)
+        {
+            std::vector<uint8_t> compressed = Send(frame);
+            CHECK(compressed.size() <= max_compressed_size, "Frame of %zu bytes compressed to %zu, expected at most %zu",
+                  frame.size(), compressed.size(), max_compressed_size);
+            std::vector<uint8_t> decompressed;
+            CHECK(Receive(compressed, &decompressed), "Compressed frame of %zu bytes was dropped", frame.size());
+            CHECK(decompressed == frame, "Frame of %zu bytes changed in the round trip", frame.size());
+        }
+
+    private:
+        SinkLayer top_;
+        PayloadCompressionLayer compression_;
+        SinkLayer bottom_;
+        LayerStack<SinkLayer, PayloadCompressionLayer, SinkLayer> stack_;
+    };
+
+    void TestDictionaryMatch(Harness &harness)
+    {
+        // One match into the dictionary and the last literals
+        harness.RoundTrip(Text(kDictionaryRun), 16);
+
+        std::string reading = "{\"id\":\"42\",\"temperature\":21.5,\"humidity\":40,\"battery\":97,\"status\":\"ok\"}";
+        harness.RoundTrip(Text(reading), reading.size() * 3 / 4);
+    }
+
+    void TestMatchesInFrame(Harness &harness)
+    {
+        std::string text;
+        while (text.size() < PACKET_BUFFER_MAX_FRAME_SIZE - 100)
+        {
+            text += "{\"sensor\":\"kitchen\",\"value\":" + std::to_string(text.size()) + "},";
+        }
+        harness.RoundTrip(Text(text), text.size() / 3);
+
+        // Runs longer than the offset overlap the bytes they copy, and need
+        // length extensions
+        std::vector<uint8_t> run(2000, 'a');
+        run[0] = 0x45;
+        harness.RoundTrip(run, 32);
+    }
+
+    void TestMatchIntoFrame(Harness &harness)
+    {
+        // Two literals, then a match of 10 starting 4 bytes before the end of
+        // the dictionary that runs on into the frame, then the last literals
+        std::vector<uint8_t> block = {FRAME_DISPATCH_COMPRESSED, 0x26, 'x', 'y', 6, 0, 0x50, 'A', 'B', 'C', 'D', 'E'};
+        std::string expected = std::string("xy") + kDictionaryTail + "xy" + kDictionaryTail + "ABCDE";
+        std::vector<uint8_t> decompressed;
+        CHECK(harness.Receive(block, &decompressed), "Match into the frame was dropped");
+        CHECK(decompressed == Text(expected), "Match into the frame decoded to the wrong bytes");
+    }
+
+    void TestIncompressible(Harness &harness)
+    {
+        for (size_t size : {64, 512, 1400, 3000})
+        {
+            // Starts like an IPv4 packet, as frames from the tunnel do
+            std::vector<uint8_t> frame = Noise(size, static_cast<uint32_t>(size));
+            frame[0] = 0x45;
+            CHECK(harness.Send(frame) == frame, "Random frame of %zu bytes was not passed on unchanged", size);
+            std::vector<uint8_t> received;
+            CHECK(harness.Receive(frame, &received) && received == frame,
+                  "Random frame of %zu bytes was not passed up unchanged", size);
+        }
+    }
+
+    void TestTruncated(Harness &harness)
+    {
+        std::string text;
+        while (text.size() < 1000)
+        {
+            text += "{\"topic\":\"tele/plug/state\",\"power\":" + std::to_string(text.size() % 97) + "}";
+        }
+        std::vector<uint8_t> frame = Text(text);
+        std::vector<uint8_t> compressed = harness.Send(frame);
+        CHECK(compressed[0] == FRAME_DISPATCH_COMPRESSED, "Text frame was not compressed");
+
+        // A block cut short may end where a sequence does, then it decodes
+        // to a shorter frame. It never decodes to anything else.
+        for (size_t size = 1; size < compressed.size(); size++)
+        {
+            std::vector<uint8_t> truncated(compressed.begin(), compressed.begin() + size);
+            std::vector<uint8_t> decompressed;
+            if (harness.Receive(truncated, &decompressed))
+            {
+                CHECK(decompressed.size() < frame.size() &&
+                          std::equal(decompressed.begin(), decompressed.end(), frame.begin()),
+                      "Block truncated to %zu bytes decoded to more than a prefix", size);
+            }
+        }
+    }
+
+    void TestMalformed(Harness &harness)
+    {
+        std::vector<uint8_t> decompressed;
+        // A match offset of zero
+        CHECK(!harness.Receive({FRAME_DISPATCH_COMPRESSED, 0x10, 'x', 0, 0, 0x10, 'y'}, &decompressed),
+              "Zero offset was accepted");
+        // An offset reaching back past the start of the dictionary
+        CHECK(!harness.Receive({FRAME_DISPATCH_COMPRESSED, 0x10, 'x', 0xFF, 0xFF, 0x10, 'y'}, &decompressed),
+              "Offset past the dictionary was accepted");
+        // More literals than the block holds
+        CHECK(!harness.Receive({FRAME_DISPATCH_COMPRESSED, 0x50, 'x', 'y'}, &decompressed),
+              "Literals past the end of the block were accepted");
+        // A literal length extension that runs off the end
+        CHECK(!harness.Receive({FRAME_DISPATCH_COMPRESSED, 0xF0, 255, 255}, &decompressed),
+              "Unterminated length was accepted");
+        // A match longer than the largest frame
+        std::vector<uint8_t> long_match = {FRAME_DISPATCH_COMPRESSED, 0x1F, 'x', 1, 0};
+        long_match.insert(long_match.end(), PACKET_BUFFER_MAX_FRAME_SIZE / 255 + 1, 255);
+        long_match.push_back(0);
+        long_match.push_back(0x10);
+        long_match.push_back('y');
+        CHECK(!harness.Receive(long_match, &decompressed), "Match past the largest frame was accepted");
+        // A block that ends after a match, without the last literals
+        CHECK(!harness.Receive({FRAME_DISPATCH_COMPRESSED, 0x10, 'x', 1, 0}, &decompressed),
+              "Block ending in a match was accepted");
+
+        // Whatever random blocks decode to has to fit in a frame
+        for (uint32_t seed = 1; seed <= 2000; seed++)
+        {
+            std::vector<uint8_t> block = Noise(1 + seed % 200, seed);
+            block[0] = FRAME_DISPATCH_COMPRESSED;
+            if (harness.Receive(block, &decompressed))
+            {
+                CHECK(decompressed.size() <= PACKET_BUFFER_MAX_FRAME_SIZE, "Random block decoded to %zu bytes",
+                      decompressed.size());
+            }
+        }
+    }
+}
+
+int main()
+{
+    Harness harness;
+    TestDictionaryMatch(harness);
+    TestMatchesInFrame(harness);
+    TestMatchIntoFrame(harness);
+    TestIncompressible(harness);
+    TestTruncated(harness);
+    TestMalformed(harness);
+    printf("payload_compression_test passed\n");
+    return 0;
+}
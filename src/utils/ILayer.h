@@ -17,36 +17,86 @@
 #ifndef ILAYER_H
 #define ILAYER_H
 
-#include <vector>
 #include <functional>
+#include <cstddef>
 #include <cstdint>
+#include <utility>
+#include <vector>
 #include "log.h"
+#include "packet_buffer.h"
+#include "timer_wheel.h"
+
+
+
+// A group of packets handed between layers in a single call. Batches are
+// consumed by the receiving layer and left empty, so the sender can keep one
+// around and reuse its capacity.
+using PacketBatch = std::vector<PacketBuffer>;
 
+class ILayer;
 
+// The connection from a layer to one of its neighbours. A link made with
+// ILayer::SetDownstreamLayer/SetUpstreamLayer dispatches through the ILayer
+// vtable, LayerStack installs links that call the concrete layer directly.
+struct LayerLink
+{
+    ILayer *layer = nullptr;
+    void (*deliver)(ILayer *layer, PacketBuffer data) = nullptr;
+    void (*deliver_batch)(ILayer *layer, PacketBatch &batch) = nullptr;
+};
 
 class ILayer
 {
 public:
+    // Returned by NextDeadlineUs when the layer has no timed work pending
+    static constexpr uint64_t kNoDeadline = UINT64_MAX;
+
+    // Returned by TxCredits when nothing below the layer limits what it takes
+    static constexpr size_t kUnlimitedCredits = SIZE_MAX;
+
     virtual ~ILayer() = default;
 
     // Set the downstream layer (the layer below this one)
     virtual void SetDownstreamLayer(ILayer *downstream)
     {
-        downstream_layer_ = downstream;
+        downstream_link_ = LayerLink();
+        if (downstream)
+        {
+            downstream_link_.layer = downstream;
+            downstream_link_.deliver = &ILayer::DeliverFromUpstream;
+            downstream_link_.deliver_batch = &ILayer::DeliverBatchFromUpstream;
+        }
     }
 
     // Set the upstream layer (the layer above this one)
     virtual void SetUpstreamLayer(ILayer *upstream)
     {
-        upstream_layer_ = upstream;
+        upstream_link_ = LayerLink();
+        if (upstream)
+        {
+            upstream_link_.layer = upstream;
+            upstream_link_.deliver = &ILayer::DeliverFromDownstream;
+            upstream_link_.deliver_batch = &ILayer::DeliverBatchFromDownstream;
+        }
+    }
+
+    // Set the links to the neighbouring layers directly, used by LayerStack
+    void SetDownstreamLink(const LayerLink &link)
+    {
+        downstream_link_ = link;
+    }
+    void SetUpstreamLink(const LayerLink &link)
+    {
+        upstream_link_ = link;
     }
 
-    // Pass data downstream (to the lower layer)
-    virtual void SendDownstream(const std::vector<uint8_t> &data)
+    // Pass data downstream (to the lower layer). The buffer is handed over, so
+    // callers move it in rather than copying it.
+    void SendDownstream(PacketBuffer data)
     {
-        if (downstream_layer_)
+        if (downstream_link_.deliver)
         {
-            downstream_layer_->ReceiveFromUpstream(data);
+            downstream_link_.deliver(downstream_link_.layer, std::move(data));
         }else
         {
             LOGE("No downstream layer set");
@@ -54,22 +104,109 @@ public:
     }
 
     // Pass data upstream (to the higher layer)
-    virtual void SendUpstream(const std::vector<uint8_t> &data)
+    void SendUpstream(PacketBuffer data)
     {
-        if (upstream_layer_)
+        if (upstream_link_.deliver)
         {
-            upstream_layer_->ReceiveFromDownstream(data);
+            upstream_link_.deliver(upstream_link_.layer, std::move(data));
         }else
         {
             LOGE("No upstream layer set");
         }
     }
 
+    // Pass a batch of packets downstream in one call
+    void SendDownstreamBatch(PacketBatch &batch)
+    {
+        if (downstream_link_.deliver_batch)
+        {
+            downstream_link_.deliver_batch(downstream_link_.layer, batch);
+        }else
+        {
+            LOGE("No downstream layer set");
+            batch.clear();
+        }
+    }
+
+    // Pass a batch of packets upstream in one call
+    void SendUpstreamBatch(PacketBatch &batch)
+    {
+        if (upstream_link_.deliver_batch)
+        {
+            upstream_link_.deliver_batch(upstream_link_.layer, batch);
+        }else
+        {
+            LOGE("No upstream layer set");
+            batch.clear();
+        }
+    }
+
     // Receive data from the lower layer
-    virtual void ReceiveFromDownstream(const std::vector<uint8_t> &data) = 0;
+    virtual void ReceiveFromDownstream(PacketBuffer data) = 0;
 
     // Receive data from the higher layer
-    virtual void ReceiveFromUpstream(const std::vector<uint8_t> &data) = 0;
+    virtual void ReceiveFromUpstream(PacketBuffer data) = 0;
+
+    // Receive a batch from the lower layer, by default one packet at a time
+    virtual void ReceiveBatchFromDownstream(PacketBatch &batch)
+    {
+        for (PacketBuffer &data : batch)
+        {
+            ReceiveFromDownstream(std::move(data));
+        }
+        batch.clear();
+    }
+
+    // Receive a batch from the higher layer, by default one packet at a time
+    virtual void ReceiveBatchFromUpstream(PacketBatch &batch)
+    {
+        for (PacketBuffer &data : batch)
+        {
+            ReceiveFromUpstream(std::move(data));
+        }
+        batch.clear();
+    }
+
+    // Does the periodic work of the layer, called by the event loop
+    virtual void Run() {}
+
+    // Returns the TimeNowUs() value at which Run has to be called next, or
+    // kNoDeadline if the layer is idle until one of its events fires
+    virtual uint64_t NextDeadlineUs() const
+    {
+        return kNoDeadline;
+    }
+
+    // Returns a file descriptor that becomes readable when the layer has work
+    // to do, or -1 if the layer has none
+    virtual int EventFd() const
+    {
+        return -1;
+    }
+
+    // Returns how many bytes the layer can take from upstream right now without
+    // dropping them or queueing them without bound. Layers that queue override
+    // this with their own free space, the rest pass on the credits of the layer
+    // below. The top of the stack holds back frames while it has no credit.
+    virtual size_t TxCredits() const
+    {
+        return DownstreamTxCredits();
+    }
+
+    // Returns the optional wire format features both ends of the link support,
+    // as LINK_FEATURE_* bits. The radio layer negotiates them, the rest pass
+    // on the features of the layer below.
+    virtual uint8_t LinkFeatures() const
+    {
+        return DownstreamLinkFeatures();
+    }
+
+    // The timers of the event loop the layer was added to, they fire before
+    // the loop runs its layers
+    void SetTimerWheel(nerfnet::TimerWheel *timer_wheel)
+    {
+        timer_wheel_ = timer_wheel;
+    }
 
     // Layer enable setter
     void SetLayerEnable(bool enable)
@@ -78,15 +215,54 @@ public:
     }
 
     virtual void Reset() = 0;
+protected:
+    // The credits advertised by the downstream layer
+    size_t DownstreamTxCredits() const
+    {
+        return downstream_link_.layer ? downstream_link_.layer->TxCredits() : kUnlimitedCredits;
+    }
+
+    // The link features advertised by the downstream layer
+    uint8_t DownstreamLinkFeatures() const
+    {
+        return downstream_link_.layer ? downstream_link_.layer->LinkFeatures() : 0;
+    }
+
+    // Layers with timers have to be added to an event loop first
+    nerfnet::TimerWheel &Timers() const
+    {
+        CHECK(timer_wheel_, "Layer with timers is not run by an event loop");
+        return *timer_wheel_;
+    }
 private:
+    // Virtual dispatch links used by SetDownstreamLayer/SetUpstreamLayer
+    static void DeliverFromUpstream(ILayer *layer, PacketBuffer data)
+    {
+        layer->ReceiveFromUpstream(std::move(data));
+    }
+    static void DeliverFromDownstream(ILayer *layer, PacketBuffer data)
+    {
+        layer->ReceiveFromDownstream(std::move(data));
+    }
+    static void DeliverBatchFromUpstream(ILayer *layer, PacketBatch &batch)
+    {
+        layer->ReceiveBatchFromUpstream(batch);
+    }
+    static void DeliverBatchFromDownstream(ILayer *layer, PacketBatch &batch)
+    {
+        layer->ReceiveBatchFromDownstream(batch);
+    }
+
     // Layer enable
     bool layer_enabled_ = true;
 
-    // The downstream layer (the layer below this one)
-    ILayer *downstream_layer_ = nullptr;
+    // The link to the downstream layer (the layer below this one)
+    LayerLink downstream_link_;
+
+    // The link to the upstream layer (the layer above this one)
+    LayerLink upstream_link_;
 
-    // The upstream layer (the layer above this one)
-    ILayer *upstream_layer_ = nullptr;
+    nerfnet::TimerWheel *timer_wheel_ = nullptr;
 };
 
 #endif // ILAYER_H
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include "alloc_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Counted per thread so the protocol loop is not skewed by the logger thread.
+thread_local uint64_t thread_heap_allocations = 0;
+
+}  // namespace
+
+namespace nerfnet {
+
+uint64_t ThreadHeapAllocations() {
+  return thread_heap_allocations;
+}
+
+}  // namespace nerfnet
+
+void *operator new(std::size_t size) {
+  ++thread_heap_allocations;
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
@@ -0,0 +1,15 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstdint>
+
+namespace nerfnet {
+
+// Returns the number of heap allocations made by the calling thread so far.
+// Every global operator new is counted, including those made by the standard
+// containers.
+uint64_t ThreadHeapAllocations();
+
+}  // namespace nerfnet
+
+#endif // ALLOC_COUNTER_H
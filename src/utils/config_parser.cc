@@ -89,6 +89,33 @@ void ConfigParser::load() {
     if(config.find("address_width") != config.end()) {
         address_width = std::stoi(get("address_width"));
     }
+    if(config.find("memory_limit_kb") != config.end()) {
+        memory_limit_kb = std::stoul(get("memory_limit_kb"));
+    }
+    if(config.find("payload_compression") != config.end()) {
+        payload_compression = (get("payload_compression") == "true");
+    }
+    if(config.find("forward_error_correction") != config.end()) {
+        forward_error_correction = (get("forward_error_correction") == "true");
+    }
+    if(config.find("tunnel_mtu") != config.end()) {
+        tunnel_mtu = std::stoul(get("tunnel_mtu"));
+    }
+    if(config.find("acknowledgements") != config.end()) {
+        acknowledgements = (get("acknowledgements") == "true");
+    }
+    if(config.find("ack_window") != config.end()) {
+        ack_window = std::stoul(get("ack_window"));
+    }
+    if(config.find("ack_max_retransmits") != config.end()) {
+        ack_max_retransmits = std::stoul(get("ack_max_retransmits"));
+    }
+    if(config.find("ack_bounded_retransmits") != config.end()) {
+        ack_bounded_retransmits = std::stoul(get("ack_bounded_retransmits"));
+    }
+    if(config.find("ack_real_time_deadline_ms") != config.end()) {
+        ack_real_time_deadline_ms = std::stoul(get("ack_real_time_deadline_ms"));
+    }
 
     // Validate that all of the parameters are set
     if (!interface_name) {
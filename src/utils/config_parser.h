@@ -42,6 +42,15 @@ public:
     std::optional<bool> low_noise_amplifier;
     std::optional<uint8_t> data_rate;
     std::optional<uint8_t> address_width;
+    std::optional<uint32_t> memory_limit_kb;
+    std::optional<bool> payload_compression;
+    std::optional<bool> forward_error_correction;
+    std::optional<uint32_t> tunnel_mtu;
+    std::optional<bool> acknowledgements;
+    std::optional<uint32_t> ack_window;
+    std::optional<uint32_t> ack_max_retransmits;
+    std::optional<uint32_t> ack_bounded_retransmits;
+    std::optional<uint32_t> ack_real_time_deadline_ms;
 
 private:
     // Get a value from the configuration file
@@ -0,0 +1,166 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "latency_trace.h"
+#include "log.h"
+#include "nrftime.h"
+
+namespace nerfnet
+{
+
+    namespace
+    {
+        // The largest number of events handled per epoll_wait.
+        constexpr int kMaxEvents = 8;
+
+        // How often the loop statistics are published.
+        constexpr uint64_t kStatsIntervalUs = 1000000;
+
+        uint64_t ProcessCpuTimeUs()
+        {
+            struct rusage usage = {};
+            getrusage(RUSAGE_SELF, &usage);
+            return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+                   usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        }
+    }
+
+    EventLoop::EventLoop()
+    {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        CHECK(epoll_fd_ >= 0, "Failed to create epoll: %s (%d)", strerror(errno), errno);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        CHECK(timer_fd_ >= 0, "Failed to create timerfd: %s (%d)", strerror(errno), errno);
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = timer_fd_;
+        CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event) == 0,
+              "Failed to add timerfd to epoll: %s (%d)", strerror(errno), errno);
+
+        stats_window_start_us_ = TimeNowUs();
+        cpu_time_at_window_start_us_ = ProcessCpuTimeUs();
+    }
+
+    EventLoop::~EventLoop()
+    {
+        close(timer_fd_);
+        close(epoll_fd_);
+    }
+
+    void EventLoop::AddLayer(ILayer *layer)
+    {
+        layers_.push_back(layer);
+        layer->SetTimerWheel(&timer_wheel_);
+        int fd = layer->EventFd();
+        if (fd >= 0)
+        {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0,
+                  "Failed to add layer fd to epoll: %s (%d)", strerror(errno), errno);
+        }
+    }
+
+    void EventLoop::Run()
+    {
+        while (running_.load(std::memory_order_relaxed))
+        {
+            RunOnce();
+        }
+    }
+
+    void EventLoop::Stop()
+    {
+        running_.store(false, std::memory_order_relaxed);
+    }
+
+    void EventLoop::RunOnce()
+    {
+        uint64_t next_deadline_us = ILayer::kNoDeadline;
+        DumpLatencyHistogramsIfRequested();
+        timer_wheel_.Advance(TimeNowUs());
+        for (ILayer *layer : layers_)
+        {
+            layer->Run();
+        }
+        next_deadline_us = std::min(next_deadline_us, timer_wheel_.NextDeadlineUs());
+        for (ILayer *layer : layers_)
+        {
+            next_deadline_us = std::min(next_deadline_us, layer->NextDeadlineUs());
+        }
+
+        UpdateStats();
+        if (next_deadline_us <= TimeNowUs())
+        {
+            return;
+        }
+
+        ArmTimer(next_deadline_us);
+        struct epoll_event events[kMaxEvents];
+        int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+        if (num_events < 0 && errno != EINTR)
+        {
+            LOGE("epoll_wait failed: %s (%d)", strerror(errno), errno);
+        }
+        wakeups_++;
+        total_wakeups_.fetch_add(1, std::memory_order_relaxed);
+
+        for (int i = 0; i < num_events; i++)
+        {
+            if (events[i].data.fd == timer_fd_)
+            {
+                uint64_t expirations;
+                ssize_t bytes_read = read(timer_fd_, &expirations, sizeof(expirations));
+                (void)bytes_read;
+                armed_deadline_us_ = 0;
+            }
+        }
+    }
+
+    void EventLoop::ArmTimer(uint64_t deadline_us)
+    {
+        if (deadline_us == armed_deadline_us_)
+        {
+            return;
+        }
+
+        struct itimerspec spec = {};
+        if (deadline_us != ILayer::kNoDeadline)
+        {
+            spec.it_value.tv_sec = deadline_us / 1000000;
+            spec.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+        }
+        CHECK(timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) == 0,
+              "Failed to arm timerfd: %s (%d)", strerror(errno), errno);
+        armed_deadline_us_ = deadline_us;
+    }
+
+    void EventLoop::UpdateStats()
+    {
+        uint64_t now_us = TimeNowUs();
+        uint64_t elapsed_us = now_us - stats_window_start_us_;
+        if (elapsed_us < kStatsIntervalUs)
+        {
+            return;
+        }
+
+        uint64_t cpu_time_us = ProcessCpuTimeUs();
+        UPDATE_STATS(&stats, loop_wakeups_per_second,
+                     static_cast<float>(wakeups_) * 1000000.0f / elapsed_us);
+        UPDATE_STATS(&stats, cpu_percent,
+                     100.0f * (cpu_time_us - cpu_time_at_window_start_us_) / elapsed_us);
+        wakeups_ = 0;
+        stats_window_start_us_ = now_us;
+        cpu_time_at_window_start_us_ = cpu_time_us;
+    }
+
+} // namespace nerfnet
@@ -0,0 +1,74 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "ILayer.h"
+#include "timer_wheel.h"
+
+namespace nerfnet {
+
+// Runs a set of layers from a single thread. Between passes the loop sleeps in
+// epoll until the earliest layer or timer deadline (armed on a timerfd) or
+// until one of the layers' event file descriptors becomes readable. Layers
+// schedule their timers on the loop's TimerWheel, due ones fire at the start
+// of a pass.
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // Adds a layer to the loop and gives it the loop's timers. Layers are run
+    // in the order they are added.
+    void AddLayer(ILayer *layer);
+
+    // Runs the layers until Stop is called.
+    void Run();
+
+    // Makes Run return after its current pass, may be called from any thread.
+    void Stop();
+
+    // Runs every layer once, then sleeps until the next deadline or event.
+    void RunOnce();
+
+    // The number of times the loop woke up since it was created, may be read
+    // from any thread.
+    uint64_t Wakeups() const
+    {
+        return total_wakeups_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Arms the timerfd for an absolute TimeNowUs() deadline.
+    void ArmTimer(uint64_t deadline_us);
+
+    // Publishes wakeups per second and CPU usage once per second.
+    void UpdateStats();
+
+    int epoll_fd_;
+    int timer_fd_;
+
+    std::vector<ILayer *> layers_;
+
+    TimerWheel timer_wheel_;
+
+    std::atomic<bool> running_{true};
+
+    // The deadline the timerfd is currently armed for.
+    uint64_t armed_deadline_us_ = 0;
+
+    // The number of times the loop woke up in the current stats window.
+    uint64_t wakeups_ = 0;
+    std::atomic<uint64_t> total_wakeups_{0};
+    uint64_t stats_window_start_us_ = 0;
+    uint64_t cpu_time_at_window_start_us_ = 0;
+};
+
+}  // namespace nerfnet
+
+#endif // EVENT_LOOP_H
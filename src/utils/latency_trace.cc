@@ -0,0 +1,155 @@
+#include "latency_trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include "log.h"
+#include "nrftime.h"
+
+namespace nerfnet
+{
+
+    namespace
+    {
+        const char *const kStageNames[] = {
+            "tunnel read",
+            "fragmented",
+            "ack enqueued",
+            "radio enqueued",
+            "on air",
+            "radio received",
+            "reassembled",
+            "tunnel write",
+        };
+        static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == static_cast<size_t>(TraceStage::Count),
+                      "Every trace stage needs a name");
+
+        // Each protocol loop thread traces its own stack
+        thread_local LatencyHistogram histograms[static_cast<size_t>(TraceStage::Count)];
+
+        std::string dump_path;
+        volatile std::sig_atomic_t dump_requested = 0;
+
+        void HandleDumpSignal(int)
+        {
+            dump_requested = 1;
+        }
+    }
+
+    LatencyHistogram::LatencyHistogram()
+    {
+        Reset();
+    }
+
+    void LatencyHistogram::Record(uint64_t value_us)
+    {
+        counts_[IndexFor(value_us)]++;
+        count_++;
+        if (value_us > max_)
+        {
+            max_ = value_us;
+        }
+    }
+
+    void LatencyHistogram::Reset()
+    {
+        std::memset(counts_, 0, sizeof(counts_));
+        count_ = 0;
+        max_ = 0;
+    }
+
+    size_t LatencyHistogram::IndexFor(uint64_t value)
+    {
+        if (value < kSubBucketCount)
+        {
+            return value;
+        }
+        // Keep the top kSubBucketBits bits of the value, the shift picks the octave
+        int shift = (63 - __builtin_clzll(value)) - kSubBucketBits + 1;
+        return shift * kSubBucketHalfCount + (value >> shift);
+    }
+
+    uint64_t LatencyHistogram::ValueFor(size_t index)
+    {
+        if (index < kSubBucketCount)
+        {
+            return index;
+        }
+        uint64_t shift = (index - kSubBucketHalfCount) / kSubBucketHalfCount;
+        uint64_t sub_bucket = index - shift * kSubBucketHalfCount;
+        // The highest value that lands in this bucket
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+    uint64_t LatencyHistogram::ValueAtPercentile(double percentile) const
+    {
+        if (count_ == 0)
+        {
+            return 0;
+        }
+        uint64_t target = static_cast<uint64_t>(percentile / 100.0 * count_ + 0.5);
+        target = std::max<uint64_t>(1, std::min(target, count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kNumCounts; i++)
+        {
+            seen += counts_[i];
+            if (seen >= target)
+            {
+                return std::min(ValueFor(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    void TraceLatency(TraceStage stage, uint64_t start_us)
+    {
+        if (start_us == 0)
+        {
+            return;
+        }
+        histograms[static_cast<size_t>(stage)].Record(TimeNowUs() - start_us);
+    }
+
+    void DumpLatencyHistograms(FILE *file)
+    {
+        fprintf(file, "%-16s %10s %10s %10s %10s %10s\n", "stage (us)", "count", "p50", "p99", "p999", "max");
+        for (size_t i = 0; i < static_cast<size_t>(TraceStage::Count); i++)
+        {
+            const LatencyHistogram &histogram = histograms[i];
+            fprintf(file, "%-16s %10llu %10llu %10llu %10llu %10llu\n", kStageNames[i],
+                    static_cast<unsigned long long>(histogram.count()),
+                    static_cast<unsigned long long>(histogram.ValueAtPercentile(50.0)),
+                    static_cast<unsigned long long>(histogram.ValueAtPercentile(99.0)),
+                    static_cast<unsigned long long>(histogram.ValueAtPercentile(99.9)),
+                    static_cast<unsigned long long>(histogram.max()));
+        }
+    }
+
+    void InstallLatencyDumpHandler(const std::string &path)
+    {
+        dump_path = path;
+        std::signal(SIGUSR1, HandleDumpSignal);
+    }
+
+    void DumpLatencyHistogramsIfRequested()
+    {
+        if (!dump_requested)
+        {
+            return;
+        }
+        dump_requested = 0;
+
+        FILE *file = fopen(dump_path.c_str(), "w");
+        if (!file)
+        {
+            LOGE("Failed to open %s: %s (%d)", dump_path.c_str(), strerror(errno), errno);
+            return;
+        }
+        DumpLatencyHistograms(file);
+        fclose(file);
+        LOGI("Latency histograms written to %s", dump_path.c_str());
+    }
+
+} // namespace nerfnet
@@ -0,0 +1,78 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "packet_buffer.h"
+
+namespace nerfnet {
+
+// The points a frame passes on its way through the stack. Transmit stages are
+// measured from the tunnel read, receive stages from the moment the first
+// fragment of the frame was read out of the radio.
+enum class TraceStage
+{
+    TunnelRead,
+    Fragmented,
+    AckEnqueued,
+    RadioEnqueued,
+    OnAir,
+    RadioReceived,
+    Reassembled,
+    TunnelWrite,
+    Count,
+};
+
+// A log-linear histogram in the style of HdrHistogram: every power of two is
+// split into 16 sub-buckets, so values are kept to within ~6% at a fixed
+// memory cost and recording is an index computation and an increment.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t value_us);
+    void Reset();
+
+    // Returns the value below which `percentile` (0-100) of the samples fall.
+    uint64_t ValueAtPercentile(double percentile) const;
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+
+private:
+    static constexpr int kSubBucketBits = 5;
+    static constexpr uint64_t kSubBucketCount = 1 << kSubBucketBits;
+    static constexpr uint64_t kSubBucketHalfCount = kSubBucketCount / 2;
+    static constexpr size_t kNumCounts = 64 * kSubBucketHalfCount + kSubBucketCount;
+
+    static size_t IndexFor(uint64_t value);
+    static uint64_t ValueFor(size_t index);
+
+    uint64_t counts_[kNumCounts];
+    uint64_t count_;
+    uint64_t max_;
+};
+
+// Records the time from `start_us` to now for a stage. A start of zero marks
+// an untraced packet and is ignored. Histograms are kept per thread, so call
+// this and the dump functions from the protocol loop.
+void TraceLatency(TraceStage stage, uint64_t start_us);
+
+inline void TraceLatency(TraceStage stage, const PacketBuffer &buffer)
+{
+    TraceLatency(stage, buffer.trace_start_us());
+}
+
+// Writes p50/p99/p999/max for every stage.
+void DumpLatencyHistograms(FILE *file);
+
+// Installs a SIGUSR1 handler that asks for the histograms to be written to
+// `path` at the next DumpLatencyHistogramsIfRequested call.
+void InstallLatencyDumpHandler(const std::string &path);
+void DumpLatencyHistogramsIfRequested();
+
+}  // namespace nerfnet
+
+#endif // LATENCY_TRACE_H
@@ -0,0 +1,150 @@
+#ifndef LAYER_STACK_H
+#define LAYER_STACK_H
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "ILayer.h"
+
+// Wires a fixed chain of layers together, top layer first. The chain is part
+// of the type, so every neighbour is connected at construction and nothing can
+// be left unwired.
+//
+// Dispatch is still dynamic. Layers are compiled apart from the stack and send
+// through the LayerLink of their neighbour, one indirect call per hop. The
+// stack only makes the target of that call a function for the concrete layer.
+// Layers in a stack are final, so that function calls the receive function
+// of the layer without a vtable lookup. Nothing is inlined across layers.
+//
+// Use ILayer itself as a template argument for a layer that is only known at
+// runtime, its links fall back to virtual dispatch:
+//
+//     LayerStack<TunnelInterface, ILayer, AckLayer, MeshRadioInterface>
+//         stack(tunnel, optional_layer, ack, radio);
+template <typename... Layers>
+class LayerStack
+{
+    static_assert(sizeof...(Layers) >= 2, "A layer stack needs at least two layers");
+    static_assert((std::is_base_of_v<ILayer, Layers> && ...), "Every layer in a stack must derive from ILayer");
+    static_assert(((!std::is_abstract_v<Layers> || std::is_same_v<Layers, ILayer>) && ...),
+                  "Only ILayer may be used as a dynamic layer in a stack");
+    // A subclass of a layer wired in under the layer's type would not have its
+    // overrides called
+    static_assert(((std::is_final_v<Layers> || std::is_same_v<Layers, ILayer>) && ...),
+                  "Layers in a stack must be final, use ILayer for a dynamic layer");
+
+public:
+    static constexpr size_t kNumLayers = sizeof...(Layers);
+
+    template <size_t I>
+    using LayerAt = std::tuple_element_t<I, std::tuple<Layers...>>;
+
+    explicit LayerStack(Layers &...layers)
+        : layers_(layers...)
+    {
+        Wire(std::make_index_sequence<kNumLayers - 1>());
+        Top().SetUpstreamLink(LayerLink());
+        Bottom().SetDownstreamLink(LayerLink());
+    }
+
+    LayerStack(const LayerStack &) = delete;
+    LayerStack &operator=(const LayerStack &) = delete;
+
+    template <size_t I>
+    LayerAt<I> &Get()
+    {
+        return std::get<I>(layers_);
+    }
+
+    LayerAt<0> &Top()
+    {
+        return Get<0>();
+    }
+
+    LayerAt<kNumLayers - 1> &Bottom()
+    {
+        return Get<kNumLayers - 1>();
+    }
+
+private:
+    template <size_t... I>
+    void Wire(std::index_sequence<I...>)
+    {
+        (Link<LayerAt<I>, LayerAt<I + 1>>(std::get<I>(layers_), std::get<I + 1>(layers_)), ...);
+    }
+
+    template <typename Upper, typename Lower>
+    static void Link(Upper &upper, Lower &lower)
+    {
+        LayerLink down;
+        down.layer = &lower;
+        down.deliver = &DeliverFromUpstream<Lower>;
+        down.deliver_batch = &DeliverBatchFromUpstream<Lower>;
+        upper.SetDownstreamLink(down);
+
+        LayerLink up;
+        up.layer = &upper;
+        up.deliver = &DeliverFromDownstream<Upper>;
+        up.deliver_batch = &DeliverBatchFromDownstream<Upper>;
+        lower.SetUpstreamLink(up);
+    }
+
+    // The calls below on final layers need no vtable, dynamic layers keep the
+    // virtual call.
+    template <typename Layer>
+    static void DeliverFromUpstream(ILayer *layer, PacketBuffer data)
+    {
+        if constexpr (std::is_same_v<Layer, ILayer>)
+        {
+            layer->ReceiveFromUpstream(std::move(data));
+        }
+        else
+        {
+            static_cast<Layer *>(layer)->ReceiveFromUpstream(std::move(data));
+        }
+    }
+
+    template <typename Layer>
+    static void DeliverFromDownstream(ILayer *layer, PacketBuffer data)
+    {
+        if constexpr (std::is_same_v<Layer, ILayer>)
+        {
+            layer->ReceiveFromDownstream(std::move(data));
+        }
+        else
+        {
+            static_cast<Layer *>(layer)->ReceiveFromDownstream(std::move(data));
+        }
+    }
+
+    template <typename Layer>
+    static void DeliverBatchFromUpstream(ILayer *layer, PacketBatch &batch)
+    {
+        if constexpr (std::is_same_v<Layer, ILayer>)
+        {
+            layer->ReceiveBatchFromUpstream(batch);
+        }
+        else
+        {
+            static_cast<Layer *>(layer)->ReceiveBatchFromUpstream(batch);
+        }
+    }
+
+    template <typename Layer>
+    static void DeliverBatchFromDownstream(ILayer *layer, PacketBatch &batch)
+    {
+        if constexpr (std::is_same_v<Layer, ILayer>)
+        {
+            layer->ReceiveBatchFromDownstream(batch);
+        }
+        else
+        {
+            static_cast<Layer *>(layer)->ReceiveBatchFromDownstream(batch);
+        }
+    }
+
+    std::tuple<Layers &...> layers_;
+};
+
+#endif // LAYER_STACK_H
@@ -38,7 +38,10 @@
 #define COLOR_WHITE "\033[37m"
 
 #define NUM_LINES_LOGGED 20
+// Tools that print their own output build with NERFNET_NO_TABLE_PRINTING
+#ifndef NERFNET_NO_TABLE_PRINTING
 #define ENABLE_TABLE_PRINTING
+#endif
 
 // Clear the console and move cursor to top-left
 #define CLEAR_SCREEN() printf("\033[2J\033[H")
@@ -55,9 +58,41 @@ namespace Logger
     uint32_t ack_messages_sent = 0;
     uint32_t ack_messages_received = 0;
     uint32_t ack_messages_resent = 0;
+    uint32_t ack_fast_retransmits = 0;
+    uint32_t acks_sent = 0;
+    uint32_t acks_piggybacked = 0;
+    uint32_t ack_duplicates_suppressed = 0;
+    uint32_t ack_packets_dropped = 0;
+    uint32_t ack_packets_expired = 0;
+    uint32_t ack_srtt_us = 0;
+    uint32_t ack_rto_us = 0;
+    uint32_t ack_cwnd = 0;
+    uint32_t ack_pacing_pps = 0;
+    uint32_t ack_congestion_events = 0;
     uint32_t radio_packets_sent = 0;
     uint32_t radio_packets_received = 0;
+    uint32_t tx_credit_stalls = 0;
+    uint32_t tcp_mss_clamped = 0;
+    uint32_t reassembly_timeouts = 0;
+    uint32_t reassembly_evictions = 0;
+    uint32_t reassembly_malformed = 0;
+    uint32_t reassembly_no_buffer = 0;
+    uint32_t frames_packed = 0;
+    uint32_t header_bytes_saved = 0;
+    uint32_t header_context_refreshes = 0;
+    uint32_t header_decompression_failures = 0;
+    uint32_t incompressible_frames = 0;
+    uint32_t fec_parity_sent = 0;
+    uint32_t fec_fragments_recovered = 0;
+    uint32_t fec_group_size = 0;
     float error_rate = 0.0f;
+    float heap_allocations_per_frame = 0.0f;
+    float loop_wakeups_per_second = 0.0f;
+    float cpu_percent = 0.0f;
+    float compression_ratio = 0.0f;
+    float compress_ns_per_frame = 0.0f;
+    float decompress_ns_per_frame = 0.0f;
+    float fec_loss_percent = 0.0f;
     std::deque<std::string> messages;
   };
 
@@ -66,8 +101,10 @@ namespace Logger
   public:
     LogPrinter()
     {
+#ifdef ENABLE_TABLE_PRINTING
       thread_ = std::thread(&LogPrinter::log_thread, this);
       printf(COLOR_GREEN "Logger thread started\n" COLOR_RESET);
+#endif
     }
 
     ~LogPrinter()
@@ -133,12 +170,76 @@ namespace Logger
         string_message += buffer;
         snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Messages Resent", stats.ack_messages_resent);
         string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Fast Retransmits", stats.ack_fast_retransmits);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Packets Sent", stats.acks_sent);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Records Piggybacked", stats.acks_piggybacked);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Duplicates Suppressed", stats.ack_duplicates_suppressed);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Packets Dropped", stats.ack_packets_dropped);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Packets Expired", stats.ack_packets_expired);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack SRTT (us)", stats.ack_srtt_us);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack RTO (us)", stats.ack_rto_us);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Congestion Window", stats.ack_cwnd);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Pacing (packets/s)", stats.ack_pacing_pps);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Ack Congestion Events", stats.ack_congestion_events);
+        string_message += buffer;
         snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Radio Packets Sent", stats.radio_packets_sent);
         string_message += buffer;
         snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Radio Packets Received", stats.radio_packets_received);
         string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "TX Credit Stalls", stats.tx_credit_stalls);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "TCP MSS Clamped", stats.tcp_mss_clamped);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Reassembly Timeouts", stats.reassembly_timeouts);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Reassembly Evictions", stats.reassembly_evictions);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Malformed Fragments", stats.reassembly_malformed);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Reassembly Out Of Buffers", stats.reassembly_no_buffer);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Packed Frames", stats.frames_packed);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Header Bytes Saved", stats.header_bytes_saved);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Header Context Refreshes", stats.header_context_refreshes);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Header Decompress Failures", stats.header_decompression_failures);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "Incompressible Frames", stats.incompressible_frames);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "FEC Parity Sent", stats.fec_parity_sent);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "FEC Fragments Recovered", stats.fec_fragments_recovered);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10u│\n", "FEC Group Size", stats.fec_group_size);
+        string_message += buffer;
         snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.2f│\n", "Error Rate", stats.error_rate);
         string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.2f│\n", "Heap Allocs / Frame", stats.heap_allocations_per_frame);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.1f│\n", "Loop Wakeups / s", stats.loop_wakeups_per_second);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.1f│\n", "CPU %", stats.cpu_percent);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.2f│\n", "Compression Ratio", stats.compression_ratio);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.1f│\n", "Compress ns / Frame", stats.compress_ns_per_frame);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.1f│\n", "Decompress ns / Frame", stats.decompress_ns_per_frame);
+        string_message += buffer;
+        snprintf(buffer, sizeof(buffer), "│ %-28s │ %-10.2f│\n", "FEC Fragment Loss %", stats.fec_loss_percent);
+        string_message += buffer;
         string_message += "└──────────────────────────────┴───────────┘\n";
 
         for (const auto &message : log_queue_)
@@ -0,0 +1,44 @@
+#include "memory_budget.h"
+
+#include <atomic>
+
+namespace
+{
+    // No ceiling until one is configured.
+    std::atomic<size_t> limit{static_cast<size_t>(-1)};
+    std::atomic<size_t> reserved{0};
+}
+
+void MemoryBudget::SetLimit(size_t bytes)
+{
+    limit.store(bytes, std::memory_order_relaxed);
+}
+
+bool MemoryBudget::TryReserve(size_t bytes, size_t keep_free)
+{
+    size_t ceiling = limit.load(std::memory_order_relaxed);
+    size_t current = reserved.load(std::memory_order_relaxed);
+    do
+    {
+        if (current > ceiling || bytes > ceiling - current || keep_free > ceiling - current - bytes)
+        {
+            return false;
+        }
+    } while (!reserved.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void MemoryBudget::Release(size_t bytes)
+{
+    reserved.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t MemoryBudget::Reserved()
+{
+    return reserved.load(std::memory_order_relaxed);
+}
+
+size_t MemoryBudget::Limit()
+{
+    return limit.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,27 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <cstddef>
+
+// A process wide ceiling on the memory the packet path may take from the heap.
+// Slabs reserve their whole capacity when they are created and the packet
+// buffer pools reserve every block they add, so once the ceiling is reached
+// the stack drops packets instead of growing.
+class MemoryBudget
+{
+public:
+    // Sets the ceiling in bytes. Call before any layer is created.
+    static void SetLimit(size_t bytes);
+
+    // Reserves `bytes` against the ceiling, returns false if they don't fit
+    // with `keep_free` bytes still to spare.
+    static bool TryReserve(size_t bytes, size_t keep_free = 0);
+
+    // Gives back bytes that were reserved with TryReserve.
+    static void Release(size_t bytes);
+
+    static size_t Reserved();
+    static size_t Limit();
+};
+
+#endif // MEMORY_BUDGET_H
@@ -2,30 +2,122 @@
 #define MESSAGE_DEFINITIONS_H
 
 #include <cstdint>
-#include <vector>
 #include "log.h"
+#include "packet_buffer.h"
 // Define message types and structures here
 #define PACKET_SIZE 32
 
-#define PACKET_HEADER_SIZE 3
-#define PACKET_PAYLOAD_SIZE 29
+#define PACKET_HEADER_SIZE 4
+#define PACKET_PAYLOAD_SIZE 28
 static_assert(PACKET_HEADER_SIZE + PACKET_PAYLOAD_SIZE == PACKET_SIZE, "Header plus payload size must be 32 bytes");
 
+// Middle fragments are always full, so on links that negotiated
+// LINK_FEATURE_COMPACT_FRAGMENTS they are sent as DataFragment packets
+// without the length byte. Only the final fragment carries the length.
+// This only wins back the byte the fragment index added to the data header:
+// middle fragments carry 29 bytes, as every fragment did before frames were
+// keyed by message id, while final fragments still carry 28. DataPacked and
+// DataParity packets share this header. A 2 byte header would need 15 bits
+// for the message id and fragment index (up to MAX_FRAGMENTS_PER_FRAME) next
+// to the checksum and type nibbles.
+#define COMPACT_PACKET_HEADER_SIZE 3
+#define COMPACT_PACKET_PAYLOAD_SIZE 29
+static_assert(COMPACT_PACKET_HEADER_SIZE + COMPACT_PACKET_PAYLOAD_SIZE == PACKET_SIZE,
+              "Compact header plus payload size must be 32 bytes");
+
+// Optional wire format features, advertised in the discovery packets. A
+// feature is only used on a link when both ends advertise it.
+#define LINK_FEATURE_COMPACT_FRAGMENTS (1 << 0)
+#define LINK_FEATURE_HEADER_COMPRESSION (1 << 1)
+#define LINK_FEATURE_PAYLOAD_COMPRESSION (1 << 2)
+#define LINK_FEATURE_PACKED_FRAMES (1 << 3)
+#define LINK_FEATURE_FORWARD_ERROR_CORRECTION (1 << 4)
+#define LINK_FEATURES_SUPPORTED                                                                      \
+    (LINK_FEATURE_COMPACT_FRAGMENTS | LINK_FEATURE_HEADER_COMPRESSION | LINK_FEATURE_PAYLOAD_COMPRESSION | \
+     LINK_FEATURE_PACKED_FRAMES | LINK_FEATURE_FORWARD_ERROR_CORRECTION)
+
+// The first byte of a frame passed between the tunnel and the fragmentation
+// layer. IP packets start with their version nibble, 4 or 6; the layers in
+// between mark the frames they encoded with the values below, the low nibble
+// is theirs to use.
+#define FRAME_DISPATCH_MASK 0xF0
+// A header compressed against a context, the low nibble is the context id
+#define FRAME_DISPATCH_HC_COMPRESSED 0x80
+// A full IP packet that (re)initializes a header compression context
+#define FRAME_DISPATCH_HC_REFRESH 0xA0
+// Asks the peer to refresh a header compression context, one byte long
+#define FRAME_DISPATCH_HC_FEEDBACK 0xB0
+// An LZ4 block holding a whole frame, dispatch byte included
+#define FRAME_DISPATCH_COMPRESSED 0xC0
+
+// The byte leading each record in a DataPacked packet. A whole frame
+// record is followed by the frame. A tail record is followed by the message
+// id and fragment index of the final fragment of a frame, then its bytes.
+#define PACKED_RECORD_LENGTH_MASK 0x3F
+#define PACKED_RECORD_TAIL (1 << 7)
+// Set on tail records of frames whose middle fragments are compact
+#define PACKED_RECORD_COMPACT (1 << 6)
+// Set on records without PACKED_RECORD_TAIL: ack records the sender's ack
+// layer put in the room left over, see ACK_RECORD_HEADER_SIZE
+#define PACKED_RECORD_ACK (1 << 6)
+#define PACKED_RECORD_TAIL_HEADER_SIZE 3
+// Never the index of a fragment, see MAX_FRAGMENTS_PER_FRAME
+#define PACKED_FRAGMENT_INDEX 0xFF
+
 #define PACKET_CHECKSUM_SIZE_BITS 4
 #define PACKET_TYPE_SIZE_BITS 4
 #define PACKET_VALID_BYTES_BITS 5
 #define FINAL_PACKET_SIZE_BITS 1
 
+// The most fragments a frame of PACKET_BUFFER_MAX_FRAME_SIZE bytes is split into, the
+// compact format never needs more
+#define MAX_FRAGMENTS_PER_FRAME ((PACKET_BUFFER_MAX_FRAME_SIZE + PACKET_PAYLOAD_SIZE - 1) / PACKET_PAYLOAD_SIZE)
+static_assert(MAX_FRAGMENTS_PER_FRAME <= PACKED_FRAGMENT_INDEX, "Fragment index must fit in one byte below PACKED_FRAGMENT_INDEX");
+
+// A DataAck packet holds the length of the ack records after it in its
+// second byte. An ack record acknowledges fragments of the frame with its
+// message_id: every fragment below its cumulative index, and cumulative + 1 +
+// i for each bit i set in its bitmap, least significant bit first. A record
+// with cumulative index PACKED_FRAGMENT_INDEX acknowledges the DataPacked
+// packet with that message_id instead and has no bitmap length or bitmap.
+#define ACK_RECORDS_OFFSET 2
+#define ACK_RECORDS_SIZE (PACKET_SIZE - ACK_RECORDS_OFFSET)
+// Message id, cumulative index and bitmap length
+#define ACK_RECORD_HEADER_SIZE 3
+#define ACK_RECORD_PACKED_SIZE 2
+// A bitmap covering every fragment after the first
+#define ACK_MAX_BITMAP_SIZE ((MAX_FRAGMENTS_PER_FRAME - 1 + 7) / 8)
+static_assert(ACK_RECORD_HEADER_SIZE + ACK_MAX_BITMAP_SIZE <= ACK_RECORDS_SIZE, "An ack record must fit in a DataAck packet");
+
+// The fragment_index byte of a DataParity packet. The packet covers the
+// middle fragments group_index * group_size to group_index * group_size +
+// group_size - 1 of its frame, the group size is 2, 4, 8 or 16.
+#define PARITY_GROUP_SIZE_SHIFT 6
+#define PARITY_GROUP_INDEX_MASK 0x3F
+#define MIN_PARITY_GROUP_SIZE 2
+#define MAX_PARITY_GROUP_SIZE 16
+static_assert((MAX_FRAGMENTS_PER_FRAME - 2) / MIN_PARITY_GROUP_SIZE <= PARITY_GROUP_INDEX_MASK,
+              "Parity group index must fit in PARITY_GROUP_INDEX_MASK");
+
 enum class PacketType
 {
     Discovery,
     DiscoverResponse,
     NodeIdAnnouncement,
     Data,
+    // Acknowledges fragments of frames, see ACK_RECORDS_OFFSET
     DataAck,
     Status,
     TimeSynch,
     TimeSynchAck,
+    // A middle fragment with the compact header
+    DataFragment,
+    // Short frames and tails of long ones sharing a packet, with the compact header
+    DataPacked,
+    // The XOR of the bytes after the compact header of a group of middle fragments
+    DataParity,
+    // The fragment loss a receiver observed, for its peer to size parity groups
+    FecReport,
 };
 
 union DataPacket
@@ -34,29 +126,70 @@ union DataPacket
     {
         uint8_t checksum : PACKET_CHECKSUM_SIZE_BITS;
         uint8_t packet_type : PACKET_TYPE_SIZE_BITS;
+        // Picked by the sender per frame, all fragments of a frame share it
+        uint8_t message_id;
+        // The position of the fragment in its frame, the payload starts at
+        // fragment_index * PACKET_PAYLOAD_SIZE, or COMPACT_PACKET_PAYLOAD_SIZE
+        // in compact frames
+        uint8_t fragment_index;
+        // Not sent in DataFragment packets
         uint8_t valid_bytes : PACKET_VALID_BYTES_BITS;
         bool final_packet : FINAL_PACKET_SIZE_BITS;
-        uint8_t padding : 2;
-        uint8_t number;
+        // Set on the final fragment of a frame whose middle fragments are compact
+        bool compact_frame : 1;
+        uint8_t padding : 1;
         uint8_t payload[PACKET_PAYLOAD_SIZE];
     };
+    // The layout of DataFragment and DataPacked packets. A DataPacked packet
+    // has fragment_index PACKED_FRAGMENT_INDEX and a message_id from a
+    // sequence of its own, so it is acknowledged like a fragment without
+    // using up frame ids. Its payload holds records, each led by a
+    // PACKED_RECORD_* byte, up to a zero byte or the end of the packet.
+    // DataParity packets use it too, with the PARITY_GROUP_* fields in
+    // fragment_index. A FecReport carries the fraction of fragments lost, in
+    // 256ths, in its first payload byte.
+    struct
+    {
+        uint8_t compact_header[COMPACT_PACKET_HEADER_SIZE];
+        uint8_t compact_payload[COMPACT_PACKET_PAYLOAD_SIZE];
+    };
     uint8_t raw_data[PACKET_SIZE];
 };
 static_assert(sizeof(DataPacket) == PACKET_SIZE, "DataPacket size must be 32 bytes");
 
-// Converts vector to DataPacket
-inline DataPacket VectorToDataPacket(const std::vector<uint8_t> &data)
+// Views a 32 byte packet buffer as a DataPacket.
+inline DataPacket &AsDataPacket(PacketBuffer &buffer)
 {
-    CHECK(data.size() == PACKET_SIZE, "Data size must be 32 bytes");
-    DataPacket packet;
-    std::copy(data.begin(), data.end(), packet.raw_data);
-    return packet;
+    CHECK(buffer.size() == PACKET_SIZE, "Data size must be 32 bytes");
+    return *reinterpret_cast<DataPacket *>(buffer.data());
 }
-// Converts DataPacket to vector
-inline std::vector<uint8_t> DataPacketToVector(const DataPacket &packet)
+inline const DataPacket &AsDataPacket(const PacketBuffer &buffer)
+{
+    CHECK(buffer.size() == PACKET_SIZE, "Data size must be 32 bytes");
+    return *reinterpret_cast<const DataPacket *>(buffer.data());
+}
+// Copies a DataPacket into a pooled packet buffer.
+inline PacketBuffer DataPacketToBuffer(const DataPacket &packet)
+{
+    return PacketBuffer::CopyFrom(packet.raw_data, PACKET_SIZE);
+}
+
+// The largest frame of at most `max_size` bytes whose fragments are all full,
+// `stride` being the payload of its middle fragments.
+inline size_t FullFragmentFrameSize(size_t max_size, size_t stride)
+{
+    if (max_size <= PACKET_PAYLOAD_SIZE)
+    {
+        return max_size;
+    }
+    return PACKET_PAYLOAD_SIZE + (max_size - PACKET_PAYLOAD_SIZE) / stride * stride;
+}
+
+// Whether a packet type carries a fragment of a frame.
+inline bool IsDataFragmentType(uint8_t packet_type)
 {
-    std::vector<uint8_t> data(PACKET_SIZE);
-    std::copy(packet.raw_data, packet.raw_data + PACKET_SIZE, data.begin());
-    return data;
+    return packet_type == static_cast<uint8_t>(PacketType::Data) ||
+           packet_type == static_cast<uint8_t>(PacketType::DataFragment) ||
+           packet_type == static_cast<uint8_t>(PacketType::DataPacked);
 }
 #endif // MESSAGE_DEFINITIONS_H
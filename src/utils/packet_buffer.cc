@@ -0,0 +1,269 @@
+#include "packet_buffer.h"
+
+#include <cstring>
+#include <new>
+#include "log.h"
+#include "memory_budget.h"
+
+namespace
+{
+    // Blocks for radio packets and other small control messages.
+    constexpr size_t kSmallBlockSize = 64;
+
+    // Blocks for whole tunnel frames.
+    constexpr size_t kFrameBlockSize = PACKET_BUFFER_MAX_FRAME_SIZE + PACKET_BUFFER_HEADROOM;
+
+    // The fraction of the MemoryBudget only small blocks may take. Acks,
+    // fragments and feedback live in them, so a burst of frames filling the
+    // budget would otherwise stall the link for good.
+    constexpr size_t kSmallPoolShareDivisor = 8;
+
+    std::atomic<uint64_t> heap_allocations{0};
+}
+
+PacketBufferPool::PacketBufferPool(size_t block_size, const PacketBufferPool *reserved_for)
+    : block_size_(block_size), reserved_for_(reserved_for)
+{
+}
+
+PacketBufferPool::~PacketBufferPool()
+{
+    while (free_list_)
+    {
+        Block *block = free_list_;
+        free_list_ = block->next_free;
+        block->~Block();
+        ::operator delete(block);
+        MemoryBudget::Release(sizeof(Block) + block_size_);
+        heap_bytes_.fetch_sub(sizeof(Block) + block_size_, std::memory_order_relaxed);
+    }
+}
+
+PacketBufferPool &PacketBufferPool::ForSize(size_t size)
+{
+    static PacketBufferPool small_pool(kSmallBlockSize);
+    static PacketBufferPool frame_pool(kFrameBlockSize, &small_pool);
+    if (size + PACKET_BUFFER_HEADROOM <= small_pool.block_size())
+    {
+        return small_pool;
+    }
+    CHECK(size + PACKET_BUFFER_HEADROOM <= frame_pool.block_size(),
+          "Packet buffer of %zu bytes is too large", size);
+    return frame_pool;
+}
+
+uint64_t PacketBufferPool::HeapAllocations()
+{
+    return heap_allocations.load(std::memory_order_relaxed);
+}
+
+size_t PacketBufferPool::UnusedShare() const
+{
+    size_t share = MemoryBudget::Limit() / kSmallPoolShareDivisor;
+    size_t taken = heap_bytes_.load(std::memory_order_relaxed);
+    return taken < share ? share - taken : 0;
+}
+
+PacketBufferPool::Block *PacketBufferPool::Acquire()
+{
+    Block *block = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_list_)
+        {
+            block = free_list_;
+            free_list_ = block->next_free;
+        }
+    }
+
+    if (!block)
+    {
+        size_t keep_free = reserved_for_ ? reserved_for_->UnusedShare() : 0;
+        if (!MemoryBudget::TryReserve(sizeof(Block) + block_size_, keep_free))
+        {
+            return nullptr;
+        }
+        heap_bytes_.fetch_add(sizeof(Block) + block_size_, std::memory_order_relaxed);
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        block = new (::operator new(sizeof(Block) + block_size_)) Block;
+        block->pool = this;
+    }
+
+    block->references.store(1, std::memory_order_relaxed);
+    block->next_free = nullptr;
+    return block;
+}
+
+void PacketBufferPool::Release(Block *block)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    block->next_free = free_list_;
+    free_list_ = block;
+    if (release_callback_)
+    {
+        // Under the lock, so CancelNotifyOnRelease can't return while it runs
+        release_callback_(release_context_);
+        release_callback_ = nullptr;
+    }
+}
+
+bool PacketBufferPool::NotifyOnRelease(void (*callback)(void *context), void *context)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_list_)
+    {
+        return false;
+    }
+    release_callback_ = callback;
+    release_context_ = context;
+    return true;
+}
+
+void PacketBufferPool::CancelNotifyOnRelease()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    release_callback_ = nullptr;
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer &other)
+    : block_(other.block_), offset_(other.offset_), size_(other.size_),
+      trace_start_us_(other.trace_start_us_), source_(other.source_), traffic_class_(other.traffic_class_)
+{
+    if (block_)
+    {
+        block_->references.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer &&other) noexcept
+    : block_(other.block_), offset_(other.offset_), size_(other.size_),
+      trace_start_us_(other.trace_start_us_), source_(other.source_), traffic_class_(other.traffic_class_)
+{
+    other.block_ = nullptr;
+    other.offset_ = 0;
+    other.size_ = 0;
+    other.trace_start_us_ = 0;
+    other.source_ = 0;
+    other.traffic_class_ = TrafficClass::Reliable;
+}
+
+PacketBuffer &PacketBuffer::operator=(const PacketBuffer &other)
+{
+    if (this != &other)
+    {
+        PacketBuffer copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+PacketBuffer &PacketBuffer::operator=(PacketBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+        block_ = other.block_;
+        offset_ = other.offset_;
+        size_ = other.size_;
+        trace_start_us_ = other.trace_start_us_;
+        source_ = other.source_;
+        traffic_class_ = other.traffic_class_;
+        other.block_ = nullptr;
+        other.offset_ = 0;
+        other.size_ = 0;
+        other.trace_start_us_ = 0;
+        other.source_ = 0;
+        other.traffic_class_ = TrafficClass::Reliable;
+    }
+    return *this;
+}
+
+PacketBuffer::~PacketBuffer()
+{
+    Release();
+}
+
+PacketBuffer PacketBuffer::Allocate(size_t size)
+{
+    PacketBufferPool::Block *block = PacketBufferPool::ForSize(size).Acquire();
+    if (!block)
+    {
+        return PacketBuffer();
+    }
+    return PacketBuffer(block, PACKET_BUFFER_HEADROOM, size);
+}
+
+PacketBuffer PacketBuffer::CopyFrom(const uint8_t *data, size_t size)
+{
+    PacketBuffer buffer = Allocate(size);
+    if (!buffer.valid())
+    {
+        return buffer;
+    }
+    std::memcpy(buffer.data(), data, size);
+    return buffer;
+}
+
+size_t PacketBuffer::tailroom() const
+{
+    return block_ ? block_->pool->block_size() - offset_ - size_ : 0;
+}
+
+uint8_t *PacketBuffer::Prepend(size_t length)
+{
+    CHECK(length <= headroom(), "Not enough headroom to prepend %zu bytes", length);
+    CHECK(!IsShared(), "Cannot prepend to a shared packet buffer");
+    offset_ -= length;
+    size_ += length;
+    return data();
+}
+
+uint8_t *PacketBuffer::Append(size_t length)
+{
+    CHECK(length <= tailroom(), "Not enough tailroom to append %zu bytes", length);
+    CHECK(!IsShared(), "Cannot append to a shared packet buffer");
+    uint8_t *tail = data() + size_;
+    size_ += length;
+    return tail;
+}
+
+void PacketBuffer::TrimFront(size_t length)
+{
+    CHECK(length <= size_, "Cannot trim %zu bytes from a %u byte buffer", length, size_);
+    offset_ += length;
+    size_ -= length;
+}
+
+void PacketBuffer::TrimBack(size_t length)
+{
+    CHECK(length <= size_, "Cannot trim %zu bytes from a %u byte buffer", length, size_);
+    size_ -= length;
+}
+
+PacketBuffer PacketBuffer::Slice(size_t offset, size_t length) const
+{
+    CHECK(offset + length <= size_, "Slice [%zu, %zu) is out of bounds", offset, offset + length);
+    PacketBuffer slice(*this);
+    slice.offset_ += offset;
+    slice.size_ = length;
+    return slice;
+}
+
+bool PacketBuffer::IsShared() const
+{
+    return block_ && block_->references.load(std::memory_order_acquire) > 1;
+}
+
+void PacketBuffer::Release()
+{
+    if (block_ && block_->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        block_->pool->Release(block_);
+    }
+    block_ = nullptr;
+    offset_ = 0;
+    size_ = 0;
+    trace_start_us_ = 0;
+    source_ = 0;
+    traffic_class_ = TrafficClass::Reliable;
+}
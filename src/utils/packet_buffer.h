@@ -0,0 +1,169 @@
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// The number of bytes reserved in front of every packet buffer so layers can
+// prepend headers without copying the payload.
+#define PACKET_BUFFER_HEADROOM 16
+
+// The largest frame that is ever read from the tunnel.
+#define PACKET_BUFFER_MAX_FRAME_SIZE 3200
+
+class PacketBuffer;
+
+// How hard the ack layer tries to deliver a frame, chosen by the tunnel from
+// its IP header. Ordered from the most reliable.
+enum class TrafficClass : uint8_t
+{
+    // Retransmitted up to the configured limit, TCP and anything unrecognised
+    Reliable,
+    // A few retransmits, for UDP and ICMP that retry or give up on their own
+    BoundedRetries,
+    // Retransmitted until a deadline, voice and video marked by DSCP
+    RealTime,
+};
+
+// A free list of fixed size, reference counted blocks. Blocks are only taken
+// from the heap when the free list is empty and are never returned to it, so
+// after warm up a steady flow of packets does not touch the allocator. Every
+// block counts against the MemoryBudget.
+class PacketBufferPool
+{
+public:
+    // A pool that yields to `reserved_for` leaves it the part of its share of
+    // the MemoryBudget it has not taken yet, see UnusedShare.
+    explicit PacketBufferPool(size_t block_size, const PacketBufferPool *reserved_for = nullptr);
+    ~PacketBufferPool();
+
+    PacketBufferPool(const PacketBufferPool &) = delete;
+    PacketBufferPool &operator=(const PacketBufferPool &) = delete;
+
+    // Returns the pool that serves buffers of at least `size` bytes.
+    static PacketBufferPool &ForSize(size_t size);
+
+    // Returns the number of blocks every pool has taken from the heap.
+    static uint64_t HeapAllocations();
+
+    size_t block_size() const { return block_size_; }
+
+    // Calls `callback(context)` when the next block comes back, so a thread
+    // that failed to allocate can sleep until it may succeed. Returns false
+    // without registering if a block is free already. A pool has one waiter,
+    // a new one replaces it.
+    bool NotifyOnRelease(void (*callback)(void *context), void *context);
+    // Drops the waiter, no callback runs once this returns.
+    void CancelNotifyOnRelease();
+
+private:
+    friend class PacketBuffer;
+
+    struct Block
+    {
+        std::atomic<uint32_t> references;
+        PacketBufferPool *pool;
+        Block *next_free;
+
+        uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+    };
+
+    // Returns nullptr if a new block would exceed the MemoryBudget.
+    Block *Acquire();
+    void Release(Block *block);
+
+    // The bytes of the MemoryBudget set aside for this pool that it has not
+    // taken yet.
+    size_t UnusedShare() const;
+
+    const size_t block_size_;
+    const PacketBufferPool *const reserved_for_;
+    // The bytes of the MemoryBudget this pool's blocks take
+    std::atomic<size_t> heap_bytes_{0};
+
+    std::mutex mutex_;
+    Block *free_list_ = nullptr;
+    // Called once by the next Release, see NotifyOnRelease
+    void (*release_callback_)(void *context) = nullptr;
+    void *release_context_ = nullptr;
+};
+
+// A reference counted view into a pooled block. Copying a buffer shares the
+// block, moving it hands it over. Slices share the block of the buffer they
+// were taken from, so only the owner of an unshared buffer may write to it.
+class PacketBuffer
+{
+public:
+    PacketBuffer() = default;
+    PacketBuffer(const PacketBuffer &other);
+    PacketBuffer(PacketBuffer &&other) noexcept;
+    PacketBuffer &operator=(const PacketBuffer &other);
+    PacketBuffer &operator=(PacketBuffer &&other) noexcept;
+    ~PacketBuffer();
+
+    // Allocates a buffer of `size` bytes with PACKET_BUFFER_HEADROOM bytes of
+    // headroom in front of it. Returns an invalid buffer if the pool is empty
+    // and the MemoryBudget has no room for another block.
+    static PacketBuffer Allocate(size_t size);
+
+    // Allocates a buffer and copies `size` bytes from `data` into it, or
+    // returns an invalid buffer like Allocate.
+    static PacketBuffer CopyFrom(const uint8_t *data, size_t size);
+
+    uint8_t *data() { return block_->data() + offset_; }
+    const uint8_t *data() const { return block_->data() + offset_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool valid() const { return block_ != nullptr; }
+
+    // The free space in front of and behind the data.
+    size_t headroom() const { return offset_; }
+    size_t tailroom() const;
+
+    // Grows the buffer into its headroom/tailroom and returns a pointer to the
+    // new bytes.
+    uint8_t *Prepend(size_t length);
+    uint8_t *Append(size_t length);
+
+    // Shrinks the buffer from the front/back.
+    void TrimFront(size_t length);
+    void TrimBack(size_t length);
+
+    // Returns a view of `length` bytes starting at `offset` that shares this
+    // buffer's block.
+    PacketBuffer Slice(size_t offset, size_t length) const;
+
+    // Returns true if more than one buffer references the block.
+    bool IsShared() const;
+
+    // The TimeNowUs() value latency tracing measures this packet from, zero if
+    // the packet is not traced. Copies and slices keep it.
+    uint64_t trace_start_us() const { return trace_start_us_; }
+    void set_trace_start_us(uint64_t trace_start_us) { trace_start_us_ = trace_start_us; }
+
+    // Identifies the neighbour a received packet came from, set by the radio
+    // layer. Copies and slices keep it.
+    uint8_t source() const { return source_; }
+    void set_source(uint8_t source) { source_ = source; }
+
+    // Set by the tunnel for frames going out, copies and slices keep it.
+    TrafficClass traffic_class() const { return traffic_class_; }
+    void set_traffic_class(TrafficClass traffic_class) { traffic_class_ = traffic_class; }
+
+private:
+    PacketBuffer(PacketBufferPool::Block *block, uint32_t offset, uint32_t size)
+        : block_(block), offset_(offset), size_(size) {}
+
+    void Release();
+
+    PacketBufferPool::Block *block_ = nullptr;
+    uint32_t offset_ = 0;
+    uint32_t size_ = 0;
+    uint64_t trace_start_us_ = 0;
+    uint8_t source_ = 0;
+    TrafficClass traffic_class_ = TrafficClass::Reliable;
+};
+
+#endif // PACKET_BUFFER_H
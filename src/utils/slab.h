@@ -0,0 +1,213 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include "log.h"
+#include "memory_budget.h"
+
+// The cache line size of the boards we run on.
+#define SLAB_CACHE_LINE_SIZE 64
+
+// A fixed number of cache line aligned slots for objects of type T, taken
+// from the heap in one piece when the slab is created. New and Delete only
+// move slots on and off a free list, and New returns nullptr once every slot
+// is in use rather than growing.
+template <typename T>
+class Slab
+{
+public:
+    explicit Slab(size_t capacity)
+        : capacity_(capacity)
+    {
+        CHECK(MemoryBudget::TryReserve(capacity_ * sizeof(Slot)),
+              "Memory limit of %zu bytes is too small for a slab of %zu %zu byte slots",
+              MemoryBudget::Limit(), capacity_, sizeof(Slot));
+        slots_ = static_cast<Slot *>(::operator new(capacity_ * sizeof(Slot), std::align_val_t(alignof(Slot))));
+        for (size_t i = 0; i < capacity_; ++i)
+        {
+            slots_[i].next_free = i + 1 < capacity_ ? &slots_[i + 1] : nullptr;
+        }
+        free_list_ = capacity_ ? &slots_[0] : nullptr;
+    }
+
+    ~Slab()
+    {
+        CHECK(size_ == 0, "Slab destroyed with %zu objects still in use", size_);
+        ::operator delete(slots_, std::align_val_t(alignof(Slot)));
+        MemoryBudget::Release(capacity_ * sizeof(Slot));
+    }
+
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    // Constructs an object in a free slot, returns nullptr if the slab is full.
+    template <typename... Args>
+    T *New(Args &&...args)
+    {
+        if (!free_list_)
+        {
+            return nullptr;
+        }
+        Slot *slot = free_list_;
+        free_list_ = slot->next_free;
+        ++size_;
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void Delete(T *object)
+    {
+        object->~T();
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        slot->next_free = free_list_;
+        free_list_ = slot;
+        --size_;
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool full() const { return free_list_ == nullptr; }
+
+private:
+    union alignas(SLAB_CACHE_LINE_SIZE) Slot
+    {
+        Slot *next_free;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    const size_t capacity_;
+    Slot *slots_ = nullptr;
+    Slot *free_list_ = nullptr;
+    size_t size_ = 0;
+};
+
+// A FIFO of objects linked through their own `T *next` member, so queueing
+// never allocates. The queue does not own its objects; whoever allocated an
+// object frees it once it is popped or removed.
+template <typename T>
+class IntrusiveQueue
+{
+public:
+    IntrusiveQueue() = default;
+    IntrusiveQueue(const IntrusiveQueue &) = delete;
+    IntrusiveQueue &operator=(const IntrusiveQueue &) = delete;
+
+    void PushBack(T *object)
+    {
+        object->next = nullptr;
+        if (tail_)
+        {
+            tail_->next = object;
+        }
+        else
+        {
+            head_ = object;
+        }
+        tail_ = object;
+        ++size_;
+    }
+
+    // Returns nullptr if the queue is empty.
+    T *PopFront()
+    {
+        T *object = head_;
+        if (object)
+        {
+            head_ = object->next;
+            if (!head_)
+            {
+                tail_ = nullptr;
+            }
+            object->next = nullptr;
+            --size_;
+        }
+        return object;
+    }
+
+    T *Front() const { return head_; }
+    static T *Next(const T *object) { return object->next; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return head_ == nullptr; }
+
+private:
+    T *head_ = nullptr;
+    T *tail_ = nullptr;
+    size_t size_ = 0;
+};
+
+// An IntrusiveQueue that also links objects back through a `T *prev`
+// member, so an object is removed from anywhere in it in constant time.
+template <typename T>
+class IntrusiveList
+{
+public:
+    IntrusiveList() = default;
+    IntrusiveList(const IntrusiveList &) = delete;
+    IntrusiveList &operator=(const IntrusiveList &) = delete;
+
+    void PushBack(T *object)
+    {
+        object->next = nullptr;
+        object->prev = tail_;
+        if (tail_)
+        {
+            tail_->next = object;
+        }
+        else
+        {
+            head_ = object;
+        }
+        tail_ = object;
+        ++size_;
+    }
+
+    // Returns nullptr if the list is empty.
+    T *PopFront()
+    {
+        T *object = head_;
+        if (object)
+        {
+            Remove(object);
+        }
+        return object;
+    }
+
+    // Unlinks an object that is in the list.
+    void Remove(T *object)
+    {
+        if (object->prev)
+        {
+            object->prev->next = object->next;
+        }
+        else
+        {
+            head_ = object->next;
+        }
+        if (object->next)
+        {
+            object->next->prev = object->prev;
+        }
+        else
+        {
+            tail_ = object->prev;
+        }
+        object->next = nullptr;
+        object->prev = nullptr;
+        --size_;
+    }
+
+    T *Front() const { return head_; }
+    static T *Next(const T *object) { return object->next; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return head_ == nullptr; }
+
+private:
+    T *head_ = nullptr;
+    T *tail_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // SLAB_H
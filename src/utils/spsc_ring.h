@@ -0,0 +1,94 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// A bounded, lock-free ring for exactly one producer thread and one consumer
+// thread. The slots are allocated up front with the ring; pushing and popping
+// only move elements in and out of them.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer side. Returns false and leaves `value` untouched if the ring is full.
+    bool TryPush(T &&value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        slots_[tail & (Capacity - 1)] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool TryPop(T &value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = std::move(slots_[head & (Capacity - 1)]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns the oldest element without removing it, or
+    // nullptr if the ring is empty.
+    T *Front()
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &slots_[head & (Capacity - 1)];
+    }
+
+    const T *Front() const
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &slots_[head & (Capacity - 1)];
+    }
+
+    // Approximate when called from a thread that is neither end of the ring.
+    size_t Size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    bool Full() const
+    {
+        return Size() == Capacity;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+
+private:
+    // Kept on separate cache lines so the two threads don't share one.
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::array<T, Capacity> slots_;
+};
+
+#endif // SPSC_RING_H
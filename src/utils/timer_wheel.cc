@@ -0,0 +1,233 @@
+#include "timer_wheel.h"
+
+#include "nrftime.h"
+
+namespace nerfnet
+{
+
+    TimerWheel::TimerWheel()
+    {
+        for (auto &level : slots_)
+        {
+            for (Timer &head : level)
+            {
+                InitList(&head);
+            }
+        }
+        InitList(&expired_);
+        current_tick_ = TimeNowUs() >> kTickShift;
+    }
+
+    TimerWheel::~TimerWheel()
+    {
+        auto clear = [](Timer &head)
+        {
+            while (head.next_ != &head)
+            {
+                Unlink(head.next_);
+            }
+        };
+        for (auto &level : slots_)
+        {
+            for (Timer &head : level)
+            {
+                clear(head);
+            }
+        }
+        clear(expired_);
+    }
+
+    void TimerWheel::Schedule(Timer *timer, uint64_t deadline_us)
+    {
+        Cancel(timer);
+        timer->deadline_us_ = deadline_us;
+        Insert(timer);
+        size_++;
+    }
+
+    void TimerWheel::Cancel(Timer *timer)
+    {
+        if (!timer->scheduled())
+        {
+            return;
+        }
+        Unlink(timer);
+        size_--;
+        if (timer->level_ < kLevels)
+        {
+            Timer &head = slots_[timer->level_][timer->slot_];
+            if (head.next_ == &head)
+            {
+                occupied_[timer->level_] &= ~(1ULL << timer->slot_);
+            }
+        }
+    }
+
+    void TimerWheel::Advance(uint64_t now_us)
+    {
+        uint64_t target = now_us >> kTickShift;
+        // Straight to the next tick with anything to do, the ticks between hold nothing
+        while (current_tick_ < target)
+        {
+            uint64_t tick = NextTick();
+            if (tick > target)
+            {
+                current_tick_ = target;
+                break;
+            }
+            current_tick_ = tick;
+            for (size_t level = kLevels - 1; level > 0; level--)
+            {
+                uint32_t shift = level * kSlotBits;
+                if ((current_tick_ & ((1ULL << shift) - 1)) == 0)
+                {
+                    Cascade(level, (current_tick_ >> shift) & (kSlots - 1));
+                }
+            }
+            size_t slot = current_tick_ & (kSlots - 1);
+            Timer &head = slots_[0][slot];
+            while (head.next_ != &head)
+            {
+                Timer *timer = head.next_;
+                Unlink(timer);
+                timer->level_ = kExpiredLevel;
+                PushBack(&expired_, timer);
+            }
+            occupied_[0] &= ~(1ULL << slot);
+        }
+
+        // Timers the callbacks schedule for now fire on the next call
+        Timer fired;
+        InitList(&fired);
+        if (expired_.next_ != &expired_)
+        {
+            fired.next_ = expired_.next_;
+            fired.prev_ = expired_.prev_;
+            fired.next_->prev_ = &fired;
+            fired.prev_->next_ = &fired;
+            InitList(&expired_);
+        }
+        while (fired.next_ != &fired)
+        {
+            Timer *timer = fired.next_;
+            Unlink(timer);
+            size_--;
+            timer->callback(timer, timer->context);
+        }
+    }
+
+    uint64_t TimerWheel::NextDeadlineUs() const
+    {
+        if (expired_.next_ != &expired_)
+        {
+            return current_tick_ << kTickShift;
+        }
+        uint64_t tick = NextTick();
+        return tick == kNoTick ? UINT64_MAX : tick << kTickShift;
+    }
+
+    void TimerWheel::Insert(Timer *timer)
+    {
+        uint64_t tick = timer->deadline_us_ >> kTickShift;
+        if ((tick << kTickShift) != timer->deadline_us_)
+        {
+            tick++;
+        }
+        if (tick <= current_tick_)
+        {
+            timer->level_ = kExpiredLevel;
+            PushBack(&expired_, timer);
+            return;
+        }
+        // The level of the highest slot digit the tick differs from the
+        // current one in, so it lies ahead of the current slot of that level
+        size_t level = (63 - __builtin_clzll(tick ^ current_tick_)) / kSlotBits;
+        size_t slot;
+        if (level < kLevels - 1)
+        {
+            slot = (tick >> (level * kSlotBits)) & (kSlots - 1);
+        }
+        else
+        {
+            // The top level wraps around. A tick beyond a whole turn of it
+            // waits a turn in the current slot and is inserted again.
+            uint32_t shift = (kLevels - 1) * kSlotBits;
+            level = kLevels - 1;
+            uint64_t top_tick = tick - current_tick_ < (kSlots << shift) ? tick : current_tick_;
+            slot = (top_tick >> shift) & (kSlots - 1);
+        }
+        timer->level_ = static_cast<uint8_t>(level);
+        timer->slot_ = static_cast<uint8_t>(slot);
+        PushBack(&slots_[level][slot], timer);
+        occupied_[level] |= 1ULL << slot;
+    }
+
+    void TimerWheel::InitList(Timer *head)
+    {
+        head->next_ = head;
+        head->prev_ = head;
+    }
+
+    void TimerWheel::PushBack(Timer *list, Timer *timer)
+    {
+        timer->prev_ = list->prev_;
+        timer->next_ = list;
+        list->prev_->next_ = timer;
+        list->prev_ = timer;
+    }
+
+    void TimerWheel::Unlink(Timer *timer)
+    {
+        timer->prev_->next_ = timer->next_;
+        timer->next_->prev_ = timer->prev_;
+        timer->next_ = nullptr;
+        timer->prev_ = nullptr;
+    }
+
+    void TimerWheel::Cascade(size_t level, size_t slot)
+    {
+        Timer &head = slots_[level][slot];
+        occupied_[level] &= ~(1ULL << slot);
+        // Only a timer a whole turn of the top level away goes back in the
+        // slot it came from
+        Timer *last = head.prev_;
+        while (head.next_ != &head)
+        {
+            Timer *timer = head.next_;
+            Unlink(timer);
+            Insert(timer);
+            if (timer == last)
+            {
+                break;
+            }
+        }
+    }
+
+    uint64_t TimerWheel::NextTick() const
+    {
+        for (size_t level = 0; level < kLevels - 1; level++)
+        {
+            uint32_t shift = level * kSlotBits;
+            size_t position = (current_tick_ >> shift) & (kSlots - 1);
+            uint64_t ahead = position == kSlots - 1 ? 0 : occupied_[level] & (~0ULL << (position + 1));
+            if (ahead)
+            {
+                uint64_t turn = current_tick_ >> (shift + kSlotBits) << (shift + kSlotBits);
+                return turn | (static_cast<uint64_t>(__builtin_ctzll(ahead)) << shift);
+            }
+        }
+        uint64_t top = occupied_[kLevels - 1];
+        if (top)
+        {
+            // The first occupied slot after the current one, going round
+            uint32_t shift = (kLevels - 1) * kSlotBits;
+            size_t position = (current_tick_ >> shift) & (kSlots - 1);
+            size_t rotate = (position + 1) & (kSlots - 1);
+            uint64_t ahead = rotate ? (top >> rotate) | (top << (kSlots - rotate)) : top;
+            uint64_t distance = __builtin_ctzll(ahead) + 1;
+            return ((current_tick_ >> shift) + distance) << shift;
+        }
+        return kNoTick;
+    }
+
+} // namespace nerfnet
@@ -0,0 +1,99 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// Deadlines of any number of timers, sorted into slots by the tick they expire
+// at. Scheduling and cancelling a timer take constant time, and so does
+// finding the next deadline: level 0 has a slot per tick for the current turn
+// of 64 ticks, each level above a slot per turn of the one below. Timers move
+// down a level when the wheel reaches their slot, so each one is moved at most
+// kLevels times before it fires.
+//
+// Deadlines are rounded up to whole ticks, a timer never fires early.
+class TimerWheel
+{
+public:
+    // The resolution of the wheel, 256us
+    static constexpr uint32_t kTickShift = 8;
+    static constexpr size_t kLevels = 4;
+
+    // Embedded in whatever the timer is for. The wheel links timers through
+    // their own pointers, so a scheduled timer must not be moved or copied.
+    struct Timer
+    {
+        // Called from Advance once the deadline passed, the timer is no longer
+        // scheduled by then and may be scheduled again
+        void (*callback)(Timer *timer, void *context) = nullptr;
+        void *context = nullptr;
+
+        bool scheduled() const { return prev_ != nullptr; }
+        uint64_t deadline_us() const { return deadline_us_; }
+
+    private:
+        friend class TimerWheel;
+        uint64_t deadline_us_ = 0;
+        Timer *next_ = nullptr;
+        Timer *prev_ = nullptr;
+        uint8_t level_ = 0;
+        uint8_t slot_ = 0;
+    };
+
+    TimerWheel();
+    // Timers still scheduled are left unscheduled, their owners may outlive the wheel
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Schedules a timer for an absolute TimeNowUs() deadline, moving it if it
+    // was scheduled already
+    void Schedule(Timer *timer, uint64_t deadline_us);
+
+    // Unschedules a timer, nothing happens if it is not scheduled
+    void Cancel(Timer *timer);
+
+    // Fires every timer whose deadline is at or before now_us
+    void Advance(uint64_t now_us);
+
+    // The TimeNowUs() value Advance has to be called at next, UINT64_MAX if
+    // no timer is scheduled. Earlier than any deadline while the earliest
+    // timers wait on a level above 0.
+    uint64_t NextDeadlineUs() const;
+
+    size_t size() const { return size_; }
+
+private:
+    static constexpr uint32_t kSlotBits = 6;
+    static constexpr size_t kSlots = 1 << kSlotBits;
+    // The level_ of timers in expired_
+    static constexpr uint8_t kExpiredLevel = kLevels;
+    static constexpr uint64_t kNoTick = UINT64_MAX;
+
+    // Links a timer into the slot for its deadline, or into expired_
+    void Insert(Timer *timer);
+    static void InitList(Timer *head);
+    static void PushBack(Timer *list, Timer *timer);
+    static void Unlink(Timer *timer);
+    // Moves the timers of a slot to the levels below
+    void Cascade(size_t level, size_t slot);
+    // The tick the wheel has to reach next to fire or cascade a timer
+    uint64_t NextTick() const;
+
+    // The slot lists, each a ring through the slot's own head
+    Timer slots_[kLevels][kSlots];
+    // A bit per slot that holds timers
+    uint64_t occupied_[kLevels] = {};
+    // Timers due on the next Advance
+    Timer expired_;
+    // Every tick up to and including this one has been handled
+    uint64_t current_tick_ = 0;
+    size_t size_ = 0;
+};
+
+}  // namespace nerfnet
+
+#endif // TIMER_WHEEL_H